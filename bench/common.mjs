@@ -0,0 +1,163 @@
+/*
+ * Shared pieces of the benchmark tools, modelled on libzmq's perf/ programs:
+ * a "local" side that binds and a "remote" side that connects, for either
+ * throughput (PUSH/PULL) or round-trip latency (REQ/REP).
+ *
+ * Message paths being compared:
+ *   raw      createSocket + sendSocket/recvBuffer, one native call per message
+ *   batched  createSocket + sendMany/recvBatch
+ *   zsock    czmq sockets through zsock_send/zsock_recv (string frames)
+ */
+import * as zmq from '../quickjs-zmq.so'
+import * as os from 'os';
+import * as std from 'std';
+
+const ZMQ_REQ=3
+const ZMQ_REP=4
+const ZMQ_PULL=7
+const ZMQ_PUSH=8
+const ZMQ_POLLIN=1
+const ZMQ_POLLOUT=2
+
+// Wall clock in microseconds.
+export const now = os.now ? () => os.now() : () => Date.now() * 1000;
+
+export const paths = ["raw", "batched", "zsock"];
+
+function open(path, type) {
+    return path == "zsock" ? zmq.zsock_new(type) : zmq.createSocket(zmq.sharedContext(), type);
+}
+
+function bind(path, sock, endpoint) {
+    var rc = path == "zsock" ? zmq.zsock_bind(sock, endpoint) : zmq.bindSocket(sock, endpoint);
+    if (rc < 0) throw new Error(`bind ${endpoint}: ${zmq.strerror(zmq.errno())}`);
+}
+
+function connect(path, sock, endpoint) {
+    var rc = path == "zsock" ? zmq.zsock_connect(sock, endpoint) : zmq.connectSocket(sock, endpoint);
+    if (rc < 0) throw new Error(`connect ${endpoint}: ${zmq.strerror(zmq.errno())}`);
+}
+
+function close(path, sock) {
+    // Wait for everything queued to be delivered, like zmq_close in perf/.
+    if (path == "zsock") zmq.zsock_destroy(sock, -1);
+    else zmq.closeSocket(sock, -1);
+}
+
+function payload(path, size) {
+    return path == "zsock" ? "x".repeat(size) : new ArrayBuffer(size);
+}
+
+function send(path, sock, message) {
+    var rc = path == "zsock" ? zmq.zsock_send(sock, message) : zmq.sendSocket(sock, message);
+    if (rc < 0) throw new Error(`send: ${zmq.strerror(zmq.errno())}`);
+}
+
+function recv(path, sock) {
+    return path == "zsock" ? zmq.zsock_recv(sock) : zmq.recvBuffer(sock);
+}
+
+function waitFor(sock, events) {
+    var poller = zmq.createPoller();
+    zmq.pollerAdd(poller, sock, events);
+    return () => zmq.pollerWait(poller, -1);
+}
+
+function percentile(sorted, p) {
+    return sorted[Math.min(sorted.length - 1, Math.floor(sorted.length * p))];
+}
+
+/**
+ * Receives count messages and reports throughput. The clock starts at the
+ * first message so connection setup is not measured.
+ */
+export function localThr(endpoint, path, size, count) {
+    var sock = open(path, ZMQ_PULL);
+    bind(path, sock, endpoint);
+    recv(path, sock);
+    var start = now();
+    var remaining = count - 1;
+    if (path == "batched") {
+        var wait = waitFor(sock, ZMQ_POLLIN);
+        while (remaining > 0) {
+            var batch = zmq.recvBatch(sock, Math.min(remaining, 1024), true);
+            if (batch.length == 0) wait();
+            remaining -= batch.length;
+        }
+    } else {
+        for (; remaining > 0; remaining--) recv(path, sock);
+    }
+    var elapsed = now() - start;
+    close(path, sock);
+    var messagesPerSecond = (count - 1) * 1e6 / elapsed;
+    return {
+        test: "thr", endpoint, path, size, count,
+        elapsedUs: Math.round(elapsed),
+        messagesPerSecond: Math.round(messagesPerSecond),
+        megabitsPerSecond: +(messagesPerSecond * size * 8 / 1e6).toFixed(3),
+    };
+}
+
+export function remoteThr(endpoint, path, size, count) {
+    var sock = open(path, ZMQ_PUSH);
+    connect(path, sock, endpoint);
+    var message = payload(path, size);
+    if (path == "batched") {
+        var wait = waitFor(sock, ZMQ_POLLOUT);
+        var chunk = new Array(Math.min(count, 256)).fill(message);
+        for (var remaining = count; remaining > 0;) {
+            var queued = zmq.sendMany(sock, remaining < chunk.length ? chunk.slice(0, remaining) : chunk);
+            if (queued == 0) wait();
+            remaining -= queued;
+        }
+    } else {
+        for (var i = 0; i < count; i++) send(path, sock, message);
+    }
+    close(path, sock);
+}
+
+// Echoes roundtrips messages back to remoteLat.
+export function localLat(endpoint, path, size, roundtrips) {
+    var sock = open(path, ZMQ_REP);
+    bind(path, sock, endpoint);
+    for (var i = 0; i < roundtrips; i++) send(path, sock, recv(path, sock));
+    close(path, sock);
+}
+
+/**
+ * Times every round trip individually so the tail, not just the mean that
+ * libzmq's remote_lat prints, is visible.
+ */
+export function remoteLat(endpoint, path, size, roundtrips) {
+    var sock = open(path, ZMQ_REQ);
+    connect(path, sock, endpoint);
+    var message = payload(path, size);
+    var samples = new Float64Array(roundtrips);
+    for (var i = 0; i < roundtrips; i++) {
+        var start = now();
+        send(path, sock, message);
+        recv(path, sock);
+        samples[i] = now() - start;
+    }
+    close(path, sock);
+    samples.sort();
+    var total = samples.reduce((a, b) => a + b, 0);
+    return {
+        test: "lat", endpoint, path, size, roundtrips,
+        meanUs: +(total / roundtrips).toFixed(2),
+        p50Us: +percentile(samples, 0.5).toFixed(2),
+        p99Us: +percentile(samples, 0.99).toFixed(2),
+        p999Us: +percentile(samples, 0.999).toFixed(2),
+        maxUs: +samples[roundtrips - 1].toFixed(2),
+    };
+}
+
+// Parses the <endpoint> <message-size> <count> [path] arguments of the tools.
+export function toolArgs(usage) {
+    var args = scriptArgs.slice(1);
+    if (args.length < 3) {
+        console.log(`usage: qjs ${usage} <endpoint> <message-size> <count> [raw|batched|zsock]`);
+        std.exit(1);
+    }
+    return [args[0], args[3] || "raw", parseInt(args[1]), parseInt(args[2])];
+}
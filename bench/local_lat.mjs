@@ -0,0 +1,6 @@
+/*
+ * Binds a REP socket and echoes <count> round trips from remote_lat.
+ */
+import { localLat, toolArgs } from './common.mjs';
+
+localLat(...toolArgs("bench/local_lat.mjs"));
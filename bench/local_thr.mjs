@@ -0,0 +1,6 @@
+/*
+ * Binds a PULL socket and prints the throughput of what remote_thr sends.
+ */
+import { localThr, toolArgs } from './common.mjs';
+
+console.log(JSON.stringify(localThr(...toolArgs("bench/local_thr.mjs"))));
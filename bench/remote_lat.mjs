@@ -0,0 +1,6 @@
+/*
+ * Connects a REQ socket and prints round-trip latency percentiles.
+ */
+import { remoteLat, toolArgs } from './common.mjs';
+
+console.log(JSON.stringify(remoteLat(...toolArgs("bench/remote_lat.mjs"))));
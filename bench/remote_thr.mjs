@@ -0,0 +1,6 @@
+/*
+ * Connects a PUSH socket and sends <count> messages to local_thr.
+ */
+import { remoteThr, toolArgs } from './common.mjs';
+
+remoteThr(...toolArgs("bench/remote_thr.mjs"));
@@ -0,0 +1,51 @@
+/*
+ * Replays a capture file written by Socket.setCapture onto a fresh socket,
+ * at the recorded pace, scaled by a speed factor, or as fast as possible.
+ *
+ *   qjs bench/replay.mjs <capture> <endpoint> [push|dealer|pub|pair] [original|max|<speed>] [sent|received|all] [bind]
+ *
+ * Prints what was sent and how long it took as JSON.
+ */
+import * as zmq from '../quickjs-zmq.so'
+import * as os from 'os';
+import * as std from 'std';
+import { now } from './common.mjs';
+
+const ZMQ_POLLOUT=2
+const types = {pair: 0, pub: 1, dealer: 5, push: 8};
+const directions = {sent: 0, received: 1, all: 2};
+
+var args = scriptArgs.slice(1);
+if (args.length < 2) {
+    console.log("usage: qjs bench/replay.mjs <capture> <endpoint> [push|dealer|pub|pair] [original|max|<speed>] [sent|received|all] [bind]");
+    std.exit(1);
+}
+var [file, endpoint, type="push", rate="original", direction="sent", mode="connect"] = args;
+// Capture nanoseconds that pass per wall clock microsecond.
+var speed = rate == "max" ? Infinity : 1000 * (rate == "original" ? 1 : parseFloat(rate));
+
+var capture = zmq.openCapture(file);
+var sock = zmq.createSocket(zmq.sharedContext(), types[type]);
+var rc = mode == "bind" ? zmq.bindSocket(sock, endpoint) : zmq.connectSocket(sock, endpoint);
+if (rc < 0) throw new Error(`${mode} ${endpoint}: ${zmq.strerror(zmq.errno())}`);
+
+var poller = zmq.createPoller();
+zmq.pollerAdd(poller, sock, ZMQ_POLLOUT);
+var messages = 0;
+var start = now();
+while (true) {
+    var until = speed == Infinity ? Infinity : (now() - start) * speed;
+    var step = zmq.replayCapture(capture.reader, sock, until, 1024, directions[direction]);
+    messages += step.sent;
+    if (step.next < 0) break;
+    if (step.blocked) {
+        zmq.pollerWait(poller, -1);
+    } else if (step.next > until) {
+        os.sleep(Math.max(1, (step.next - until) / speed / 1000));
+    }
+}
+var elapsed = (now() - start) / 1e6;
+zmq.closeSocket(sock, -1);
+console.log(JSON.stringify({file, endpoint, rate, messages, frames: capture.frames,
+                            captured: capture.duration / 1e9, seconds: elapsed,
+                            messagesPerSecond: messages / elapsed}));
@@ -0,0 +1,82 @@
+/*
+ * Runs the throughput and latency matrix over transports, message sizes and
+ * message paths, with the local side in a worker thread of the same process,
+ * and prints the results as one JSON document.
+ *
+ *   qjs bench/run.mjs [transports] [sizes] [paths]
+ *
+ * Each argument is a comma separated filter, e.g.
+ *   qjs bench/run.mjs tcp,ipc 16,65536 raw,batched
+ */
+import * as os from 'os';
+import { paths, remoteThr, remoteLat } from './common.mjs';
+import * as zmq from '../quickjs-zmq.so'
+
+const allTransports = ["inproc", "ipc", "tcp"];
+const allSizes = [16, 256, 4096, 65536, 1 << 20, 4 << 20];
+
+function filter(arg, all, parse=(x) => x) {
+    return arg ? arg.split(",").map(parse) : all;
+}
+
+var transports = filter(scriptArgs[1], allTransports);
+var sizes = filter(scriptArgs[2], allSizes, (x) => parseInt(x));
+var selectedPaths = filter(scriptArgs[3], paths);
+
+// Enough messages to move about 256MB, within sane bounds either way.
+function messageCount(size) {
+    return Math.max(64, Math.min(200000, Math.floor((256 << 20) / size)));
+}
+
+function roundtripCount(size) {
+    return Math.max(64, Math.min(10000, Math.floor((64 << 20) / size)));
+}
+
+var sequence = 0;
+function endpoint(transport) {
+    // A fresh endpoint per run keeps lingering peers of the previous run out.
+    sequence++;
+    switch (transport) {
+    case "inproc": return `inproc://bench-${sequence}`;
+    case "ipc": return `ipc:///tmp/quickjs-zmq-bench-${sequence}.ipc`;
+    default: return `tcp://127.0.0.1:${15555 + sequence}`;
+    }
+}
+
+var worker = new os.Worker("./worker.mjs");
+var pending;
+worker.onmessage = (e) => pending(e.data);
+
+function local(job) {
+    return new Promise((resolve) => {
+        pending = resolve;
+        worker.postMessage(job);
+    });
+}
+
+async function main() {
+    var results = [];
+    for (var transport of transports) {
+        for (var size of sizes) {
+            for (var path of selectedPaths) {
+                var count = messageCount(size);
+                var where = endpoint(transport);
+                var done = local({test: "thr", endpoint: where, path, size, count});
+                remoteThr(where, path, size, count);
+                results.push(Object.assign({transport}, await done));
+
+                // Latency is a lock-step REQ/REP exchange, batching does not apply.
+                if (path == "batched") continue;
+                count = roundtripCount(size);
+                where = endpoint(transport);
+                done = local({test: "lat", endpoint: where, path, size, count});
+                results.push(Object.assign({transport}, remoteLat(where, path, size, count)));
+                await done;
+            }
+        }
+    }
+    console.log(JSON.stringify({version: zmq.version(), results}, null, 2));
+    worker.onmessage = null;
+}
+
+main();
@@ -0,0 +1,16 @@
+/*
+ * Runs the local (binding) side of a benchmark for run.mjs on its own thread.
+ */
+import * as os from 'os';
+import { localThr, localLat } from './common.mjs';
+
+var parent = os.Worker.parent;
+parent.onmessage = (e) => {
+    var job = e.data;
+    if (job.test == "thr") {
+        parent.postMessage(localThr(job.endpoint, job.path, job.size, job.count));
+    } else {
+        localLat(job.endpoint, job.path, job.size, job.count);
+        parent.postMessage(null);
+    }
+};
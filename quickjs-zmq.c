@@ -27,32 +27,281 @@ SOFTWARE.
 #include <czmq.h>
 #include <zsock.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#include <math.h>
+#include <zlib.h>
 // #include <zhelpers.h>
 #include "../quickjs/quickjs-libc.h"
 #include "../quickjs/quickjs.h"
 
-// Borrowed from quickjs-ffi
-#if UINTPTR_MAX == UINT32_MAX
-#define JS_TO_UINTPTR_T(ctx, pres, val) JS_ToInt32(ctx, (int32_t *)(pres), val)
-#define JS_NEW_UINTPTR_T(ctx, val) JS_NewInt32(ctx, (int32_t)(val))
-#define C_MACRO_UINTPTR_T_DEF(x) JS_PROP_INT32_DEF(#x, (int32_t)(x), JS_PROP_CONFIGURABLE)
-// 不能#define C_MACRO_INTPTR_DEF(x) C_MACRO_INT_DEF(x)否则#会展开为x所定义的内容而非x本身
-#define C_VAR_ADDRESS_DEF(x) JS_PROP_INT32_DEF(#x, (int32_t)(&x), JS_PROP_CONFIGURABLE)
-#define ffi_type_intptr_t ffi_type_sint32
-#define ffi_type_uintptr_t ffi_type_uint32
-#elif UINTPTR_MAX == UINT64_MAX
-#define JS_TO_UINTPTR_T(ctx, pres, val) JS_ToInt64(ctx, (int64_t *)(pres), val)
-#define JS_NEW_UINTPTR_T(ctx, val) JS_NewInt64(ctx, (int64_t)(val))
-#define C_MACRO_UINTPTR_T_DEF(x) JS_PROP_INT64_DEF(#x, (int64_t)(x), JS_PROP_CONFIGURABLE)
-#define C_VAR_ADDRESS_DEF(x) JS_PROP_INT64_DEF(#x, (int64_t)(&x), JS_PROP_CONFIGURABLE)
-#define ffi_type_intptr_t ffi_type_sint64
-#define ffi_type_uintptr_t ffi_type_uint64
-#else
-#error "'uintptr_t' neither 32bit nor 64 bit, I don't know how to handle it."
+#define countof(x) (sizeof(x) / sizeof((x)[0]))
+
+/***************************************************************
+ * Handle classes.
+ * Contexts and sockets are handed to JS as opaque, GC-managed objects. A
+ * socket that becomes unreachable is closed by its finalizer, and a context is
+ * terminated once its JS handle and every socket created from it are gone.
+ **************************************************************/
+typedef struct JSZmqContext {
+    void* context;
+    int refCount; // the JS handle plus one per open socket
+} JSZmqContext;
+
+typedef struct JSZmqCompression JSZmqCompression;
+typedef struct JSZmqSharedSocket JSZmqSharedSocket;
+typedef struct JSZmqSpool JSZmqSpool;
+typedef struct JSZmqCapture JSZmqCapture;
+
+// Receive-to-next-receive times fall into power-of-two microsecond buckets:
+// bucket 0 is under 1us, bucket i covers [2^(i-1), 2^i) us, the last is open.
+#define JS_ZMQ_DISPATCH_BUCKETS 32
+
+// Counters kept by the interpreter thread; plain integers, no atomics needed.
+// The exception are the send counters while an actor thread owns the socket:
+// it adds to them atomically, see js_zmq_actor_run.
+typedef struct JSZmqStats {
+    uint64_t messagesIn;
+    uint64_t bytesIn;
+    uint64_t messagesOut;
+    uint64_t bytesOut;
+    uint64_t wouldBlock; // sends refused with EAGAIN, i.e. high-water mark hits
+    uint64_t sendErrors; // sends refused with any other error; the message is lost
+    uint64_t dispatch[JS_ZMQ_DISPATCH_BUCKETS];
+    uint64_t dispatchStart; // when received messages were last handed to JS, in us
+} JSZmqStats;
+
+typedef struct JSZmqSocket {
+    void* handle;          // libzmq socket, NULL once closed
+    zsock_t* zsock;        // set when the socket was created through czmq
+    JSZmqContext* context; // NULL for zsock sockets, czmq owns their context
+    bool detached;         // handed over to a background thread
+    bool orphaned;         // JS object collected while detached, see js_zmq_socket_reattach
+    bool monitored;        // zmq_socket_monitor is running, see js_zmq_monitor_socket
+    uint8_t codec;         // JS_ZMQ_CODEC_* used for message payloads
+    JSZmqCompression* compression; // NULL unless payload compression is on
+    JSZmqStats stats;
+    JSZmqSharedSocket* shared; // set when the handle is shared between workers
+    void* poller; // zmq_poller backing the fd of a thread-safe socket
+    JSZmqSpool* spool; // NULL unless overflow spooling is on
+    JSZmqCapture* capture; // NULL unless traffic capture is on
+} JSZmqSocket;
+
+static JSClassID js_zmq_context_class_id;
+static JSClassID js_zmq_socket_class_id;
+
+static JSZmqContext* js_zmq_context_ref(JSZmqContext* context) {
+    __atomic_add_fetch(&context->refCount, 1, __ATOMIC_RELAXED);
+    return context;
+}
+
+static void js_zmq_context_unref(JSZmqContext* context) {
+    if (__atomic_sub_fetch(&context->refCount, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+    // Blocks until lingering messages of closed sockets are delivered or
+    // their ZMQ_LINGER expires.
+    zmq_ctx_term(context->context);
+    free(context);
+}
+
+static void js_zmq_context_finalizer(JSRuntime* rt, JSValue val) {
+    JSZmqContext* context = JS_GetOpaque(val, js_zmq_context_class_id);
+    if (context)
+        js_zmq_context_unref(context);
+}
+
+static JSClassDef js_zmq_context_class = {
+    "Context",
+    .finalizer = js_zmq_context_finalizer,
+};
+
+static void js_zmq_compression_free(JSZmqCompression* compression);
+static void js_zmq_spool_close(JSZmqSpool* spool);
+static int js_zmq_capture_close(JSZmqCapture* capture);
+
+/**
+ * Thread-safe (draft) sockets can be used from several os.Workers at once.
+ * The owner publishes the handle under a name, and each worker opening it gets
+ * its own JS socket object. The handle is closed with the last of them.
+ */
+struct JSZmqSharedSocket {
+    JSZmqSharedSocket* next;
+    void* handle;
+    JSZmqContext* context;
+    int refCount; // one per JS socket object wrapping the handle
+    char name[];
+};
+
+static JSZmqSharedSocket* js_zmq_shared_sockets;
+static pthread_mutex_t js_zmq_shared_sockets_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Drops one claim on a shared handle. Returns true when it was the last one,
+// in which case the caller closes the handle.
+static bool js_zmq_shared_release(JSZmqSharedSocket* shared) {
+    pthread_mutex_lock(&js_zmq_shared_sockets_lock);
+    bool last = --shared->refCount == 0;
+    if (last) {
+        JSZmqSharedSocket** link = &js_zmq_shared_sockets;
+        while (*link != shared)
+            link = &(*link)->next;
+        *link = shared->next;
+    }
+    pthread_mutex_unlock(&js_zmq_shared_sockets_lock);
+    if (last)
+        free(shared);
+    return last;
+}
+
+static void js_zmq_socket_close(JSZmqSocket* s) {
+    if (s->compression) {
+        js_zmq_compression_free(s->compression);
+        s->compression = NULL;
+    }
+    if (s->spool) {
+        js_zmq_spool_close(s->spool);
+        s->spool = NULL;
+    }
+    if (s->capture) {
+        js_zmq_capture_close(s->capture);
+        s->capture = NULL;
+    }
+    if (!s->handle)
+        return;
+#ifdef ZMQ_BUILD_DRAFT_API
+    if (s->poller)
+        zmq_poller_destroy(&s->poller);
 #endif
+    if (s->zsock)
+        zsock_destroy(&s->zsock);
+    else if (!s->shared || js_zmq_shared_release(s->shared))
+        zmq_close(s->handle);
+    s->shared = NULL;
+    s->handle = NULL;
+    if (s->context) {
+        js_zmq_context_unref(s->context);
+        s->context = NULL;
+    }
+}
 
-#define countof(x) (sizeof(x) / sizeof((x)[0]))
+// Closes a socket nobody can use any more and frees it.
+static void js_zmq_socket_discard(JSRuntime* rt, JSZmqSocket* s) {
+    if (s->handle && !s->shared) {
+        // Nobody can send on an unreachable socket any more; do not let queued
+        // messages hold up context termination. A shared handle may still be
+        // in use by other workers, so it keeps its linger.
+        int linger = 0;
+        zmq_setsockopt(s->handle, ZMQ_LINGER, &linger, sizeof(linger));
+    }
+    js_zmq_socket_close(s);
+    js_free_rt(rt, s);
+}
+
+static void js_zmq_socket_finalizer(JSRuntime* rt, JSValue val) {
+    JSZmqSocket* s = JS_GetOpaque(val, js_zmq_socket_class_id);
+    if (!s)
+        return;
+    // Owners keep their sockets reachable, but when a runtime is torn down
+    // objects can be finalized in any order. The thread may still be using
+    // the socket, so leave it to the owner to discard once it stopped.
+    if (s->detached) {
+        s->orphaned = true;
+        return;
+    }
+    js_zmq_socket_discard(rt, s);
+}
+
+static JSClassDef js_zmq_socket_class = {
+    "Socket",
+    .finalizer = js_zmq_socket_finalizer,
+};
+
+// Wraps a new libzmq or czmq socket. Takes over the context reference.
+static JSValue js_zmq_new_socket_object(JSContext* ctx, void* handle, zsock_t* zsock, JSZmqContext* context) {
+    if (!handle) {
+        if (context)
+            js_zmq_context_unref(context);
+        return JS_ThrowInternalError(ctx, "%s", zmq_strerror(zmq_errno()));
+    }
+    JSValue obj = JS_NewObjectClass(ctx, js_zmq_socket_class_id);
+    JSZmqSocket* s = JS_IsException(obj) ? NULL : js_mallocz(ctx, sizeof(JSZmqSocket));
+    if (!s) {
+        JS_FreeValue(ctx, obj);
+        if (zsock)
+            zsock_destroy(&zsock);
+        else
+            zmq_close(handle);
+        if (context)
+            js_zmq_context_unref(context);
+        return JS_EXCEPTION;
+    }
+    s->handle = handle;
+    s->zsock = zsock;
+    s->context = context;
+    JS_SetOpaque(obj, s);
+    return obj;
+}
+
+// Decodes a socket handle argument. Throws unless val is an open socket
+// created by this module, raw or zsock.
+static JSZmqSocket* js_zmq_socket_get(JSContext* ctx, JSValueConst val) {
+    JSZmqSocket* s = JS_GetOpaque2(ctx, val, js_zmq_socket_class_id);
+    if (!s)
+        return NULL;
+    if (!s->handle) {
+        JS_ThrowTypeError(ctx, "socket is closed");
+        return NULL;
+    }
+    if (s->detached) {
+        JS_ThrowTypeError(ctx, "socket is owned by a background thread");
+        return NULL;
+    }
+    return s;
+}
+
+// Returns the libzmq socket behind a socket handle argument, or NULL with a
+// pending exception. The zmq_* entry points work on zsock sockets too.
+static void* js_zmq_socket_arg(JSContext* ctx, JSValueConst val) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, val);
+    return s ? s->handle : NULL;
+}
+
+// Hands a socket over to a background thread (actor, proxy). Direct calls on
+// it throw until js_zmq_socket_reattach. Returns NULL with a pending exception
+// if the socket is closed or already owned by another thread.
+static JSZmqSocket* js_zmq_socket_detach(JSContext* ctx, JSValueConst val) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, val);
+    if (s)
+        s->detached = true;
+    return s;
+}
+
+// Takes a socket back once its background thread stopped using it.
+static void js_zmq_socket_reattach(JSRuntime* rt, JSZmqSocket* s) {
+    s->detached = false;
+    if (s->orphaned)
+        js_zmq_socket_discard(rt, s);
+}
+
+static zsock_t* js_zmq_zsock_arg(JSContext* ctx, JSValueConst val) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, val);
+    if (s && !s->zsock) {
+        JS_ThrowTypeError(ctx, "not a zsock socket");
+        return NULL;
+    }
+    return s ? s->zsock : NULL;
+}
+
+// Throws for anything but a live context handle, including destroyed ones.
+static JSZmqContext* js_zmq_context_arg(JSContext* ctx, JSValueConst val) {
+    return JS_GetOpaque2(ctx, val, js_zmq_context_class_id);
+}
 
 static JSValue js_zmq_version(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
     int major, minor, patch;
@@ -65,63 +314,142 @@ static JSValue js_zmq_version(JSContext* ctx, JSValueConst this_val, int argc, J
 }
 
 static JSValue js_zmq_new_context(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
-    void* context = zmq_ctx_new();
-    return JS_NEW_UINTPTR_T(ctx, context);
+    JSValue obj = JS_NewObjectClass(ctx, js_zmq_context_class_id);
+    if (JS_IsException(obj))
+        return obj;
+    JSZmqContext* context = malloc(sizeof(JSZmqContext));
+    if (!context) {
+        JS_FreeValue(ctx, obj);
+        return JS_ThrowOutOfMemory(ctx);
+    }
+    context->context = zmq_ctx_new();
+    if (!context->context) {
+        // zmq_ctx_new fails when the reaper thread or its mailbox cannot be
+        // created, typically because the process ran out of descriptors.
+        free(context);
+        JS_FreeValue(ctx, obj);
+        return JS_ThrowInternalError(ctx, "%s", zmq_strerror(zmq_errno()));
+    }
+    context->refCount = 1;
+    JS_SetOpaque(obj, context);
+    return obj;
+}
+
+static JSZmqContext js_zmq_shared_context;
+static pthread_once_t js_zmq_shared_context_once = PTHREAD_ONCE_INIT;
+
+static void js_zmq_shared_context_init(void) {
+    js_zmq_shared_context.context = zmq_ctx_new();
+    // The process keeps one reference for itself, so the context and its
+    // inproc endpoints outlive every worker that uses them.
+    js_zmq_shared_context.refCount = 1;
+}
+
+/**
+ * Returns a handle to the process-wide context. Every os.Worker calling this
+ * gets the same libzmq context, so inproc:// sockets connect workers to each
+ * other and frames cross between them without being copied.
+ */
+static JSValue js_zmq_shared_context_fn(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
+    pthread_once(&js_zmq_shared_context_once, js_zmq_shared_context_init);
+    if (!js_zmq_shared_context.context)
+        return JS_ThrowInternalError(ctx, "%s", zmq_strerror(zmq_errno()));
+    JSValue obj = JS_NewObjectClass(ctx, js_zmq_context_class_id);
+    if (JS_IsException(obj))
+        return obj;
+    JS_SetOpaque(obj, js_zmq_context_ref(&js_zmq_shared_context));
+    return obj;
 }
 
+/**
+ * Releases the JS handle's reference to the context. The context itself is
+ * terminated once every socket created from it is closed as well.
+ */
 static JSValue js_zmq_destroy_context(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-    void* zmqContextPtr;
-    JS_TO_UINTPTR_T(ctx, zmqContextPtr, argv[0]);
-    zmq_ctx_destroy(zmqContextPtr);
+    JSZmqContext* context = js_zmq_context_arg(ctx, argv[0]);
+    if (!context)
+        return JS_EXCEPTION;
+    JS_SetOpaque(argv[0], NULL);
+    js_zmq_context_unref(context);
     return JS_UNDEFINED;
 }
 
 static JSValue js_zmq_get_context_option(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-    void* zmqContextPtr;
-    JS_TO_UINTPTR_T(ctx, zmqContextPtr, argv[0]);
+    JSZmqContext* context = js_zmq_context_arg(ctx, argv[0]);
+    if (!context)
+        return JS_EXCEPTION;
     int32_t optionName;
-    JS_ToInt32(ctx, &optionName, argv[1]);
-    int returnValue = zmq_ctx_get(zmqContextPtr, optionName);
+    if (JS_ToInt32(ctx, &optionName, argv[1]) < 0)
+        return JS_EXCEPTION;
+    int returnValue = zmq_ctx_get(context->context, optionName);
     return JS_NewInt32(ctx, returnValue);
 }
 
 static JSValue js_zmq_set_context_option(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-    void* zmqContextPtr;
-    JS_TO_UINTPTR_T(ctx, zmqContextPtr, argv[0]);
+    JSZmqContext* context = js_zmq_context_arg(ctx, argv[0]);
+    if (!context)
+        return JS_EXCEPTION;
     int32_t optionName;
-    JS_ToInt32(ctx, &optionName, argv[1]);
+    if (JS_ToInt32(ctx, &optionName, argv[1]) < 0)
+        return JS_EXCEPTION;
     int32_t optionValue;
-    JS_ToInt32(ctx, &optionValue, argv[2]);
-    int returnCode = zmq_ctx_set(zmqContextPtr, optionName, optionValue);
+    if (JS_ToInt32(ctx, &optionValue, argv[2]) < 0)
+        return JS_EXCEPTION;
+    // ZMQ_IO_THREADS, ZMQ_THREAD_AFFINITY_CPU_ADD/REMOVE and the scheduling
+    // options only affect I/O threads started afterwards, i.e. they must be
+    // set before the first socket is created.
+    int returnCode = zmq_ctx_set(context->context, optionName, optionValue);
     return JS_NewInt32(ctx, returnCode);
 }
 
 
 static JSValue js_zmq_create_socket(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst* argv) {
-    void* zmqContextPtr;
-    JS_TO_UINTPTR_T(ctx, &zmqContextPtr, argv[0]);
+    JSZmqContext* context = js_zmq_context_arg(ctx, argv[0]);
+    if (!context)
+        return JS_EXCEPTION;
     int32_t socketTypeInt;
-    JS_ToInt32(ctx, &socketTypeInt, argv[1]);
-    void* sock = zmq_socket(zmqContextPtr, socketTypeInt);
-    return JS_NEW_UINTPTR_T(ctx, sock);
-    // return JS_UNDEFINED;
+    if (JS_ToInt32(ctx, &socketTypeInt, argv[1]) < 0)
+        return JS_EXCEPTION;
+    void* sock = zmq_socket(context->context, socketTypeInt);
+    return js_zmq_new_socket_object(ctx, sock, NULL, js_zmq_context_ref(context));
+}
+
+// Applies the optional linger argument (milliseconds) of the close calls.
+static void js_zmq_apply_linger(JSContext* ctx, void* zmqSocketPtr, int argc, JSValue* argv, int index) {
+    if (argc <= index || JS_IsUndefined(argv[index]))
+        return;
+    int32_t linger;
+    JS_ToInt32(ctx, &linger, argv[index]);
+    zmq_setsockopt(zmqSocketPtr, ZMQ_LINGER, &linger, sizeof(linger));
 }
 
+/**
+ * Closes a raw or zsock socket, optionally setting ZMQ_LINGER first. Closing
+ * an already closed socket is a no-op.
+ */
 static JSValue js_zmq_close_socket(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    void* zmqSocketPtr;
-    JS_TO_UINTPTR_T(ctx, &zmqSocketPtr, argv[0]);
-    zmq_close(zmqSocketPtr);
+    JSZmqSocket* s = JS_GetOpaque2(ctx, argv[0], js_zmq_socket_class_id);
+    if (!s)
+        return JS_EXCEPTION;
+    if (s->detached)
+        return JS_ThrowTypeError(ctx, "socket is owned by a background thread");
+    if (s->handle) {
+        js_zmq_apply_linger(ctx, s->handle, argc, argv, 1);
+        js_zmq_socket_close(s);
+    }
     return JS_UNDEFINED;
 }
 
 
 static JSValue js_zmq_bind_socket(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    void* zmqSocketPtr;
-    JSValueConst addressVal = argv[1];   
-    const char *address = NULL;    
-    JS_TO_UINTPTR_T(ctx, &zmqSocketPtr, argv[0]);
-    address = JS_ToCString(ctx, addressVal);
+    void* zmqSocketPtr = js_zmq_socket_arg(ctx, argv[0]);
+    if (!zmqSocketPtr)
+        return JS_EXCEPTION;
+    const char *address = JS_ToCString(ctx, argv[1]);
+    if (!address)
+        return JS_EXCEPTION;
     int returnCode = zmq_bind(zmqSocketPtr, address);
+    JS_FreeCString(ctx, address);
     return JS_NewInt32(ctx, returnCode);
 }
 
@@ -131,193 +459,150 @@ static JSValue js_zmq_bind_socket(JSContext* ctx, JSValueConst this_val, int arg
  **************************************************************/
 static JSValue js_zmq_zsock_new(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
     int32_t socketTypeInt;
-    JS_ToInt32(ctx, &socketTypeInt, argv[0]);
+    if (JS_ToInt32(ctx, &socketTypeInt, argv[0]) < 0)
+        return JS_EXCEPTION;
     zsock_t* sock = zsock_new(socketTypeInt);
-    return JS_NEW_UINTPTR_T(ctx, sock);
+    return js_zmq_new_socket_object(ctx, sock ? zsock_resolve(sock) : NULL, sock, NULL);
+}
+
+// Shared body of the zsock_new_<type>(endpoint) constructors.
+static JSValue js_zmq_zsock_new_endpoint(JSContext* ctx, JSValueConst endpointVal, zsock_t* (*constructor)(const char*)) {
+    const char *endpoint = JS_ToCString(ctx, endpointVal);
+    if (!endpoint)
+        return JS_EXCEPTION;
+    zsock_t* sock = constructor(endpoint);
+    JS_FreeCString(ctx, endpoint);
+    return js_zmq_new_socket_object(ctx, sock ? zsock_resolve(sock) : NULL, sock, NULL);
 }
 
 static JSValue js_zmq_zsock_new_pub(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    JSValueConst endpointVal = argv[0];   
-    const char *endpoint = NULL;    
-    endpoint = JS_ToCString(ctx, endpointVal);
-    zsock_t* sock = zsock_new_pub(endpoint);
-    return JS_NEW_UINTPTR_T(ctx, sock);    
+    return js_zmq_zsock_new_endpoint(ctx, argv[0], zsock_new_pub);
 }
 
 static JSValue js_zmq_zsock_new_sub(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    JSValueConst endpointVal = argv[0];   
-    const char *endpoint = NULL;
-    JSValueConst subscribeVal = argv[1];
-    const char* subscribe = NULL;
-    endpoint = JS_ToCString(ctx, endpointVal);
-    subscribe = JS_ToCString(ctx, subscribeVal);
+    const char *endpoint = JS_ToCString(ctx, argv[0]);
+    if (!endpoint)
+        return JS_EXCEPTION;
+    const char* subscribe = JS_ToCString(ctx, argv[1]);
+    if (!subscribe) {
+        JS_FreeCString(ctx, endpoint);
+        return JS_EXCEPTION;
+    }
     zsock_t* sock = zsock_new_sub(endpoint, subscribe);
-    return JS_NEW_UINTPTR_T(ctx, sock);    
+    JS_FreeCString(ctx, endpoint);
+    JS_FreeCString(ctx, subscribe);
+    return js_zmq_new_socket_object(ctx, sock ? zsock_resolve(sock) : NULL, sock, NULL);
 }
 
 static JSValue js_zmq_zsock_new_req(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    JSValueConst endpointVal = argv[0];   
-    const char *endpoint = NULL;    
-    endpoint = JS_ToCString(ctx, endpointVal);
-    zsock_t* sock = zsock_new_req(endpoint);
-    return JS_NEW_UINTPTR_T(ctx, sock);    
+    return js_zmq_zsock_new_endpoint(ctx, argv[0], zsock_new_req);
 }
 
 static JSValue js_zmq_zsock_new_rep(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    JSValueConst endpointVal = argv[0];   
-    const char *endpoint = NULL;    
-    endpoint = JS_ToCString(ctx, endpointVal);
-    zsock_t* sock = zsock_new_rep(endpoint);
-    return JS_NEW_UINTPTR_T(ctx, sock);    
+    return js_zmq_zsock_new_endpoint(ctx, argv[0], zsock_new_rep);
 }
 
 static JSValue js_zmq_zsock_new_dealer(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    JSValueConst endpointVal = argv[0];   
-    const char *endpoint = NULL;    
-    endpoint = JS_ToCString(ctx, endpointVal);
-    zsock_t* sock = zsock_new_dealer(endpoint);
-    return JS_NEW_UINTPTR_T(ctx, sock);    
+    return js_zmq_zsock_new_endpoint(ctx, argv[0], zsock_new_dealer);
 }
 
 static JSValue js_zmq_zsock_new_router(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    JSValueConst endpointVal = argv[0];   
-    const char *endpoint = NULL;    
-    endpoint = JS_ToCString(ctx, endpointVal);
-    zsock_t* sock = zsock_new_router(endpoint);
-    return JS_NEW_UINTPTR_T(ctx, sock);    
+    return js_zmq_zsock_new_endpoint(ctx, argv[0], zsock_new_router);
 }
 
 static JSValue js_zmq_zsock_new_push(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    JSValueConst endpointVal = argv[0];   
-    const char *endpoint = NULL;    
-    endpoint = JS_ToCString(ctx, endpointVal);
-    zsock_t* sock = zsock_new_push(endpoint);
-    return JS_NEW_UINTPTR_T(ctx, sock);    
+    return js_zmq_zsock_new_endpoint(ctx, argv[0], zsock_new_push);
 }
 
 static JSValue js_zmq_zsock_new_xpub(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    JSValueConst endpointVal = argv[0];   
-    const char *endpoint = NULL;    
-    endpoint = JS_ToCString(ctx, endpointVal);
-    zsock_t* sock = zsock_new_xpub(endpoint);
-    return JS_NEW_UINTPTR_T(ctx, sock);    
+    return js_zmq_zsock_new_endpoint(ctx, argv[0], zsock_new_xpub);
 }
 
 static JSValue js_zmq_zsock_new_xsub(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    JSValueConst endpointVal = argv[0];   
-    const char *endpoint = NULL;    
-    endpoint = JS_ToCString(ctx, endpointVal);
-    zsock_t* sock = zsock_new_xsub(endpoint);
-    return JS_NEW_UINTPTR_T(ctx, sock);    
+    return js_zmq_zsock_new_endpoint(ctx, argv[0], zsock_new_xsub);
 }
 
 static JSValue js_zmq_zsock_new_pair(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    JSValueConst endpointVal = argv[0];   
-    const char *endpoint = NULL;    
-    endpoint = JS_ToCString(ctx, endpointVal);
-    zsock_t* sock = zsock_new_pair(endpoint);
-    return JS_NEW_UINTPTR_T(ctx, sock);
+    return js_zmq_zsock_new_endpoint(ctx, argv[0], zsock_new_pair);
 }
 
 static JSValue js_zmq_zsock_new_stream(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    JSValueConst endpointVal = argv[0];   
-    const char *endpoint = NULL;    
-    endpoint = JS_ToCString(ctx, endpointVal);
-    zsock_t* sock = zsock_new_stream(endpoint);
-    return JS_NEW_UINTPTR_T(ctx, sock);
+    return js_zmq_zsock_new_endpoint(ctx, argv[0], zsock_new_stream);
 }
 
 static JSValue js_zmq_zsock_new_pull(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    JSValueConst endpointVal = argv[0];   
-    const char *endpoint = NULL;    
-    endpoint = JS_ToCString(ctx, endpointVal);
-    zsock_t* sock = zsock_new_pull(endpoint);
-    return JS_NEW_UINTPTR_T(ctx, sock);
+    return js_zmq_zsock_new_endpoint(ctx, argv[0], zsock_new_pull);
 }
 
 static JSValue js_zmq_zsock_destroy(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    zsock_t* self;
-    JS_TO_UINTPTR_T(ctx, self, argv[0]);
-    zsock_destroy(&self);
-    return JS_UNDEFINED;
+    return js_zmq_close_socket(ctx, this_val, argc, argv);
+}
+
+// Shared body of the zsock calls taking a socket and an endpoint. The endpoint
+// is always passed through "%s" so it is never interpreted as a format string.
+static JSValue js_zmq_zsock_endpoint_call(JSContext* ctx, JSValue* argv, int (*call)(zsock_t*, const char*, ...)) {
+    zsock_t* self = js_zmq_zsock_arg(ctx, argv[0]);
+    if (!self)
+        return JS_EXCEPTION;
+    const char *endpoint = JS_ToCString(ctx, argv[1]);
+    if (!endpoint)
+        return JS_EXCEPTION;
+    int returnCode = call(self, "%s", endpoint);
+    JS_FreeCString(ctx, endpoint);
+    return JS_NewInt32(ctx, returnCode);
 }
 
 // We only pass in an already-created endpoint (using javascript templates) 
 // rather than the formatting string.
 static JSValue js_zmq_zsock_bind(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    zsock_t* self;
-    JS_TO_UINTPTR_T(ctx, self, argv[0]);
-    JSValueConst endpointVal = argv[1];
-    const char *endpoint = NULL;
-    endpoint = JS_ToCString(ctx, endpointVal);
-    int port = zsock_bind(self, endpoint);
-    return JS_NewInt32(ctx, port);
+    return js_zmq_zsock_endpoint_call(ctx, argv, zsock_bind);
 }
 
 static JSValue js_zmq_zsock_endpoint(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    zsock_t* self;
-    JS_TO_UINTPTR_T(ctx, self, argv[0]);
-    // JSValueConst endpointVal = argv[1];
+    zsock_t* self = js_zmq_zsock_arg(ctx, argv[0]);
+    if (!self)
+        return JS_EXCEPTION;
     const char *endpoint = zsock_endpoint(self);
-    // endpoint = JS_ToCString(ctx, endpointVal);
-    // int port = zsock_bind(self, endpoint);
-    return JS_NewString(ctx, endpoint);
+    return endpoint ? JS_NewString(ctx, endpoint) : JS_NULL;
 }
 
 // We only pass in an already-created endpoint (using javascript templates) 
 // rather than the formatting string.
 static JSValue js_zmq_zsock_unbind(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    zsock_t* self;
-    JS_TO_UINTPTR_T(ctx, self, argv[0]);
-    JSValueConst endpointVal = argv[1];
-    const char *endpoint = NULL;
-    endpoint = JS_ToCString(ctx, endpointVal);
-    int returnCode = zsock_unbind(self, endpoint);
-    return JS_NewInt32(ctx, returnCode);
+    return js_zmq_zsock_endpoint_call(ctx, argv, zsock_unbind);
 }
 
 
 // We only pass in an already-created endpoint (using javascript templates) 
 // rather than the formatting string.
 static JSValue js_zmq_zsock_connect(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    zsock_t* self;
-    JS_TO_UINTPTR_T(ctx, self, argv[0]);
-    JSValueConst endpointVal = argv[1];
-    const char *endpoint = NULL;
-    endpoint = JS_ToCString(ctx, endpointVal);
-    // int returnCode = zsock_connect(self, endpoint);
-    int returnCode = 0;
-    return JS_NewInt32(ctx, returnCode);
+    return js_zmq_zsock_endpoint_call(ctx, argv, zsock_connect);
 }
 
 // We only pass in an already-created endpoint (using javascript templates) 
 // rather than the format string.
 static JSValue js_zmq_zsock_disconnect(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    zsock_t* self;
-    JS_TO_UINTPTR_T(ctx, self, argv[0]);
-    JSValueConst endpointVal = argv[1];
-    const char *endpoint = NULL;
-    endpoint = JS_ToCString(ctx, endpointVal);
-    int returnCode = zsock_disconnect(self, endpoint);
-    return JS_NewInt32(ctx, returnCode);
+    return js_zmq_zsock_endpoint_call(ctx, argv, zsock_disconnect);
 }
 
 static JSValue js_zmq_zsock_attach(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    zsock_t* self;
-    JS_TO_UINTPTR_T(ctx, self, argv[0]);
-    JSValueConst endpointVal = argv[1];
-    const char *endpoints = NULL;
-    endpoints = JS_ToCString(ctx, endpointVal);
+    zsock_t* self = js_zmq_zsock_arg(ctx, argv[0]);
+    if (!self)
+        return JS_EXCEPTION;
+    const char *endpoints = JS_ToCString(ctx, argv[1]);
+    if (!endpoints)
+        return JS_EXCEPTION;
     bool serverish = JS_ToBool(ctx, argv[2]);
     int returnCode = zsock_attach(self, endpoints, serverish);
+    JS_FreeCString(ctx, endpoints);
     return JS_NewInt32(ctx, returnCode);
 }
 
 static JSValue js_zmq_zsock_type_str(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    zsock_t* self;
-    JS_TO_UINTPTR_T(ctx, self, argv[0]);
+    zsock_t* self = js_zmq_zsock_arg(ctx, argv[0]);
+    if (!self)
+        return JS_EXCEPTION;
     return JS_NewString(ctx, zsock_type_str(self));
-    // return JS_UNDEFINED;
 }
 
 /**
@@ -325,308 +610,4900 @@ static JSValue js_zmq_zsock_type_str(JSContext* ctx, JSValueConst this_val, int
  * Could add additional methods or shapes via the "picture" argument in the future
  */
 static JSValue js_zmq_zsock_send(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    zsock_t* self;
-    JS_TO_UINTPTR_T(ctx, self, argv[0]);
-    JSValueConst messageVal = argv[1];
-    int returnValue;    
-    
-    // if (JS_IsInteger(messageVal)) {
-        // int message;
-        // JS_ToInt32(ctx, &message, messageVal);
-        // returnValue = zsock_send(self, "i", message);
-    // } else (JS_IsString(messageVal)) {
-        char* message = NULL;
-        JS_ToCString(ctx, messageVal);
-        returnValue = zsock_send(self, "s", message);
-    // } 
-    // JSValueConst pictureVal = argv[1];
-    // JSValueConst messageVal = argv[2];
-    // const char *picture = NULL;
-    // const char* message = NULL;
-    // picture = JS_ToCString(ctx, pictureVal);
-
-    // message = JS_ToCString(ctx, messageVal);
-//      u = uint (deprecated)    
+    zsock_t* self = js_zmq_zsock_arg(ctx, argv[0]);
+    if (!self)
+        return JS_EXCEPTION;
+    const char* message = JS_ToCString(ctx, argv[1]);
+    if (!message)
+        return JS_EXCEPTION;
+    int returnValue = zsock_send(self, "s", message);
+    JS_FreeCString(ctx, message);
     return JS_NewInt32(ctx, returnValue);
 }
 
 /**
- * Sends the given message over a zsock.
+ * Receives a string message over a zsock.
  * Could add additional methods or shapes via the "picture" argument in the future
  */
 static JSValue js_zmq_zsock_recv(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    zsock_t* self;
-    JS_TO_UINTPTR_T(ctx, self, argv[0]);
+    zsock_t* self = js_zmq_zsock_arg(ctx, argv[0]);
+    if (!self)
+        return JS_EXCEPTION;
     char* receivedMessage = NULL;
-    int returnCode = zsock_recv(self, "s", &receivedMessage);
-    // TODO: Throw exception if returnCode != 0
-    return JS_NewString(ctx, receivedMessage);
+    if (zsock_recv(self, "s", &receivedMessage) != 0)
+        return JS_ThrowInternalError(ctx, "%s", zmq_strerror(zmq_errno()));
+    JSValue returnValue = receivedMessage ? JS_NewString(ctx, receivedMessage) : JS_NULL;
+    zstr_free(&receivedMessage);
+    return returnValue;
 }
 
 static JSValue js_zmq_zsock_flush(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    zsock_t* self;
-    JS_TO_UINTPTR_T(ctx, self, argv[0]);
+    zsock_t* self = js_zmq_zsock_arg(ctx, argv[0]);
+    if (!self)
+        return JS_EXCEPTION;
     zsock_flush(self);
     return JS_UNDEFINED;
 }
 
 static JSValue js_zmq_zsock_is(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    zsock_t* self;
-    JS_TO_UINTPTR_T(ctx, self, argv[0]);
-    bool result = zsock_is(self);
-    return JS_NewBool(ctx, result);
+    JSZmqSocket* s = JS_GetOpaque(argv[0], js_zmq_socket_class_id);
+    return JS_NewBool(ctx, s && s->zsock);
 }
 
 static JSValue js_zmq_zsock_resolve(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    zsock_t* self;
-    JS_TO_UINTPTR_T(ctx, self, argv[0]);
-    zsock_resolve(self);
+    if (!js_zmq_socket_arg(ctx, argv[0]))
+        return JS_EXCEPTION;
+    // Socket handles always carry the resolved libzmq socket.
     return JS_UNDEFINED;
 }
 
-// // zmsg Functions
-// static JSValue js_zmq_zmsg_new(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// }
+static JSValue js_zmq_connect_socket(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    void* zmqSocketPtr = js_zmq_socket_arg(ctx, argv[0]);
+    if (!zmqSocketPtr)
+        return JS_EXCEPTION;
+    const char *address = JS_ToCString(ctx, argv[1]);
+    if (!address)
+        return JS_EXCEPTION;
+    int returnCode = zmq_connect(zmqSocketPtr, address);
+    JS_FreeCString(ctx, address);
+    return JS_NewInt32(ctx, returnCode);
+}
+
+/***************************************************************
+ * Buffer pool.
+ * Message memory allocated by this module comes from per-thread free lists in
+ * power-of-two size classes, so steady traffic stops hitting malloc. Blocks
+ * handed to libzmq come back from its I/O threads through a lock-free list
+ * that the owning thread drains on its next call, like zero-copy holds.
+ * libzmq can release a block after the thread that allocated it has exited
+ * (linger, inproc peers in other workers), so pools live on the heap and are
+ * freed only once their thread is gone and every block is back.
+ **************************************************************/
+#define JS_ZMQ_POOL_MIN_SHIFT 6  // smallest class holds 64 bytes
+#define JS_ZMQ_POOL_CLASSES 11   // largest class holds 64 KiB
+#define JS_ZMQ_POOL_CLASS_BYTES (1 << 20) // idle memory kept per class
+// libzmq stores small frames inside zmq_msg_t and allocates the header and
+// data of medium ones in one block; pooling only pays off above this.
+#define JS_ZMQ_POOL_MSG_MIN 1024
+
+typedef struct JSZmqPool JSZmqPool;
+typedef struct JSZmqHeld JSZmqHeld;
+
+typedef struct JSZmqPoolBlock {
+    struct JSZmqPoolBlock* next;
+    JSZmqPool* pool;    // thread the block returns to
+    uint32_t sizeClass; // JS_ZMQ_POOL_CLASSES for oversized blocks
+} JSZmqPoolBlock;
 
-// static JSValue js_zmq_zmsg_destroy(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// }
+typedef struct JSZmqPoolClass {
+    JSZmqPoolBlock* free;
+    uint32_t count;
+    uint64_t hits;
+    uint64_t misses;
+} JSZmqPoolClass;
 
-// static JSValue js_zmq_zmsg_send(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// }
+// Head of a return list once its thread has exited; releases free directly.
+#define JS_ZMQ_POOL_CLOSED ((void*)1)
+
+struct JSZmqPool {
+    JSZmqPoolClass classes[JS_ZMQ_POOL_CLASSES];
+    JSZmqPoolBlock* returned; // released by libzmq, not yet put back
+    JSZmqHeld* released;      // zero-copy holds released by libzmq
+    uint64_t oversized;       // allocations above the largest class
+    int refCount;             // the owning thread plus one per block out
+};
 
-// static JSValue js_zmq_zmsg_recv(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+static __thread JSZmqPool* js_zmq_pool;
+static pthread_key_t js_zmq_pool_key;
+static pthread_once_t js_zmq_pool_key_once = PTHREAD_ONCE_INIT;
 
-// static JSValue js_zmq_zmsg_size(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+static void js_zmq_pool_unref(JSZmqPool* pool) {
+    if (__atomic_sub_fetch(&pool->refCount, 1, __ATOMIC_ACQ_REL) == 0)
+        free(pool);
+}
 
-// static JSValue js_zmq_zmsg_content_size(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+// Frees a block of a pool whose thread has exited.
+static void js_zmq_pool_orphan_free(JSZmqPoolBlock* block) {
+    JSZmqPool* pool = block->pool;
+    free(block);
+    js_zmq_pool_unref(pool);
+}
 
-// static JSValue js_zmq_zmsg_prepend(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+static void js_zmq_held_orphan_free(JSZmqHeld* held);
 
-// static JSValue js_zmq_zmsg_append(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+// Thread exit: gives back idle and returned blocks and drops the thread's
+// reference. Blocks libzmq still holds free themselves when released.
+static void js_zmq_pool_destroy(void* arg) {
+    JSZmqPool* pool = arg;
+    js_zmq_pool = NULL;
+    JSZmqPoolBlock* block = __atomic_exchange_n(&pool->returned, JS_ZMQ_POOL_CLOSED, __ATOMIC_ACQ_REL);
+    while (block) {
+        JSZmqPoolBlock* next = block->next;
+        js_zmq_pool_orphan_free(block);
+        block = next;
+    }
+    JSZmqHeld* held = __atomic_exchange_n(&pool->released, JS_ZMQ_POOL_CLOSED, __ATOMIC_ACQ_REL);
+    while (held) {
+        JSZmqHeld* next = *(JSZmqHeld**)held;
+        js_zmq_held_orphan_free(held);
+        held = next;
+    }
+    for (uint32_t i = 0; i < JS_ZMQ_POOL_CLASSES; i++) {
+        for (block = pool->classes[i].free; block; ) {
+            JSZmqPoolBlock* next = block->next;
+            js_zmq_pool_orphan_free(block);
+            block = next;
+        }
+    }
+    js_zmq_pool_unref(pool);
+}
 
-// static JSValue js_zmq_zmsg_pop(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+static void js_zmq_pool_key_init(void) {
+    pthread_key_create(&js_zmq_pool_key, js_zmq_pool_destroy);
+}
 
-// static JSValue js_zmq_zmsg_pushmem(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+// The calling thread's pool, created on first use. NULL when out of memory.
+static JSZmqPool* js_zmq_pool_get(void) {
+    if (js_zmq_pool)
+        return js_zmq_pool;
+    pthread_once(&js_zmq_pool_key_once, js_zmq_pool_key_init);
+    JSZmqPool* pool = calloc(1, sizeof(JSZmqPool));
+    if (!pool)
+        return NULL;
+    pool->refCount = 1;
+    pthread_setspecific(js_zmq_pool_key, pool);
+    js_zmq_pool = pool;
+    return pool;
+}
 
-// static JSValue js_zmq_zmsg_addmem(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+static void* js_zmq_pool_alloc(size_t size) {
+    JSZmqPool* pool = js_zmq_pool_get();
+    if (!pool)
+        return NULL;
+    uint32_t sizeClass = size <= (1u << JS_ZMQ_POOL_MIN_SHIFT) ? 0 :
+        (64 - __builtin_clzll((unsigned long long)size - 1)) - JS_ZMQ_POOL_MIN_SHIFT;
+    JSZmqPoolBlock* block;
+    if (sizeClass >= JS_ZMQ_POOL_CLASSES) {
+        pool->oversized++;
+        block = malloc(sizeof(JSZmqPoolBlock) + size);
+        sizeClass = JS_ZMQ_POOL_CLASSES;
+    } else {
+        JSZmqPoolClass* cls = &pool->classes[sizeClass];
+        block = cls->free;
+        if (block) {
+            cls->free = block->next;
+            cls->count--;
+            cls->hits++;
+            return block + 1; // idle blocks still count as out
+        }
+        cls->misses++;
+        block = malloc(sizeof(JSZmqPoolBlock) + ((size_t)1 << (sizeClass + JS_ZMQ_POOL_MIN_SHIFT)));
+    }
+    if (!block)
+        return NULL;
+    __atomic_add_fetch(&pool->refCount, 1, __ATOMIC_RELAXED);
+    block->pool = pool;
+    block->sizeClass = sizeClass;
+    return block + 1;
+}
 
-// static JSValue js_zmq_zmsg_pushstr(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+// Puts a block back; only on the thread that allocated it.
+static void js_zmq_pool_free(void* data) {
+    if (!data)
+        return;
+    JSZmqPoolBlock* block = (JSZmqPoolBlock*)data - 1;
+    JSZmqPool* pool = block->pool;
+    if (block->sizeClass < JS_ZMQ_POOL_CLASSES) {
+        JSZmqPoolClass* cls = &pool->classes[block->sizeClass];
+        if (((size_t)cls->count + 1) << (block->sizeClass + JS_ZMQ_POOL_MIN_SHIFT) <= JS_ZMQ_POOL_CLASS_BYTES) {
+            block->next = cls->free;
+            cls->free = block;
+            cls->count++;
+            return;
+        }
+    }
+    free(block);
+    // The thread's own reference keeps this from reaching zero.
+    __atomic_sub_fetch(&pool->refCount, 1, __ATOMIC_RELAXED);
+}
 
-// static JSValue js_zmq_zmsg_addstr(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+// zmq_free_fn of pooled message data, called from any thread.
+static void js_zmq_pool_release(void* data, void* hint) {
+    JSZmqPoolBlock* block = (JSZmqPoolBlock*)data - 1;
+    JSZmqPool* pool = block->pool;
+    JSZmqPoolBlock* head = __atomic_load_n(&pool->returned, __ATOMIC_ACQUIRE);
+    do {
+        if (head == JS_ZMQ_POOL_CLOSED) {
+            js_zmq_pool_orphan_free(block);
+            return;
+        }
+        block->next = head;
+    } while (!__atomic_compare_exchange_n(&pool->returned, &head, block, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
 
-// static JSValue js_zmq_zmsg_pushstrf(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+static void js_zmq_pool_reclaim(void) {
+    if (!js_zmq_pool || !__atomic_load_n(&js_zmq_pool->returned, __ATOMIC_RELAXED))
+        return;
+    JSZmqPoolBlock* block = __atomic_exchange_n(&js_zmq_pool->returned, NULL, __ATOMIC_ACQUIRE);
+    while (block) {
+        JSZmqPoolBlock* next = block->next;
+        js_zmq_pool_free(block + 1);
+        block = next;
+    }
+}
 
-// static JSValue js_zmq_zmsg_addstrf(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+// Like zmq_msg_init_size, with the data of larger frames taken from the pool.
+static int js_zmq_pool_msg(zmq_msg_t* msg, size_t size) {
+    if (size < JS_ZMQ_POOL_MSG_MIN)
+        return zmq_msg_init_size(msg, size);
+    void* data = js_zmq_pool_alloc(size);
+    if (!data) {
+        errno = ENOMEM;
+        return -1;
+    }
+    return zmq_msg_init_data(msg, data, size, js_zmq_pool_release, NULL);
+}
 
-// static JSValue js_zmq_zmsg_popstr(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+/**
+ * Returns the calling thread's pool counters: total and per size class hits
+ * and misses, idle blocks, and allocations too large for any class.
+ */
+static JSValue js_zmq_get_pool_stats(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    bool reset = argc > 0 && JS_ToBool(ctx, argv[0]);
+    JSZmqPool* pool = js_zmq_pool_get();
+    if (!pool)
+        return JS_ThrowOutOfMemory(ctx);
+    js_zmq_pool_reclaim();
+    JSValue result = JS_NewObject(ctx);
+    JSValue classes = JS_NewArray(ctx);
+    uint64_t hits = 0, misses = 0, idleBytes = 0;
+    for (uint32_t i = 0; i < JS_ZMQ_POOL_CLASSES; i++) {
+        JSZmqPoolClass* cls = &pool->classes[i];
+        size_t size = (size_t)1 << (i + JS_ZMQ_POOL_MIN_SHIFT);
+        JSValue entry = JS_NewObject(ctx);
+        JS_DefinePropertyValueStr(ctx, entry, "size", JS_NewInt64(ctx, size), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, entry, "hits", JS_NewInt64(ctx, cls->hits), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, entry, "misses", JS_NewInt64(ctx, cls->misses), JS_PROP_C_W_E);
+        JS_DefinePropertyValueStr(ctx, entry, "idle", JS_NewUint32(ctx, cls->count), JS_PROP_C_W_E);
+        JS_SetPropertyUint32(ctx, classes, i, entry);
+        hits += cls->hits;
+        misses += cls->misses;
+        idleBytes += (uint64_t)cls->count * size;
+        if (reset)
+            cls->hits = cls->misses = 0;
+    }
+    JS_DefinePropertyValueStr(ctx, result, "hits", JS_NewInt64(ctx, hits), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, result, "misses", JS_NewInt64(ctx, misses), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, result, "oversized", JS_NewInt64(ctx, pool->oversized), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, result, "idleBytes", JS_NewInt64(ctx, idleBytes), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, result, "classes", classes, JS_PROP_C_W_E);
+    if (reset)
+        pool->oversized = 0;
+    return result;
+}
 
-// static JSValue js_zmq_zmsg_addmsg(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
 
-// static JSValue js_zmq_zmsg_popmsg(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+/***************************************************************
+ * Message helpers.
+ * Frames move between JS and libzmq as zmq_msg_t so that sizes are unbounded,
+ * payloads are binary-safe and large buffers are never copied.
+ **************************************************************/
 
-// static JSValue js_zmq_zmsg_remove(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+// Buffers smaller than this are copied into the message; the bookkeeping for a
+// zero-copy send costs more than a memcpy of a small payload.
+#define JS_ZMQ_ZEROCOPY_MIN 1024
 
-// static JSValue js_zmq_zmsg_first(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+// A JS value kept alive while libzmq still references its memory. Holds are
+// pool blocks, so they know the thread they belong to.
+struct JSZmqHeld {
+    struct JSZmqHeld* next; // first, see js_zmq_pool_destroy
+    JSValue value;
+};
 
-// static JSValue js_zmq_zmsg_next(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+// libzmq releases zero-copy messages from its I/O threads, where touching the
+// JS runtime is not allowed. Released holds are pushed onto a lock-free list
+// of the interpreter thread's pool and freed by js_zmq_reclaim on its next
+// call.
+static void js_zmq_held_release(void* data, void* hint) {
+    JSZmqHeld* held = hint;
+    JSZmqPool* pool = ((JSZmqPoolBlock*)held - 1)->pool;
+    JSZmqHeld* head = __atomic_load_n(&pool->released, __ATOMIC_ACQUIRE);
+    do {
+        if (head == JS_ZMQ_POOL_CLOSED) {
+            js_zmq_held_orphan_free(held);
+            return;
+        }
+        held->next = head;
+    } while (!__atomic_compare_exchange_n(&pool->released, &head, held, true,
+                                          __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+}
 
-// static JSValue js_zmq_zmsg_last(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+// The thread and its runtime are gone; only the memory is left to free.
+static void js_zmq_held_orphan_free(JSZmqHeld* held) {
+    js_zmq_pool_orphan_free((JSZmqPoolBlock*)held - 1);
+}
 
-// static JSValue js_zmq_zmsg_save(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+static void js_zmq_reclaim(JSContext* ctx) {
+    js_zmq_pool_reclaim();
+    if (!js_zmq_pool || !__atomic_load_n(&js_zmq_pool->released, __ATOMIC_RELAXED))
+        return;
+    JSZmqHeld* held = __atomic_exchange_n(&js_zmq_pool->released, NULL, __ATOMIC_ACQUIRE);
+    while (held) {
+        JSZmqHeld* next = held->next;
+        JS_FreeValue(ctx, held->value);
+        js_zmq_pool_free(held);
+        held = next;
+    }
+}
 
+// Large received ArrayBuffers, keyed by data pointer, with the zmq_msg_t that
+// owns their memory. Sending such a buffer on (say, a worker forwarding over
+// inproc) then shares the message content by refcount instead of pinning the
+// JS buffer until every peer is done with it. Open addressing, linear probing.
+typedef struct JSZmqOwned {
+    const void* data;
+    zmq_msg_t* msg;
+} JSZmqOwned;
 
-// static JSValue js_zmq_zmsg_encode(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+static __thread JSZmqOwned* js_zmq_owned = NULL;
+static __thread size_t js_zmq_owned_capacity = 0;
+static __thread size_t js_zmq_owned_count = 0;
 
-// static JSValue js_zmq_zmsg_decode(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+static size_t js_zmq_owned_slot(const void* data) {
+    return (size_t)(((uintptr_t)data >> 4) * 0x9E3779B97F4A7C15ull) & (js_zmq_owned_capacity - 1);
+}
 
-// static JSValue js_zmq_zmsg_dup(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+static void js_zmq_owned_insert(const void* data, zmq_msg_t* msg) {
+    if ((js_zmq_owned_count + 1) * 2 > js_zmq_owned_capacity) {
+        JSZmqOwned* old = js_zmq_owned;
+        size_t oldCapacity = js_zmq_owned_capacity;
+        size_t capacity = oldCapacity ? oldCapacity * 2 : 64;
+        JSZmqOwned* table = calloc(capacity, sizeof(JSZmqOwned));
+        if (!table)
+            return; // the buffer just will not be shared on forwarding
+        js_zmq_owned = table;
+        js_zmq_owned_capacity = capacity;
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (!old[i].data)
+                continue;
+            size_t j = js_zmq_owned_slot(old[i].data);
+            while (table[j].data)
+                j = (j + 1) & (capacity - 1);
+            table[j] = old[i];
+        }
+        free(old);
+    }
+    size_t i = js_zmq_owned_slot(data);
+    while (js_zmq_owned[i].data)
+        i = (i + 1) & (js_zmq_owned_capacity - 1);
+    js_zmq_owned[i].data = data;
+    js_zmq_owned[i].msg = msg;
+    js_zmq_owned_count++;
+}
 
-// static JSValue js_zmq_zmsg_print(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+static zmq_msg_t* js_zmq_owned_find(const void* data) {
+    if (!js_zmq_owned_count)
+        return NULL;
+    for (size_t i = js_zmq_owned_slot(data); js_zmq_owned[i].data; i = (i + 1) & (js_zmq_owned_capacity - 1)) {
+        if (js_zmq_owned[i].data == data)
+            return js_zmq_owned[i].msg;
+    }
+    return NULL;
+}
 
-// static JSValue js_zmq_zmsg_is(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-// // zmsg_recv
-// }
+static void js_zmq_owned_remove(const void* data) {
+    if (!js_zmq_owned_count)
+        return;
+    size_t mask = js_zmq_owned_capacity - 1;
+    size_t i = js_zmq_owned_slot(data);
+    while (js_zmq_owned[i].data != data) {
+        if (!js_zmq_owned[i].data)
+            return;
+        i = (i + 1) & mask;
+    }
+    // Shift later entries of the probe run back so lookups never hit a hole.
+    for (size_t j = (i + 1) & mask; js_zmq_owned[j].data; j = (j + 1) & mask) {
+        size_t home = js_zmq_owned_slot(js_zmq_owned[j].data);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            js_zmq_owned[i] = js_zmq_owned[j];
+            i = j;
+        }
+    }
+    js_zmq_owned[i].data = NULL;
+    if (--js_zmq_owned_count == 0) {
+        free(js_zmq_owned);
+        js_zmq_owned = NULL;
+        js_zmq_owned_capacity = 0;
+    }
+}
 
+// ArrayBuffers handed to JS own the zmq_msg_t they were received into, so the
+// payload is never copied; the message is closed when the buffer is collected.
+static void js_zmq_msg_buffer_free(JSRuntime* rt, void* opaque, void* ptr) {
+    zmq_msg_t* msg = opaque;
+    if (zmq_msg_size(msg) >= JS_ZMQ_ZEROCOPY_MIN)
+        js_zmq_owned_remove(ptr);
+    zmq_msg_close(msg);
+    js_zmq_pool_free(msg);
+}
 
-static JSValue js_zmq_connect_socket(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    void* zmqSocketPtr;
-    JSValueConst addressVal = argv[1];   
-    const char *address = NULL;    
-    JS_TO_UINTPTR_T(ctx, &zmqSocketPtr, argv[0]);
-    address = JS_ToCString(ctx, addressVal);
-    int returnCode = zmq_connect(zmqSocketPtr, address);
-    return JS_NewInt32(ctx, returnCode);
+// Moves msg into a new ArrayBuffer. msg is left empty either way.
+static JSValue js_zmq_msg_to_buffer(JSContext* ctx, zmq_msg_t* msg) {
+    zmq_msg_t* owned = js_zmq_pool_alloc(sizeof(zmq_msg_t));
+    if (!owned) {
+        zmq_msg_close(msg);
+        return JS_ThrowOutOfMemory(ctx);
+    }
+    zmq_msg_init(owned);
+    zmq_msg_move(owned, msg);
+    // Small messages are stored inside the zmq_msg_t itself, so the data
+    // pointer must be taken after the move.
+    JSValue buffer = JS_NewArrayBuffer(ctx, zmq_msg_data(owned), zmq_msg_size(owned),
+                                       js_zmq_msg_buffer_free, owned, false);
+    if (!JS_IsException(buffer) && zmq_msg_size(owned) >= JS_ZMQ_ZEROCOPY_MIN)
+        js_zmq_owned_insert(zmq_msg_data(owned), owned);
+    return buffer;
 }
 
-static const int RECV_BUFFER_SIZE=65535;
+static JSValue js_zmq_msg_to_string(JSContext* ctx, zmq_msg_t* msg) {
+    JSValue value = JS_NewStringLen(ctx, zmq_msg_data(msg), zmq_msg_size(msg));
+    zmq_msg_close(msg);
+    return value;
+}
 
-static JSValue js_zmq_recv_socket(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    void* zmqSocketPtr;
-    JS_TO_UINTPTR_T(ctx, &zmqSocketPtr, argv[0]);
-    char buffer[RECV_BUFFER_SIZE];
-    memset(&buffer, 0, RECV_BUFFER_SIZE); // Clear the buffer before use.
-    int returnCode = zmq_recv(zmqSocketPtr, buffer, RECV_BUFFER_SIZE, 0);
-    if (returnCode < 0) {
-        const char* errorString = zmq_strerror(zmq_errno());
-        return JS_ThrowInternalError(ctx, errorString);
-    }
-    JSValue returnValue = JS_NewString(ctx, buffer);
-    memset(&buffer, 0, RECV_BUFFER_SIZE); // Clear the buffer.
-    return returnValue;
+// Finds the bytes behind an ArrayBuffer or TypedArray. On success *holder is
+// the ArrayBuffer owning the memory (to be freed by the caller); returns -1
+// with no pending exception when val is not a binary value.
+static int js_zmq_get_bytes(JSContext* ctx, JSValueConst val, uint8_t** data, size_t* length, JSValue* holder) {
+    if (!JS_IsObject(val))
+        return -1;
+    size_t offset, byteLength, bytesPerElement;
+    JSValue buffer = JS_GetTypedArrayBuffer(ctx, val, &offset, &byteLength, &bytesPerElement);
+    if (!JS_IsException(buffer)) {
+        size_t size;
+        uint8_t* base = JS_GetArrayBuffer(ctx, &size, buffer);
+        if (!base && byteLength) {
+            JS_FreeValue(ctx, buffer);
+            return -1;
+        }
+        *data = base + offset;
+        *length = byteLength;
+        *holder = buffer;
+        return 0;
+    }
+    JS_FreeValue(ctx, JS_GetException(ctx));
+    size_t size;
+    uint8_t* base = JS_GetArrayBuffer(ctx, &size, val);
+    if (!base) {
+        JS_FreeValue(ctx, JS_GetException(ctx));
+        return -1;
+    }
+    *data = base;
+    *length = size;
+    *holder = JS_DupValue(ctx, val);
+    return 0;
 }
 
-static JSValue js_zmq_send_socket(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    void* zmqSocketPtr;
-    JS_TO_UINTPTR_T(ctx, &zmqSocketPtr, argv[0]);
-    JSValueConst messageVal = argv[1];
-    const char *message = NULL;
-    // JS_TO_UINTPTR_T(ctx, &zmqSocketPtr, argv[0]);
+/**
+ * Initializes msg from a JS value. ArrayBuffers and TypedArrays of at least
+ * JS_ZMQ_ZEROCOPY_MIN bytes are handed to libzmq without copying and kept alive
+ * until libzmq releases them; the JS side must not modify them meanwhile. A
+ * whole received buffer shares the content of the message it came from.
+ * Anything else is sent as its string conversion.
+ */
+static int js_zmq_msg_from_value(JSContext* ctx, zmq_msg_t* msg, JSValueConst val) {
+    uint8_t* data;
+    size_t length;
+    JSValue holder;
+    if (js_zmq_get_bytes(ctx, val, &data, &length, &holder) == 0) {
+        if (length < JS_ZMQ_ZEROCOPY_MIN) {
+            zmq_msg_init_size(msg, length);
+            if (length)
+                memcpy(zmq_msg_data(msg), data, length);
+            JS_FreeValue(ctx, holder);
+            return 0;
+        }
+        zmq_msg_t* received = js_zmq_owned_find(data);
+        if (received && zmq_msg_size(received) == length) {
+            zmq_msg_init(msg);
+            zmq_msg_copy(msg, received);
+            JS_FreeValue(ctx, holder);
+            return 0;
+        }
+        JSZmqHeld* held = js_zmq_pool_alloc(sizeof(JSZmqHeld));
+        if (!held) {
+            JS_FreeValue(ctx, holder);
+            JS_ThrowOutOfMemory(ctx);
+            return -1;
+        }
+        held->value = holder;
+        held->next = NULL;
+        zmq_msg_init_data(msg, data, length, js_zmq_held_release, held);
+        return 0;
+    }
     size_t messageLength;
-    message = JS_ToCStringLen(ctx, &messageLength, messageVal);
-    int response = zmq_send(zmqSocketPtr, message, messageLength, 0);
+    const char* message = JS_ToCStringLen(ctx, &messageLength, val);
+    if (!message)
+        return -1;
+    if (js_zmq_pool_msg(msg, messageLength) != 0) {
+        JS_FreeCString(ctx, message);
+        JS_ThrowOutOfMemory(ctx);
+        return -1;
+    }
+    memcpy(zmq_msg_data(msg), message, messageLength);
     JS_FreeCString(ctx, message);
-    return JS_NewInt32(ctx, response);
+    return 0;
 }
 
-static JSValue js_zmq_strerror(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    JSValueConst returnCode = argv[0];
-    int errCode;
-    JS_ToInt32(ctx, &errCode, returnCode);
-    const char* errorString = zmq_strerror(errCode);
-    return JS_NewString(ctx, errorString);
+static JSValue js_zmq_msg_to_value(JSContext* ctx, zmq_msg_t* msg, bool binary) {
+    return binary ? js_zmq_msg_to_buffer(ctx, msg) : js_zmq_msg_to_string(ctx, msg);
 }
 
-static JSValue js_zmq_errno(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
-    return JS_NewInt32(ctx, zmq_errno());
+/*
+ * Payload compression, enabled per socket with setSocketCompression.
+ * Compressed frames carry an 8 byte header: a magic marker followed by the
+ * uncompressed length (big-endian). Frames without the marker are passed
+ * through unchanged, so compressing and plain peers can be mixed.
+ */
+#define JS_ZMQ_COMPRESSED_MAGIC "\xffZLB"
+#define JS_ZMQ_COMPRESSED_HEADER 8
+// deflate cannot expand data by more than about 1032:1; anything claiming a
+// larger ratio is not ours and is not worth allocating for.
+#define JS_ZMQ_INFLATE_MAX_RATIO 1032
+
+struct JSZmqCompression {
+    int level;          // 1-9 to compress outgoing frames, 0 to only inflate
+    size_t threshold;   // smaller payloads are sent uncompressed
+    uint8_t* dictionary;
+    size_t dictionaryLength;
+    z_stream deflater;  // both streams are reset and reused for every frame
+    z_stream inflater;
+    bool deflaterReady;
+    bool inflaterReady;
+};
+
+static void js_zmq_compression_free(JSZmqCompression* compression) {
+    if (compression->deflaterReady)
+        deflateEnd(&compression->deflater);
+    if (compression->inflaterReady)
+        inflateEnd(&compression->inflater);
+    free(compression->dictionary);
+    free(compression);
 }
 
-static JSValue js_zmq_get_socket_option(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-    void* zmqSocketPtr;
-    JS_TO_UINTPTR_T(ctx, &zmqSocketPtr, argv[0]);
-    int32_t optionName;
-    JS_ToInt32(ctx, &optionName, argv[1]);
-    void* optionValue;
-    JS_TO_UINTPTR_T(ctx, &optionValue, argv[2]);
-    size_t optionValueLength;
-    JS_ToInt64(ctx, &optionValueLength, argv[3]);
-    int returnCode = zmq_getsockopt(zmqSocketPtr, optionName, &optionValue, &optionValueLength);
-    return JS_NewInt32(ctx, returnCode);
+// Replaces msg with its compressed form when that is actually smaller.
+static void js_zmq_msg_deflate(JSZmqCompression* compression, zmq_msg_t* msg) {
+    size_t length = zmq_msg_size(msg);
+    if (compression->level == 0 || length < compression->threshold || length > UINT32_MAX)
+        return;
+    z_stream* stream = &compression->deflater;
+    if (!compression->deflaterReady) {
+        if (deflateInit(stream, compression->level) != Z_OK)
+            return;
+        compression->deflaterReady = true;
+    } else {
+        deflateReset(stream);
+    }
+    if (compression->dictionary)
+        deflateSetDictionary(stream, compression->dictionary, compression->dictionaryLength);
+    size_t bound = deflateBound(stream, length);
+    uint8_t* out = js_zmq_pool_alloc(JS_ZMQ_COMPRESSED_HEADER + bound);
+    if (!out)
+        return;
+    stream->next_in = zmq_msg_data(msg);
+    stream->avail_in = length;
+    stream->next_out = out + JS_ZMQ_COMPRESSED_HEADER;
+    stream->avail_out = bound;
+    if (deflate(stream, Z_FINISH) != Z_STREAM_END ||
+        stream->total_out + JS_ZMQ_COMPRESSED_HEADER >= length) {
+        js_zmq_pool_free(out);
+        return;
+    }
+    memcpy(out, JS_ZMQ_COMPRESSED_MAGIC, 4);
+    out[4] = length >> 24;
+    out[5] = length >> 16;
+    out[6] = length >> 8;
+    out[7] = length;
+    zmq_msg_close(msg);
+    zmq_msg_init_data(msg, out, JS_ZMQ_COMPRESSED_HEADER + stream->total_out, js_zmq_pool_release, NULL);
 }
 
-static JSValue js_zmq_set_socket_option(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
-    void* zmqSocketPtr;
-    JS_TO_UINTPTR_T(ctx, zmqSocketPtr, argv[0]);
-    int32_t optionName;
-    JS_ToInt32(ctx, &optionName, argv[1]);
-    int32_t optionValue;
-    JS_TO_UINTPTR_T(ctx, &optionValue, argv[2]);
-    size_t optionValueLength;
-    JS_ToInt64(ctx, &optionValueLength, argv[3]);
-    int returnCode = zmq_setsockopt(zmqSocketPtr, optionName, &optionValue, optionValueLength);
-    return JS_NewInt32(ctx, returnCode);
+// Replaces a compressed msg with its original content. Frames that are not
+// compressed, or fail to inflate, are left as they are.
+static void js_zmq_msg_inflate(JSZmqCompression* compression, zmq_msg_t* msg) {
+    size_t length = zmq_msg_size(msg);
+    const uint8_t* data = zmq_msg_data(msg);
+    if (length < JS_ZMQ_COMPRESSED_HEADER || memcmp(data, JS_ZMQ_COMPRESSED_MAGIC, 4) != 0)
+        return;
+    size_t rawLength = (size_t)data[4] << 24 | (size_t)data[5] << 16 | (size_t)data[6] << 8 | data[7];
+    size_t compressedLength = length - JS_ZMQ_COMPRESSED_HEADER;
+    if (rawLength > compressedLength * JS_ZMQ_INFLATE_MAX_RATIO + 64)
+        return;
+    z_stream* stream = &compression->inflater;
+    if (!compression->inflaterReady) {
+        if (inflateInit(stream) != Z_OK)
+            return;
+        compression->inflaterReady = true;
+    } else {
+        inflateReset(stream);
+    }
+    zmq_msg_t raw;
+    if (js_zmq_pool_msg(&raw, rawLength) != 0)
+        return;
+    stream->next_in = (uint8_t*)data + JS_ZMQ_COMPRESSED_HEADER;
+    stream->avail_in = compressedLength;
+    stream->next_out = zmq_msg_data(&raw);
+    stream->avail_out = rawLength;
+    int rc = inflate(stream, Z_FINISH);
+    if (rc == Z_NEED_DICT && compression->dictionary &&
+        inflateSetDictionary(stream, compression->dictionary, compression->dictionaryLength) == Z_OK)
+        rc = inflate(stream, Z_FINISH);
+    if (rc != Z_STREAM_END || stream->total_out != rawLength) {
+        zmq_msg_close(&raw);
+        return;
+    }
+    zmq_msg_close(msg);
+    zmq_msg_init(msg);
+    zmq_msg_move(msg, &raw);
 }
 
+static uint64_t js_zmq_now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
 
-static JSCFunctionListEntry funcs[] = {
-    JS_CFUNC_DEF("version", 0, js_zmq_version),
-    JS_CFUNC_DEF("createContext", 0, js_zmq_new_context),
-    JS_CFUNC_DEF("destroyContext", 1, js_zmq_destroy_context),
-    JS_CFUNC_DEF("getContextOption", 2, js_zmq_get_context_option),
-    JS_CFUNC_DEF("setContextOption", 3, js_zmq_set_context_option),
-    JS_CFUNC_DEF("getSocketOption", 4, js_zmq_get_socket_option),
-    JS_CFUNC_DEF("setSocketOption", 4, js_zmq_set_socket_option),
-    JS_CFUNC_DEF("createSocket", 2, js_zmq_create_socket),
-    JS_CFUNC_DEF("closeSocket", 1, js_zmq_close_socket),
-    JS_CFUNC_DEF("bindSocket", 2, js_zmq_bind_socket),
-    JS_CFUNC_DEF("recvSocket", 1, js_zmq_recv_socket),
-    JS_CFUNC_DEF("sendSocket", 2, js_zmq_send_socket),
-    JS_CFUNC_DEF("connectSocket", 2, js_zmq_connect_socket),
-    JS_CFUNC_DEF("strerror", 1, js_zmq_strerror),
-    JS_CFUNC_DEF("errno", 0, js_zmq_errno),
-    JS_CFUNC_DEF("zsock_new", 1, js_zmq_zsock_new),
-    JS_CFUNC_DEF("zsock_new_pub", 1, js_zmq_zsock_new_pub),
-    JS_CFUNC_DEF("zsock_new_sub", 2, js_zmq_zsock_new_sub),
-    JS_CFUNC_DEF("zsock_new_req", 1, js_zmq_zsock_new_req),
-    JS_CFUNC_DEF("zsock_new_rep", 1, js_zmq_zsock_new_rep),
-    JS_CFUNC_DEF("zsock_new_dealer", 1, js_zmq_zsock_new_dealer),
-    JS_CFUNC_DEF("zsock_new_router", 1, js_zmq_zsock_new_router),
-    JS_CFUNC_DEF("zsock_new_push", 1, js_zmq_zsock_new_push),
-    JS_CFUNC_DEF("zsock_new_xpub", 1, js_zmq_zsock_new_xpub),
-    JS_CFUNC_DEF("zsock_new_xsub", 1, js_zmq_zsock_new_sub),
-    JS_CFUNC_DEF("zsock_new_pair", 1, js_zmq_zsock_new_pair),
-    JS_CFUNC_DEF("zsock_new_stream", 1, js_zmq_zsock_new_stream),
-    JS_CFUNC_DEF("zsock_new_pull", 1, js_zmq_zsock_new_pull),
-    JS_CFUNC_DEF("zsock_destroy", 1, js_zmq_zsock_destroy),
-    JS_CFUNC_DEF("zsock_connect", 2, js_zmq_zsock_connect),
-    JS_CFUNC_DEF("zsock_send", 2, js_zmq_zsock_send),
-    JS_CFUNC_DEF("zsock_recv", 1, js_zmq_zsock_recv),
-    JS_CFUNC_DEF("zsock_is", 1, js_zmq_zsock_is),
-    JS_CFUNC_DEF("zsock_resolve", 1, js_zmq_zsock_resolve),
-    JS_CFUNC_DEF("zsock_flush", 1, js_zmq_zsock_flush),
-    JS_CFUNC_DEF("zsock_unbind", 1, js_zmq_zsock_unbind)
+// Called by every receiving native before it receives anything: the time since
+// the previous call handed messages over is how long JS took to dispatch them.
+static void js_zmq_stats_dispatch_end(JSZmqSocket* s) {
+    if (!s->stats.dispatchStart)
+        return;
+    uint64_t elapsed = js_zmq_now_us() - s->stats.dispatchStart;
+    int bucket = elapsed ? 64 - __builtin_clzll(elapsed) : 0;
+    if (bucket >= JS_ZMQ_DISPATCH_BUCKETS)
+        bucket = JS_ZMQ_DISPATCH_BUCKETS - 1;
+    s->stats.dispatch[bucket]++;
+    s->stats.dispatchStart = 0;
+}
+
+static void js_zmq_stats_dispatch_start(JSZmqSocket* s) {
+    s->stats.dispatchStart = js_zmq_now_us();
+}
+
+// rc is the result of a send: bytes queued, or -1 on a libzmq error.
+static void js_zmq_stats_sent(JSZmqSocket* s, int64_t rc) {
+    if (rc >= 0) {
+        s->stats.messagesOut++;
+        s->stats.bytesOut += rc;
+    } else if (rc == -1 && zmq_errno() == EAGAIN) {
+        s->stats.wouldBlock++;
+    } else if (rc == -1) {
+        s->stats.sendErrors++;
+    }
+}
+
+/*
+ * Traffic capture, enabled per socket with setSocketCapture.
+ * Every frame sent or received through the natives of this module, envelopes
+ * included, is appended to a file as a 16 byte record header (CLOCK_REALTIME
+ * nanoseconds, length, flags) followed by the frame bytes as they went over
+ * the wire, i.e. after the codec and compression. Spooled messages are
+ * recorded when they are actually sent. Not recorded: sockets handed to a
+ * proxy while it runs, and the zsock_send/zsock_recv picture calls.
+ * openCapture/replayCapture read such files back.
+ */
+#define JS_ZMQ_CAPTURE_MAGIC "QJSZCAP1"
+#define JS_ZMQ_CAPTURE_HEADER 16
+#define JS_ZMQ_CAPTURE_MORE 1     // more frames of the same message follow
+#define JS_ZMQ_CAPTURE_RECEIVED 2 // received rather than sent
+
+typedef struct JSZmqCaptureRecord {
+    uint64_t timestamp;
+    uint32_t length;
+    uint8_t flags;
+    uint8_t reserved[3];
+} JSZmqCaptureRecord;
+
+struct JSZmqCapture {
+    FILE* file;
+    uint64_t frames;
+    uint64_t bytes;
+    int error; // errno of the first failed write; nothing is written after it
 };
 
+// Returns 0, or the errno of the first write that failed.
+static int js_zmq_capture_close(JSZmqCapture* capture) {
+    int error = capture->error;
+    if (fclose(capture->file) != 0 && !error)
+        error = errno;
+    free(capture);
+    return error;
+}
+
+static uint64_t js_zmq_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-static int init(JSContext *ctx, JSModuleDef *m) {
-    // JS_NewClassID(&js_dtor_class_id);
-    // JS_NewClass(JS_GetRuntime(ctx), js_dtor_class_id, &js_dtor_class);
-    JS_SetModuleExportList(ctx, m, funcs, countof(funcs));
+static void js_zmq_capture_frame(JSZmqCapture* capture, zmq_msg_t* msg, uint8_t flags, uint64_t timestamp) {
+    size_t length = zmq_msg_size(msg);
+    if (length > UINT32_MAX)
+        return;
+    // An actor thread sends while the interpreter decodes what it received.
+    flockfile(capture->file);
+    // Nothing is written after a failed write, the file would not parse.
+    if (!capture->error) {
+        JSZmqCaptureRecord record = { timestamp, length, flags, {0} };
+        if (fwrite(&record, sizeof(record), 1, capture->file) == 1 &&
+            fwrite(zmq_msg_data(msg), 1, length, capture->file) == length) {
+            capture->frames++;
+            capture->bytes += length;
+        } else {
+            capture->error = errno ? errno : EIO;
+        }
+    }
+    funlockfile(capture->file);
+}
+
+// Records a frame just received on s, if it captures.
+static void js_zmq_capture_in(JSZmqSocket* s, zmq_msg_t* msg) {
+    if (s->capture)
+        js_zmq_capture_frame(s->capture, msg,
+                             JS_ZMQ_CAPTURE_RECEIVED | (zmq_msg_more(msg) ? JS_ZMQ_CAPTURE_MORE : 0), js_zmq_now_ns());
+}
+
+// Accounts for a received frame that is not the payload frame.
+static void js_zmq_frame_in(JSZmqSocket* s, zmq_msg_t* msg) {
+    s->stats.bytesIn += zmq_msg_size(msg);
+    js_zmq_capture_in(s, msg);
+}
+
+// zmq_msg_send that records the frame in capture (may be NULL) once libzmq
+// accepted it.
+static int js_zmq_capture_send(JSZmqCapture* capture, void* handle, zmq_msg_t* msg, int flags) {
+    if (!capture)
+        return zmq_msg_send(msg, handle, flags);
+    // Sending empties msg; keep a reference to record what went out.
+    zmq_msg_t copy;
+    zmq_msg_init(&copy);
+    zmq_msg_copy(&copy, msg);
+    int rc = zmq_msg_send(msg, handle, flags);
+    if (rc >= 0)
+        js_zmq_capture_frame(capture, &copy, flags & ZMQ_SNDMORE ? JS_ZMQ_CAPTURE_MORE : 0, js_zmq_now_ns());
+    zmq_msg_close(&copy);
+    return rc;
+}
+
+static int js_zmq_msg_send_out(JSZmqSocket* s, zmq_msg_t* msg, int flags) {
+    return js_zmq_capture_send(s->capture, s->handle, msg, flags);
+}
+
+// zmq_send counterpart of js_zmq_msg_send_out.
+static int js_zmq_send_out(JSZmqSocket* s, const void* data, size_t length, int flags) {
+    if (!s->capture)
+        return zmq_send(s->handle, data, length, flags);
+    zmq_msg_t msg;
+    if (zmq_msg_init_size(&msg, length) != 0)
+        return -1;
+    memcpy(zmq_msg_data(&msg), data, length);
+    int rc = js_zmq_msg_send_out(s, &msg, flags);
+    zmq_msg_close(&msg);
+    return rc;
+}
+
+/**
+ * Starts appending the socket's traffic to the file at path (truncated
+ * first), or stops when path is null. Stopping or replacing a capture throws
+ * if any of it could not be written, e.g. because the disk is full.
+ */
+static JSValue js_zmq_set_socket_capture(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    if (s->capture) {
+        int error = js_zmq_capture_close(s->capture);
+        s->capture = NULL;
+        if (error)
+            return JS_ThrowInternalError(ctx, "capture incomplete: %s", strerror(error));
+    }
+    if (JS_IsNull(argv[1]) || JS_IsUndefined(argv[1]))
+        return JS_UNDEFINED;
+    const char* path = JS_ToCString(ctx, argv[1]);
+    if (!path)
+        return JS_EXCEPTION;
+    FILE* file = fopen(path, "wb");
+    JS_FreeCString(ctx, path);
+    JSZmqCapture* capture = file ? calloc(1, sizeof(JSZmqCapture)) : NULL;
+    if (!capture) {
+        int error = errno;
+        if (file)
+            fclose(file);
+        return JS_ThrowInternalError(ctx, "cannot open capture: %s", strerror(error));
+    }
+    // Frames are small and many; write them out in large chunks.
+    setvbuf(file, NULL, _IOFBF, 1 << 20);
+    uint8_t header[JS_ZMQ_CAPTURE_HEADER] = {0};
+    memcpy(header, JS_ZMQ_CAPTURE_MAGIC, 8);
+    if (fwrite(header, sizeof(header), 1, file) != 1)
+        capture->error = errno ? errno : EIO;
+    capture->file = file;
+    s->capture = capture;
+    return JS_UNDEFINED;
+}
+
+/*
+ * Payload codecs, selected per socket with setSocketCodec. A codec (and
+ * compression) applies to the payload of a message: its only frame, or the
+ * last frame of a multipart message. Leading frames (topics, routing
+ * envelopes) are always raw.
+ */
+#define JS_ZMQ_CODEC_RAW 0    // strings, ArrayBuffers and TypedArrays as they are
+#define JS_ZMQ_CODEC_OBJECT 1 // any JS value, via QuickJS object serialization
+
+static int js_zmq_msg_encode(JSContext* ctx, JSZmqSocket* s, zmq_msg_t* msg, JSValueConst val) {
+    if (s->codec != JS_ZMQ_CODEC_OBJECT) {
+        if (js_zmq_msg_from_value(ctx, msg, val) < 0)
+            return -1;
+    } else {
+        size_t length;
+        uint8_t* data = JS_WriteObject(ctx, &length, val, 0);
+        if (!data)
+            return -1;
+        if (js_zmq_pool_msg(msg, length) != 0) {
+            js_free(ctx, data);
+            JS_ThrowOutOfMemory(ctx);
+            return -1;
+        }
+        memcpy(zmq_msg_data(msg), data, length);
+        js_free(ctx, data);
+    }
+    if (s->compression)
+        js_zmq_msg_deflate(s->compression, msg);
     return 0;
 }
 
-JSModuleDef *js_init_module(JSContext *ctx, const char *module_name) {
+// Consumes msg. Object frames are decoded straight from the message memory.
+static JSValue js_zmq_msg_decode(JSContext* ctx, JSZmqSocket* s, zmq_msg_t* msg, bool binary) {
+    // Every received message passes through here exactly once.
+    s->stats.messagesIn++;
+    s->stats.bytesIn += zmq_msg_size(msg);
+    js_zmq_capture_in(s, msg);
+    if (s->compression)
+        js_zmq_msg_inflate(s->compression, msg);
+    if (s->codec != JS_ZMQ_CODEC_OBJECT)
+        return js_zmq_msg_to_value(ctx, msg, binary);
+    JSValue value = JS_ReadObject(ctx, zmq_msg_data(msg), zmq_msg_size(msg), 0);
+    zmq_msg_close(msg);
+    return value;
+}
+
+/*
+ * Overflow spool, enabled per socket with setSocketSpool.
+ * Messages refused with EAGAIN are appended to a memory-mapped file and sent
+ * again, in order, once the socket accepts them; while anything is spooled new
+ * messages queue up behind it. The file starts with a header holding the read
+ * and write offsets, so messages spooled before a crash are replayed by the
+ * next process opening it. Each frame is stored as a 4 byte length, a 4 byte
+ * "more frames follow" flag and the frame bytes. Records are never overwritten
+ * while the header still points at them, and the write offset and depth are
+ * recomputed from the records on open, so a crash between two header updates
+ * loses at most the message being appended.
+ */
+#define JS_ZMQ_SPOOL_MAGIC 0x5053515au // "ZQSP"
+#define JS_ZMQ_SPOOL_DATA 64           // offset of the first record
+#define JS_ZMQ_SPOOL_RECORD 8
+
+typedef struct JSZmqSpoolHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t readOffset;
+    uint64_t writeOffset;
+    uint64_t depth; // messages stored
+} JSZmqSpoolHeader;
+
+struct JSZmqSpool {
+    int fd;
+    uint8_t* map;
+    size_t size;
+    JSZmqSpoolHeader* header;
+    uint64_t spooled;  // messages taken in since the spool was opened
+    uint64_t replayed; // messages sent from the spool
+    uint64_t rejected; // messages refused because the spool was full
+    uint64_t dropped;  // spooled messages libzmq refused for good, see js_zmq_spool_replay
+    uint64_t compactions;
+};
+
+static void js_zmq_spool_close(JSZmqSpool* spool) {
+    munmap(spool->map, spool->size);
+    close(spool->fd);
+    free(spool);
+}
+
+static void js_zmq_spool_reset(JSZmqSpool* spool) {
+    spool->header->readOffset = spool->header->writeOffset = JS_ZMQ_SPOOL_DATA;
+    spool->header->depth = 0;
+}
+
+// Walks the records after readOffset and sets writeOffset and depth to the
+// end and number of the complete messages found there.
+static void js_zmq_spool_recover(JSZmqSpool* spool) {
+    JSZmqSpoolHeader* header = spool->header;
+    uint64_t offset = header->readOffset, end = offset, depth = 0;
+    while (depth < header->depth) {
+        uint32_t record[2];
+        if (offset + JS_ZMQ_SPOOL_RECORD > header->writeOffset)
+            break;
+        memcpy(record, spool->map + offset, sizeof(record));
+        if (offset + JS_ZMQ_SPOOL_RECORD + record[0] > header->writeOffset)
+            break;
+        offset += JS_ZMQ_SPOOL_RECORD + record[0];
+        if (!record[1]) {
+            end = offset;
+            depth++;
+        }
+    }
+    header->writeOffset = end;
+    header->depth = depth;
+}
+
+// Opens or creates a spool file of at least size bytes. NULL with errno set on
+// failure.
+static JSZmqSpool* js_zmq_spool_open(const char* path, size_t size) {
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    // A file left by a previous run keeps its size so no spooled data is cut.
+    if (fstat(fd, &st) != 0 || ((size_t)st.st_size < size && ftruncate(fd, size) != 0)) {
+        close(fd);
+        return NULL;
+    }
+    if ((size_t)st.st_size > size)
+        size = st.st_size;
+    JSZmqSpool* spool = calloc(1, sizeof(JSZmqSpool));
+    uint8_t* map = spool ? mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (map == MAP_FAILED) {
+        free(spool);
+        close(fd);
+        return NULL;
+    }
+    spool->fd = fd;
+    spool->map = map;
+    spool->size = size;
+    spool->header = (JSZmqSpoolHeader*)map;
+    JSZmqSpoolHeader* header = spool->header;
+    if (header->magic != JS_ZMQ_SPOOL_MAGIC || header->version != 1 ||
+        header->readOffset < JS_ZMQ_SPOOL_DATA || header->readOffset > header->writeOffset ||
+        header->writeOffset > size) {
+        header->magic = JS_ZMQ_SPOOL_MAGIC;
+        header->version = 1;
+        js_zmq_spool_reset(spool);
+    }
+    js_zmq_spool_recover(spool);
+    return spool;
+}
+
+// Appends a message that could not be sent. Returns the bytes stored, or -1
+// with errno EAGAIN when the spool is full even after compaction.
+static int64_t js_zmq_spool_append(JSZmqSpool* spool, zmq_msg_t* parts, uint32_t count) {
+    JSZmqSpoolHeader* header = spool->header;
+    size_t needed = 0, bytes = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        bytes += zmq_msg_size(&parts[i]);
+        needed += JS_ZMQ_SPOOL_RECORD + zmq_msg_size(&parts[i]);
+    }
+    size_t live = header->writeOffset - header->readOffset;
+    if (header->writeOffset + needed > spool->size && live <= header->readOffset - JS_ZMQ_SPOOL_DATA) {
+        // Compact: copy the unsent records to the start of the file. Only done
+        // when the copy does not overlap them, so the old records are intact
+        // until the header points at the new ones; moving readOffset first
+        // is safe because writeOffset is recomputed on open.
+        memcpy(spool->map + JS_ZMQ_SPOOL_DATA, spool->map + header->readOffset, live);
+        msync(spool->map, JS_ZMQ_SPOOL_DATA + live, MS_SYNC);
+        header->readOffset = JS_ZMQ_SPOOL_DATA;
+        __atomic_signal_fence(__ATOMIC_RELEASE);
+        header->writeOffset = JS_ZMQ_SPOOL_DATA + live;
+        spool->compactions++;
+    }
+    if (header->writeOffset + needed > spool->size) {
+        spool->rejected++;
+        errno = EAGAIN;
+        return -1;
+    }
+    uint8_t* out = spool->map + header->writeOffset;
+    for (uint32_t i = 0; i < count; i++) {
+        uint32_t record[2] = { zmq_msg_size(&parts[i]), i + 1 < count };
+        memcpy(out, record, sizeof(record));
+        memcpy(out + JS_ZMQ_SPOOL_RECORD, zmq_msg_data(&parts[i]), record[0]);
+        out += JS_ZMQ_SPOOL_RECORD + record[0];
+    }
+    // The offsets are updated last so a crash never exposes a partial message.
+    __atomic_signal_fence(__ATOMIC_RELEASE);
+    header->writeOffset += needed;
+    header->depth++;
+    spool->spooled++;
+    return bytes;
+}
+
+// Moves *offset past the remaining frames of the message it points into.
+// Returns -1 if the records run past writeOffset.
+static int js_zmq_spool_skip(JSZmqSpool* spool, uint64_t* offset) {
+    uint64_t end = spool->header->writeOffset;
+    for (;;) {
+        uint32_t record[2];
+        if (*offset + JS_ZMQ_SPOOL_RECORD > end)
+            return -1;
+        memcpy(record, spool->map + *offset, sizeof(record));
+        if (*offset + JS_ZMQ_SPOOL_RECORD + record[0] > end)
+            return -1;
+        *offset += JS_ZMQ_SPOOL_RECORD + record[0];
+        if (!record[1])
+            return 0;
+    }
+}
+
+// Sends spooled messages until the socket refuses one. A message refused for
+// a reason of its own (a peer that is gone) is dropped and counted so it does
+// not hold up the rest. Returns -1 with errno set when the socket itself
+// fails; the message then stays spooled.
+static int js_zmq_spool_replay(JSZmqSocket* s) {
+    JSZmqSpool* spool = s->spool;
+    JSZmqSpoolHeader* header = spool->header;
+    while (header->depth > 0) {
+        uint64_t offset = header->readOffset;
+        uint64_t bytes = 0;
+        bool more = true;
+        for (uint32_t frame = 0; more; frame++) {
+            uint32_t record[2];
+            if (offset + JS_ZMQ_SPOOL_RECORD > header->writeOffset)
+                goto corrupt;
+            memcpy(record, spool->map + offset, sizeof(record));
+            if (offset + JS_ZMQ_SPOOL_RECORD + record[0] > header->writeOffset)
+                goto corrupt;
+            more = record[1] != 0;
+            zmq_msg_t msg;
+            if (js_zmq_pool_msg(&msg, record[0]) != 0)
+                return -1;
+            memcpy(zmq_msg_data(&msg), spool->map + offset + JS_ZMQ_SPOOL_RECORD, record[0]);
+            if (js_zmq_msg_send_out(s, &msg, ZMQ_DONTWAIT | (more ? ZMQ_SNDMORE : 0)) < 0) {
+                int error = zmq_errno();
+                zmq_msg_close(&msg);
+                // libzmq takes multipart messages atomically: only the first
+                // frame can be refused for lack of room or a missing peer.
+                if ((error == EAGAIN || error == EINTR) && frame == 0)
+                    return 0;
+                if (error == EHOSTUNREACH && frame == 0) {
+                    if (js_zmq_spool_skip(spool, &offset) != 0)
+                        goto corrupt;
+                    header->readOffset = offset;
+                    header->depth--;
+                    spool->dropped++;
+                    s->stats.sendErrors++;
+                    goto next;
+                }
+                errno = error;
+                return -1;
+            }
+            offset += JS_ZMQ_SPOOL_RECORD + record[0];
+            bytes += record[0];
+        }
+        header->readOffset = offset;
+        header->depth--;
+        spool->replayed++;
+        // Spooled messages count as sent once they actually are.
+        s->stats.messagesOut++;
+        s->stats.bytesOut += bytes;
+    next:;
+    }
+    js_zmq_spool_reset(spool);
+    return 0;
+corrupt:
+    // Offsets pointing past the data: whatever is left cannot be trusted.
+    js_zmq_spool_reset(spool);
+    return 0;
+}
+
+// Sends a converted message, or spools it when the socket has a spool and the
+// message cannot go out right now. Sent parts are left empty. Updates the
+// socket counters itself: spooled messages are counted, and captured, when
+// they are replayed, not when they are refused. Returns the bytes queued or
+// -1 (see errno()).
+static int64_t js_zmq_send_msgs(JSZmqSocket* s, zmq_msg_t* parts, uint32_t count, int flags) {
+    if (s->spool) {
+        // Spooling replaces blocking; and nothing may overtake spooled messages.
+        flags |= ZMQ_DONTWAIT;
+        if (s->spool->header->depth > 0) {
+            if (js_zmq_spool_replay(s) != 0) {
+                js_zmq_stats_sent(s, -1);
+                return -1;
+            }
+            if (s->spool->header->depth > 0)
+                return js_zmq_spool_append(s->spool, parts, count);
+        }
+    }
+    int64_t total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        int sent = js_zmq_msg_send_out(s, &parts[i], flags | (i + 1 < count ? ZMQ_SNDMORE : 0));
+        if (sent < 0) {
+            if (i == 0 && s->spool && zmq_errno() == EAGAIN) {
+                s->stats.wouldBlock++;
+                return js_zmq_spool_append(s->spool, parts, count);
+            }
+            js_zmq_stats_sent(s, -1);
+            return -1;
+        }
+        total += sent;
+    }
+    js_zmq_stats_sent(s, total);
+    return total;
+}
+
+/**
+ * Turns the overflow spool of a socket on with the file at path, limited to
+ * limit bytes (default 64 MiB), or off when path is null. Turning it off keeps
+ * unsent messages in the file for the next setSocketSpool on it. Returns the
+ * number of messages found waiting in the file.
+ */
+static JSValue js_zmq_set_socket_spool(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    int64_t limit = 64 << 20;
+    if (argc > 2 && !JS_IsUndefined(argv[2]) && JS_ToInt64(ctx, &limit, argv[2]) < 0)
+        return JS_EXCEPTION;
+    if (limit < JS_ZMQ_SPOOL_DATA + JS_ZMQ_SPOOL_RECORD)
+        return JS_ThrowRangeError(ctx, "spool limit too small");
+    if (s->spool) {
+        js_zmq_spool_close(s->spool);
+        s->spool = NULL;
+    }
+    if (JS_IsNull(argv[1]) || JS_IsUndefined(argv[1]))
+        return JS_NewInt32(ctx, 0);
+    const char* path = JS_ToCString(ctx, argv[1]);
+    if (!path)
+        return JS_EXCEPTION;
+    s->spool = js_zmq_spool_open(path, limit);
+    JS_FreeCString(ctx, path);
+    if (!s->spool)
+        return JS_ThrowInternalError(ctx, "cannot open spool: %s", strerror(errno));
+    return JS_NewInt64(ctx, s->spool->header->depth);
+}
+
+/**
+ * Sends as many spooled messages as the socket takes now. Call it when
+ * ZMQ_POLLOUT is signalled. Returns the number of messages still spooled.
+ */
+static JSValue js_zmq_flush_spool(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    if (!s->spool)
+        return JS_NewInt32(ctx, 0);
+    js_zmq_reclaim(ctx);
+    if (s->spool->header->depth > 0 && js_zmq_spool_replay(s) != 0)
+        return JS_ThrowInternalError(ctx, "%s", zmq_strerror(errno));
+    return JS_NewInt64(ctx, s->spool->header->depth);
+}
+
+/**
+ * Returns {depth, bytes, capacity, spooled, replayed, rejected, dropped,
+ * compactions} for the socket's spool, or null when it has none.
+ */
+static JSValue js_zmq_get_spool_stats(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    JSZmqSpool* spool = s->spool;
+    if (!spool)
+        return JS_NULL;
+    JSValue result = JS_NewObject(ctx);
+    JS_DefinePropertyValueStr(ctx, result, "depth", JS_NewInt64(ctx, spool->header->depth), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, result, "bytes",
+                              JS_NewInt64(ctx, spool->header->writeOffset - spool->header->readOffset), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, result, "capacity", JS_NewInt64(ctx, spool->size - JS_ZMQ_SPOOL_DATA), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, result, "spooled", JS_NewInt64(ctx, spool->spooled), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, result, "replayed", JS_NewInt64(ctx, spool->replayed), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, result, "rejected", JS_NewInt64(ctx, spool->rejected), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, result, "dropped", JS_NewInt64(ctx, spool->dropped), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, result, "compactions", JS_NewInt64(ctx, spool->compactions), JS_PROP_C_W_E);
+    return result;
+}
+
+// Sends every element of the frames array as one multipart message, setting
+// ZMQ_SNDMORE on all but the last. All frames are converted before the first
+// one is queued so a conversion error cannot leave a half-sent message behind;
+// libzmq queues multipart messages atomically, so only the first frame can
+// fail with EAGAIN.
+// Returns the total number of bytes queued, -1 on a libzmq error (see errno())
+// or -2 with a pending JS exception.
+static int64_t js_zmq_send_parts(JSContext* ctx, JSZmqSocket* s, JSValueConst frames, int flags) {
+    JSValue lengthVal = JS_GetPropertyStr(ctx, frames, "length");
+    uint32_t count;
+    if (JS_ToUint32(ctx, &count, lengthVal) < 0) {
+        JS_FreeValue(ctx, lengthVal);
+        return -2;
+    }
+    JS_FreeValue(ctx, lengthVal);
+    if (count == 0) {
+        JS_ThrowRangeError(ctx, "a multipart message needs at least one frame");
+        return -2;
+    }
+    zmq_msg_t stackParts[8];
+    zmq_msg_t* parts = stackParts;
+    if (count > countof(stackParts)) {
+        parts = js_malloc(ctx, count * sizeof(zmq_msg_t));
+        if (!parts)
+            return -2;
+    }
+    int64_t total = -2;
+    uint32_t converted = 0;
+    for (; converted < count; converted++) {
+        JSValue frame = JS_GetPropertyUint32(ctx, frames, converted);
+        int rc = converted + 1 < count ?
+            js_zmq_msg_from_value(ctx, &parts[converted], frame) :
+            js_zmq_msg_encode(ctx, s, &parts[converted], frame);
+        JS_FreeValue(ctx, frame);
+        if (rc < 0)
+            goto done;
+    }
+    total = js_zmq_send_msgs(s, parts, count, flags);
+done:
+    // Sent messages are already empty, so closing every part is safe.
+    for (uint32_t i = 0; i < converted; i++)
+        zmq_msg_close(&parts[i]);
+    if (parts != stackParts)
+        js_free(ctx, parts);
+    return total;
+}
+
+// Receives every part of the next message into a JS array. Returns JS_NULL
+// when nothing is queued and flags contains ZMQ_DONTWAIT. When first is not
+// NULL it holds an already received first part, which is consumed.
+static JSValue js_zmq_recv_parts(JSContext* ctx, JSZmqSocket* s, int flags, bool binary, zmq_msg_t* first) {
+    JSValue frames = JS_NewArray(ctx);
+    uint32_t index = 0;
+    zmq_msg_t msg;
+    do {
+        zmq_msg_init(&msg);
+        if (first) {
+            zmq_msg_move(&msg, first);
+            first = NULL;
+        } else if (zmq_msg_recv(&msg, s->handle, flags) < 0) {
+            int error = zmq_errno();
+            zmq_msg_close(&msg);
+            JS_FreeValue(ctx, frames);
+            if (error == EAGAIN && index == 0)
+                return JS_NULL;
+            return JS_ThrowInternalError(ctx, "%s", zmq_strerror(error));
+        }
+        bool more = zmq_msg_more(&msg);
+        if (more)
+            js_zmq_frame_in(s, &msg);
+        JSValue frame = more ?
+            js_zmq_msg_to_value(ctx, &msg, binary) :
+            js_zmq_msg_decode(ctx, s, &msg, binary);
+        if (JS_IsException(frame)) {
+            JS_FreeValue(ctx, frames);
+            return frame;
+        }
+        JS_SetPropertyUint32(ctx, frames, index++, frame);
+        if (!more)
+            break;
+    } while (true);
+    return frames;
+}
+
+/**
+ * Receives a single frame as a string (or decoded with the socket's codec).
+ * Accepts optional flags (e.g. ZMQ_DONTWAIT);
+ * when the socket has nothing queued in non-blocking mode, null is returned
+ * instead of throwing so callers can drain a socket until it runs dry.
+ */
+static JSValue js_zmq_recv_socket(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    int32_t flags = 0;
+    if (argc > 1)
+        JS_ToInt32(ctx, &flags, argv[1]);
+    js_zmq_reclaim(ctx);
+    js_zmq_stats_dispatch_end(s);
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
+    if (zmq_msg_recv(&msg, s->handle, flags) < 0) {
+        int error = zmq_errno();
+        zmq_msg_close(&msg);
+        if (error == EAGAIN)
+            return JS_NULL;
+        return JS_ThrowInternalError(ctx, "%s", zmq_strerror(error));
+    }
+    JSValue value = js_zmq_msg_decode(ctx, s, &msg, false);
+    js_zmq_stats_dispatch_start(s);
+    return value;
+}
+
+/**
+ * Receives a single frame as an ArrayBuffer that owns the message memory.
+ * Behaves like recvSocket otherwise.
+ */
+static JSValue js_zmq_recv_buffer(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    int32_t flags = 0;
+    if (argc > 1)
+        JS_ToInt32(ctx, &flags, argv[1]);
+    js_zmq_reclaim(ctx);
+    js_zmq_stats_dispatch_end(s);
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
+    if (zmq_msg_recv(&msg, s->handle, flags) < 0) {
+        int error = zmq_errno();
+        zmq_msg_close(&msg);
+        if (error == EAGAIN)
+            return JS_NULL;
+        return JS_ThrowInternalError(ctx, "%s", zmq_strerror(error));
+    }
+    JSValue value = js_zmq_msg_decode(ctx, s, &msg, true);
+    js_zmq_stats_dispatch_start(s);
+    return value;
+}
+
+/**
+ * Sends a single frame. The message may be a string, an ArrayBuffer or a
+ * TypedArray view; see js_zmq_msg_from_value for the copy rules.
+ * Returns the number of bytes queued, or -1 on error (see errno()).
+ */
+static JSValue js_zmq_send_socket(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    int32_t flags = 0;
+    if (argc > 2)
+        JS_ToInt32(ctx, &flags, argv[2]);
+    js_zmq_reclaim(ctx);
+    zmq_msg_t msg;
+    if (js_zmq_msg_encode(ctx, s, &msg, argv[1]) < 0)
+        return JS_EXCEPTION;
+    int64_t response = js_zmq_send_msgs(s, &msg, 1, flags);
+    zmq_msg_close(&msg);
+    return JS_NewInt64(ctx, response);
+}
+
+/**
+ * Sends an array of frames (strings, ArrayBuffers or TypedArrays) as one
+ * multipart message in a single call.
+ * Returns the total number of bytes queued, or -1 on error (see errno()).
+ */
+static JSValue js_zmq_send_multipart(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    int32_t flags = 0;
+    if (argc > 2)
+        JS_ToInt32(ctx, &flags, argv[2]);
+    js_zmq_reclaim(ctx);
+    int64_t sent = js_zmq_send_parts(ctx, s, argv[1], flags);
+    if (sent == -2)
+        return JS_EXCEPTION;
+    return JS_NewInt64(ctx, sent);
+}
+
+/**
+ * Receives all parts of the next message into an array, as strings or, when
+ * binary is true, as ArrayBuffers. Returns null on EAGAIN like recvSocket.
+ */
+static JSValue js_zmq_recv_multipart(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    int32_t flags = 0;
+    if (argc > 1)
+        JS_ToInt32(ctx, &flags, argv[1]);
+    bool binary = argc > 2 && JS_ToBool(ctx, argv[2]);
+    js_zmq_reclaim(ctx);
+    js_zmq_stats_dispatch_end(s);
+    JSValue frames = js_zmq_recv_parts(ctx, s, flags, binary, NULL);
+    if (!JS_IsNull(frames) && !JS_IsException(frames))
+        js_zmq_stats_dispatch_start(s);
+    return frames;
+}
+
+/**
+ * Queues an array of messages with one native call. Each element is a single
+ * frame (string, ArrayBuffer or TypedArray) or an array of frames sent as one
+ * multipart message. Sending is always non-blocking: it stops at the first
+ * message libzmq refuses, e.g. with EAGAIN once the high-water mark is reached.
+ * Returns the number of messages queued; when that is short of the array
+ * length, errno() tells why.
+ */
+static JSValue js_zmq_send_many(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    JSValueConst messages = argv[1];
+    int32_t flags = 0;
+    if (argc > 2)
+        JS_ToInt32(ctx, &flags, argv[2]);
+    flags |= ZMQ_DONTWAIT;
+    js_zmq_reclaim(ctx);
+    JSValue lengthVal = JS_GetPropertyStr(ctx, messages, "length");
+    uint32_t count;
+    if (JS_ToUint32(ctx, &count, lengthVal) < 0) {
+        JS_FreeValue(ctx, lengthVal);
+        return JS_EXCEPTION;
+    }
+    JS_FreeValue(ctx, lengthVal);
+    uint32_t sent = 0;
+    for (; sent < count; sent++) {
+        JSValue message = JS_GetPropertyUint32(ctx, messages, sent);
+        int64_t rc;
+        if (JS_IsArray(ctx, message)) {
+            rc = js_zmq_send_parts(ctx, s, message, flags);
+        } else {
+            zmq_msg_t msg;
+            rc = js_zmq_msg_encode(ctx, s, &msg, message) < 0 ? -2 : 0;
+            if (rc == 0) {
+                rc = js_zmq_send_msgs(s, &msg, 1, flags);
+                zmq_msg_close(&msg);
+            }
+        }
+        JS_FreeValue(ctx, message);
+        if (rc == -2)
+            return JS_EXCEPTION;
+        if (rc < 0)
+            break;
+    }
+    return JS_NewUint32(ctx, sent);
+}
+
+/**
+ * Drains up to max queued messages with ZMQ_DONTWAIT into one array. Single
+ * frame messages appear as strings (or ArrayBuffers when binary is true);
+ * multipart messages appear as arrays of frames. Returns an empty array when
+ * nothing is queued. An error is only thrown if it occurs before the first
+ * message; otherwise the batch ends early and the error resurfaces on the next
+ * call.
+ */
+static JSValue js_zmq_recv_batch(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    uint32_t max = 1024;
+    if (argc > 1 && !JS_IsUndefined(argv[1]))
+        JS_ToUint32(ctx, &max, argv[1]);
+    bool binary = argc > 2 && JS_ToBool(ctx, argv[2]);
+    js_zmq_reclaim(ctx);
+    js_zmq_stats_dispatch_end(s);
+    JSValue batch = JS_NewArray(ctx);
+    uint32_t received = 0;
+    zmq_msg_t msg;
+    while (received < max) {
+        zmq_msg_init(&msg);
+        if (zmq_msg_recv(&msg, s->handle, ZMQ_DONTWAIT) < 0) {
+            int error = zmq_errno();
+            zmq_msg_close(&msg);
+            if (error == EAGAIN || received > 0)
+                break;
+            JS_FreeValue(ctx, batch);
+            return JS_ThrowInternalError(ctx, "%s", zmq_strerror(error));
+        }
+        JSValue entry = zmq_msg_more(&msg) ?
+            js_zmq_recv_parts(ctx, s, ZMQ_DONTWAIT, binary, &msg) :
+            js_zmq_msg_decode(ctx, s, &msg, binary);
+        if (JS_IsException(entry)) {
+            JS_FreeValue(ctx, batch);
+            return entry;
+        }
+        JS_SetPropertyUint32(ctx, batch, received++, entry);
+    }
+    if (received > 0)
+        js_zmq_stats_dispatch_start(s);
+    return batch;
+}
+
+/**
+ * Selects how message payloads are converted: ZMQ_CODEC_RAW (0) sends strings
+ * and binary values as they are, ZMQ_CODEC_OBJECT (1) sends any JS value in
+ * QuickJS's compact object serialization, skipping JSON and its intermediate
+ * strings. Both peers must use the same codec.
+ */
+static JSValue js_zmq_set_socket_codec(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    int32_t codec;
+    if (JS_ToInt32(ctx, &codec, argv[1]) < 0)
+        return JS_EXCEPTION;
+    if (codec != JS_ZMQ_CODEC_RAW && codec != JS_ZMQ_CODEC_OBJECT)
+        return JS_ThrowRangeError(ctx, "unknown codec %d", codec);
+    s->codec = codec;
+    return JS_UNDEFINED;
+}
+
+/**
+ * Turns payload compression on or off for a socket. level 1-9 deflates
+ * outgoing payloads of at least threshold bytes (default 1024) whenever that
+ * makes them smaller; level 0 only inflates compressed payloads received;
+ * a negative level turns compression off. The optional dictionary (string or
+ * binary) primes zlib with typical content and must match on both peers.
+ */
+static JSValue js_zmq_set_socket_compression(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    int32_t level;
+    if (JS_ToInt32(ctx, &level, argv[1]) < 0)
+        return JS_EXCEPTION;
+    if (level > 9)
+        return JS_ThrowRangeError(ctx, "compression level must be at most 9");
+    int64_t threshold = 1024;
+    if (argc > 2 && !JS_IsUndefined(argv[2]) && JS_ToInt64(ctx, &threshold, argv[2]) < 0)
+        return JS_EXCEPTION;
+    if (s->compression) {
+        js_zmq_compression_free(s->compression);
+        s->compression = NULL;
+    }
+    if (level < 0)
+        return JS_UNDEFINED;
+    JSZmqCompression* compression = calloc(1, sizeof(JSZmqCompression));
+    if (!compression)
+        return JS_ThrowOutOfMemory(ctx);
+    compression->level = level;
+    compression->threshold = threshold < 0 ? 0 : threshold;
+    if (argc > 3 && !JS_IsUndefined(argv[3]) && !JS_IsNull(argv[3])) {
+        zmq_msg_t dictionary;
+        if (js_zmq_msg_from_value(ctx, &dictionary, argv[3]) < 0) {
+            free(compression);
+            return JS_EXCEPTION;
+        }
+        compression->dictionaryLength = zmq_msg_size(&dictionary);
+        compression->dictionary = malloc(compression->dictionaryLength);
+        if (compression->dictionary)
+            memcpy(compression->dictionary, zmq_msg_data(&dictionary), compression->dictionaryLength);
+        zmq_msg_close(&dictionary);
+        if (!compression->dictionary) {
+            free(compression);
+            return JS_ThrowOutOfMemory(ctx);
+        }
+    }
+    s->compression = compression;
+    return JS_UNDEFINED;
+}
+
+/**
+ * Returns a snapshot of the socket's counters: messagesIn, bytesIn,
+ * messagesOut, bytesOut, wouldBlock (sends refused at the high-water mark),
+ * sendErrors (sends refused for any other reason) and dispatchUs, the histogram of time between handing received messages to JS
+ * and JS asking for more (bucket i counts times under 2^i microseconds).
+ * Passing reset = true zeroes the counters afterwards.
+ */
+static JSValue js_zmq_get_socket_stats(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    // Stats stay readable while a background thread owns the socket.
+    JSZmqSocket* s = JS_GetOpaque2(ctx, argv[0], js_zmq_socket_class_id);
+    if (!s)
+        return JS_EXCEPTION;
+    uint64_t messagesOut = __atomic_load_n(&s->stats.messagesOut, __ATOMIC_RELAXED);
+    uint64_t bytesOut = __atomic_load_n(&s->stats.bytesOut, __ATOMIC_RELAXED);
+    uint64_t sendErrors = __atomic_load_n(&s->stats.sendErrors, __ATOMIC_RELAXED);
+    JSValue stats = JS_NewObject(ctx);
+    JS_SetPropertyStr(ctx, stats, "messagesIn", JS_NewInt64(ctx, s->stats.messagesIn));
+    JS_SetPropertyStr(ctx, stats, "bytesIn", JS_NewInt64(ctx, s->stats.bytesIn));
+    JS_SetPropertyStr(ctx, stats, "messagesOut", JS_NewInt64(ctx, messagesOut));
+    JS_SetPropertyStr(ctx, stats, "bytesOut", JS_NewInt64(ctx, bytesOut));
+    JS_SetPropertyStr(ctx, stats, "wouldBlock", JS_NewInt64(ctx, s->stats.wouldBlock));
+    JS_SetPropertyStr(ctx, stats, "sendErrors", JS_NewInt64(ctx, sendErrors));
+    JSValue dispatch = JS_NewArray(ctx);
+    for (uint32_t i = 0; i < JS_ZMQ_DISPATCH_BUCKETS; i++)
+        JS_SetPropertyUint32(ctx, dispatch, i, JS_NewInt64(ctx, s->stats.dispatch[i]));
+    JS_SetPropertyStr(ctx, stats, "dispatchUs", dispatch);
+    if (argc > 1 && JS_ToBool(ctx, argv[1])) {
+        // An actor thread may be adding to the send counters meanwhile, so
+        // take off what was reported instead of zeroing them.
+        __atomic_fetch_sub(&s->stats.messagesOut, messagesOut, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&s->stats.bytesOut, bytesOut, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&s->stats.sendErrors, sendErrors, __ATOMIC_RELAXED);
+        s->stats.messagesIn = s->stats.bytesIn = s->stats.wouldBlock = 0;
+        memset(s->stats.dispatch, 0, sizeof(s->stats.dispatch));
+        s->stats.dispatchStart = 0;
+    }
+    return stats;
+}
+
+/**
+ * Starts zmq_socket_monitor on a socket and returns the PAIR socket the
+ * events arrive on; read them with readMonitorEvent. events is a mask of
+ * ZMQ_EVENT_* bits (default all); 0 stops monitoring and returns null.
+ * A socket has at most one monitor; stop it before starting another.
+ */
+static JSValue js_zmq_monitor_socket(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    int32_t events = ZMQ_EVENT_ALL;
+    if (argc > 1 && !JS_IsUndefined(argv[1]))
+        JS_ToInt32(ctx, &events, argv[1]);
+    if (events == 0) {
+        zmq_socket_monitor(s->handle, NULL, 0);
+        s->monitored = false;
+        return JS_NULL;
+    }
+    // The previous PAIR would stay open and connected to the same endpoint.
+    if (s->monitored)
+        return JS_ThrowTypeError(ctx, "socket is already monitored");
+    char endpoint[64];
+    snprintf(endpoint, sizeof(endpoint), "inproc://quickjs-zmq-monitor-%p", (void*)s);
+    if (zmq_socket_monitor(s->handle, endpoint, events) != 0)
+        return JS_ThrowInternalError(ctx, "%s", zmq_strerror(zmq_errno()));
+    // The PAIR must live in the monitored socket's context for inproc to reach
+    // it; czmq sockets all share the zsys context.
+    void* context = s->context ? s->context->context : zsys_init();
+    void* pair = zmq_socket(context, ZMQ_PAIR);
+    if (pair && zmq_connect(pair, endpoint) != 0) {
+        zmq_close(pair);
+        pair = NULL;
+    }
+    if (!pair)
+        zmq_socket_monitor(s->handle, NULL, 0);
+    s->monitored = pair != NULL;
+    return js_zmq_new_socket_object(ctx, pair, NULL, s->context ? js_zmq_context_ref(s->context) : NULL);
+}
+
+/**
+ * Reads the next event from a monitor socket without blocking. Returns
+ * {event, value, endpoint} (value is the fd, errno or retry interval,
+ * depending on the event) or null when no event is queued.
+ */
+static JSValue js_zmq_read_monitor_event(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
+    if (zmq_msg_recv(&msg, s->handle, ZMQ_DONTWAIT) < 0) {
+        int error = zmq_errno();
+        zmq_msg_close(&msg);
+        if (error == EAGAIN)
+            return JS_NULL;
+        return JS_ThrowInternalError(ctx, "%s", zmq_strerror(error));
+    }
+    // First frame: 16-bit event id and 32-bit value, in host byte order.
+    uint16_t event = 0;
+    uint32_t value = 0;
+    if (zmq_msg_size(&msg) >= 6) {
+        memcpy(&event, zmq_msg_data(&msg), sizeof(event));
+        memcpy(&value, (uint8_t*)zmq_msg_data(&msg) + 2, sizeof(value));
+    }
+    bool more = zmq_msg_more(&msg);
+    zmq_msg_close(&msg);
+    JSValue result = JS_NewObject(ctx);
+    JS_SetPropertyStr(ctx, result, "event", JS_NewInt32(ctx, event));
+    JS_SetPropertyStr(ctx, result, "value", JS_NewUint32(ctx, value));
+    // Second frame: the endpoint the event relates to.
+    if (more) {
+        zmq_msg_init(&msg);
+        if (zmq_msg_recv(&msg, s->handle, 0) >= 0)
+            JS_SetPropertyStr(ctx, result, "endpoint", js_zmq_msg_to_string(ctx, &msg));
+        else
+            zmq_msg_close(&msg);
+    }
+    return result;
+}
+
+/**
+ * Returns the ZMQ_FD of a socket so it can be registered with os.setReadHandler.
+ * The descriptor is edge-triggered: it only signals that ZMQ_EVENTS may have
+ * changed, so callers must check getSocketEvents and drain with ZMQ_DONTWAIT.
+ */
+static JSValue js_zmq_get_socket_fd(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+#ifdef _WIN32
+    SOCKET fd;
+#else
+    int fd;
+#endif
+    size_t fdLength = sizeof(fd);
+    if (zmq_getsockopt(s->handle, ZMQ_FD, &fd, &fdLength) == 0)
+        return JS_NewInt32(ctx, (int32_t)fd);
+#ifdef ZMQ_BUILD_DRAFT_API
+    // Thread-safe sockets have no ZMQ_FD; a private poller provides one. It
+    // stays readable until getSocketEvents resets it.
+    if (zmq_errno() == EINVAL) {
+        if (!s->poller) {
+            s->poller = zmq_poller_new();
+            if (s->poller && zmq_poller_add(s->poller, s->handle, NULL, ZMQ_POLLIN) != 0)
+                zmq_poller_destroy(&s->poller);
+        }
+        if (s->poller && zmq_poller_fd(s->poller, &fd) == 0)
+            return JS_NewInt32(ctx, (int32_t)fd);
+    }
+#endif
+    return JS_ThrowInternalError(ctx, "%s", zmq_strerror(zmq_errno()));
+}
+
+/**
+ * Returns the ZMQ_EVENTS bitmask (ZMQ_POLLIN | ZMQ_POLLOUT) of a socket.
+ */
+static JSValue js_zmq_get_socket_events(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+#ifdef ZMQ_BUILD_DRAFT_API
+    if (s->poller) {
+        zmq_poller_event_t event;
+        zmq_poller_wait(s->poller, &event, 0); // consumes the fd wakeup
+    }
+#endif
+    int events = 0;
+    size_t eventsLength = sizeof(events);
+    if (zmq_getsockopt(s->handle, ZMQ_EVENTS, &events, &eventsLength) != 0)
+        return JS_ThrowInternalError(ctx, "%s", zmq_strerror(zmq_errno()));
+    return JS_NewInt32(ctx, events);
+}
+
+static JSValue js_zmq_strerror(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSValueConst returnCode = argv[0];
+    int errCode;
+    JS_ToInt32(ctx, &errCode, returnCode);
+    const char* errorString = zmq_strerror(errCode);
+    return JS_NewString(ctx, errorString);
+}
+
+static JSValue js_zmq_errno(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    return JS_NewInt32(ctx, zmq_errno());
+}
+
+/*
+ * Socket options by value type. Options not listed here are treated as ints,
+ * which is what most libzmq options are.
+ */
+typedef enum JSZmqOptionType {
+    JS_ZMQ_OPTION_INT,
+    JS_ZMQ_OPTION_INT64,
+    JS_ZMQ_OPTION_UINT64, // read back as a BigInt, doubles cannot hold every mask
+    JS_ZMQ_OPTION_STRING, // NUL-terminated text
+    JS_ZMQ_OPTION_BINARY, // up to 255 bytes, read back as an ArrayBuffer
+    JS_ZMQ_OPTION_CURVE_KEY, // set as 32 bytes or 40 Z85 characters, read as 32 bytes
+} JSZmqOptionType;
+
+typedef struct JSZmqOption {
+    int option;
+    JSZmqOptionType type;
+} JSZmqOption;
+
+static const JSZmqOption js_zmq_socket_options[] = {
+    { ZMQ_AFFINITY, JS_ZMQ_OPTION_UINT64 },
+    { ZMQ_IDENTITY, JS_ZMQ_OPTION_BINARY },
+    { ZMQ_SUBSCRIBE, JS_ZMQ_OPTION_BINARY },
+    { ZMQ_UNSUBSCRIBE, JS_ZMQ_OPTION_BINARY },
+    { ZMQ_MAXMSGSIZE, JS_ZMQ_OPTION_INT64 },
+    { ZMQ_LAST_ENDPOINT, JS_ZMQ_OPTION_STRING },
+    { ZMQ_ZAP_DOMAIN, JS_ZMQ_OPTION_STRING },
+    { ZMQ_PLAIN_USERNAME, JS_ZMQ_OPTION_STRING },
+    { ZMQ_PLAIN_PASSWORD, JS_ZMQ_OPTION_STRING },
+    { ZMQ_CURVE_PUBLICKEY, JS_ZMQ_OPTION_CURVE_KEY },
+    { ZMQ_CURVE_SECRETKEY, JS_ZMQ_OPTION_CURVE_KEY },
+    { ZMQ_CURVE_SERVERKEY, JS_ZMQ_OPTION_CURVE_KEY },
+#ifdef ZMQ_GSSAPI_PRINCIPAL
+    { ZMQ_GSSAPI_PRINCIPAL, JS_ZMQ_OPTION_STRING },
+    { ZMQ_GSSAPI_SERVICE_PRINCIPAL, JS_ZMQ_OPTION_STRING },
+#endif
+#ifdef ZMQ_VMCI_BUFFER_SIZE
+    { ZMQ_VMCI_BUFFER_SIZE, JS_ZMQ_OPTION_UINT64 },
+    { ZMQ_VMCI_BUFFER_MIN_SIZE, JS_ZMQ_OPTION_UINT64 },
+    { ZMQ_VMCI_BUFFER_MAX_SIZE, JS_ZMQ_OPTION_UINT64 },
+#endif
+#ifdef ZMQ_METADATA
+    { ZMQ_METADATA, JS_ZMQ_OPTION_STRING }, // "X-Name:value", write-only
+#endif
+#ifdef ZMQ_CONNECT_ROUTING_ID
+    { ZMQ_CONNECT_ROUTING_ID, JS_ZMQ_OPTION_BINARY },
+#endif
+#ifdef ZMQ_SOCKS_PROXY
+    { ZMQ_SOCKS_PROXY, JS_ZMQ_OPTION_STRING },
+#endif
+#ifdef ZMQ_XPUB_WELCOME_MSG
+    { ZMQ_XPUB_WELCOME_MSG, JS_ZMQ_OPTION_BINARY },
+#endif
+#ifdef ZMQ_BINDTODEVICE
+    { ZMQ_BINDTODEVICE, JS_ZMQ_OPTION_STRING },
+#endif
+};
+
+static JSZmqOptionType js_zmq_socket_option_type(int option) {
+    for (size_t i = 0; i < countof(js_zmq_socket_options); i++) {
+        if (js_zmq_socket_options[i].option == option)
+            return js_zmq_socket_options[i].type;
+    }
+    return JS_ZMQ_OPTION_INT;
+}
+
+/**
+ * Reads a socket option and returns its value as a number, a BigInt for
+ * unsigned 64-bit options such as ZMQ_AFFINITY, a string or, for binary
+ * options such as ZMQ_ROUTING_ID and CURVE keys, an ArrayBuffer. Throws on
+ * error.
+ */
+static JSValue js_zmq_get_socket_option(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    void* zmqSocketPtr = js_zmq_socket_arg(ctx, argv[0]);
+    if (!zmqSocketPtr)
+        return JS_EXCEPTION;
+    int32_t optionName;
+    if (JS_ToInt32(ctx, &optionName, argv[1]) < 0)
+        return JS_EXCEPTION;
+    union {
+        int i;
+        int64_t i64;
+        uint64_t u64;
+        char bytes[1024];
+    } value;
+    size_t length;
+    JSZmqOptionType type = js_zmq_socket_option_type(optionName);
+    switch (type) {
+    case JS_ZMQ_OPTION_INT:
+        length = sizeof(value.i);
+        break;
+    case JS_ZMQ_OPTION_INT64:
+    case JS_ZMQ_OPTION_UINT64:
+        length = sizeof(value.i64);
+        break;
+    case JS_ZMQ_OPTION_CURVE_KEY:
+        // libzmq picks the key format from the buffer size: 32 means binary.
+        length = 32;
+        break;
+    default:
+        length = sizeof(value.bytes);
+        break;
+    }
+    if (zmq_getsockopt(zmqSocketPtr, optionName, &value, &length) != 0)
+        return JS_ThrowInternalError(ctx, "%s", zmq_strerror(zmq_errno()));
+    switch (type) {
+    case JS_ZMQ_OPTION_INT:
+        return JS_NewInt32(ctx, value.i);
+    case JS_ZMQ_OPTION_INT64:
+        return JS_NewInt64(ctx, value.i64);
+    case JS_ZMQ_OPTION_UINT64:
+        return JS_NewBigUint64(ctx, value.u64);
+    case JS_ZMQ_OPTION_STRING:
+        // The reported length includes the terminating NUL.
+        return JS_NewStringLen(ctx, value.bytes, length ? strnlen(value.bytes, length) : 0);
+    default:
+        return JS_NewArrayBufferCopy(ctx, (uint8_t*)value.bytes, length);
+    }
+}
+
+/**
+ * Sets a socket option, converting the value to the option's type: numbers
+ * (or BigInts for 64-bit options) for integer options, strings for text
+ * options, and strings, ArrayBuffers or TypedArrays for binary ones. Returns
+ * 0, or -1 on error (see errno()).
+ */
+static JSValue js_zmq_set_socket_option(JSContext* ctx, JSValueConst this_val, int argc, JSValueConst *argv) {
+    void* zmqSocketPtr = js_zmq_socket_arg(ctx, argv[0]);
+    if (!zmqSocketPtr)
+        return JS_EXCEPTION;
+    int32_t optionName;
+    if (JS_ToInt32(ctx, &optionName, argv[1]) < 0)
+        return JS_EXCEPTION;
+    int returnCode;
+    switch (js_zmq_socket_option_type(optionName)) {
+    case JS_ZMQ_OPTION_INT: {
+        int32_t optionValue;
+        if (JS_ToInt32(ctx, &optionValue, argv[2]) < 0)
+            return JS_EXCEPTION;
+        int value = optionValue;
+        returnCode = zmq_setsockopt(zmqSocketPtr, optionName, &value, sizeof(value));
+        break;
+    }
+    case JS_ZMQ_OPTION_INT64:
+    case JS_ZMQ_OPTION_UINT64: {
+        // Both are 64 bits wide; a BigInt carries masks above 2^53 intact.
+        int64_t optionValue;
+        if (JS_ToInt64Ext(ctx, &optionValue, argv[2]) < 0)
+            return JS_EXCEPTION;
+        returnCode = zmq_setsockopt(zmqSocketPtr, optionName, &optionValue, sizeof(optionValue));
+        break;
+    }
+    default: {
+        zmq_msg_t value;
+        if (js_zmq_msg_from_value(ctx, &value, argv[2]) < 0)
+            return JS_EXCEPTION;
+        returnCode = zmq_setsockopt(zmqSocketPtr, optionName, zmq_msg_data(&value), zmq_msg_size(&value));
+        zmq_msg_close(&value);
+        break;
+    }
+    }
+    return JS_NewInt32(ctx, returnCode);
+}
+
+
+/***************************************************************
+ * Poller.
+ * Waits on any number of raw or zsock sockets with a single zmq_poll call,
+ * so one thread can multiplex many sockets without spinning.
+ **************************************************************/
+typedef struct JSZmqPoller {
+    zmq_pollitem_t* items;
+    JSValue* sockets;   // handles as registered, returned in the ready set
+    JSValue* callbacks; // JS_UNDEFINED when the socket has no callback
+    int count;
+    int capacity;
+} JSZmqPoller;
+
+static JSClassID js_zmq_poller_class_id;
+
+static void js_zmq_poller_finalizer(JSRuntime* rt, JSValue val) {
+    JSZmqPoller* poller = JS_GetOpaque(val, js_zmq_poller_class_id);
+    if (!poller)
+        return;
+    for (int i = 0; i < poller->count; i++) {
+        JS_FreeValueRT(rt, poller->sockets[i]);
+        JS_FreeValueRT(rt, poller->callbacks[i]);
+    }
+    js_free_rt(rt, poller->items);
+    js_free_rt(rt, poller->sockets);
+    js_free_rt(rt, poller->callbacks);
+    js_free_rt(rt, poller);
+}
+
+static void js_zmq_poller_mark(JSRuntime* rt, JSValueConst val, JS_MarkFunc* mark_func) {
+    JSZmqPoller* poller = JS_GetOpaque(val, js_zmq_poller_class_id);
+    if (!poller)
+        return;
+    for (int i = 0; i < poller->count; i++) {
+        JS_MarkValue(rt, poller->sockets[i], mark_func);
+        JS_MarkValue(rt, poller->callbacks[i], mark_func);
+    }
+}
+
+static JSClassDef js_zmq_poller_class = {
+    "Poller",
+    .finalizer = js_zmq_poller_finalizer,
+    .gc_mark = js_zmq_poller_mark,
+};
+
+static int js_zmq_poller_find(JSZmqPoller* poller, JSZmqSocket* s) {
+    for (int i = 0; i < poller->count; i++) {
+        if (JS_GetOpaque(poller->sockets[i], js_zmq_socket_class_id) == s)
+            return i;
+    }
+    return -1;
+}
+
+static JSValue js_zmq_create_poller(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSValue obj = JS_NewObjectClass(ctx, js_zmq_poller_class_id);
+    if (JS_IsException(obj))
+        return obj;
+    JSZmqPoller* poller = js_mallocz(ctx, sizeof(JSZmqPoller));
+    if (!poller) {
+        JS_FreeValue(ctx, obj);
+        return JS_EXCEPTION;
+    }
+    JS_SetOpaque(obj, poller);
+    return obj;
+}
+
+/**
+ * Registers a socket with the poller for the given events (ZMQ_POLLIN by
+ * default), optionally with a callback(socket, revents) used by pollerDispatch.
+ * Registering a socket again updates its events and callback.
+ */
+static JSValue js_zmq_poller_add(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqPoller* poller = JS_GetOpaque2(ctx, argv[0], js_zmq_poller_class_id);
+    if (!poller)
+        return JS_EXCEPTION;
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[1]);
+    if (!s)
+        return JS_EXCEPTION;
+    int32_t events = ZMQ_POLLIN;
+    if (argc > 2 && !JS_IsUndefined(argv[2]))
+        JS_ToInt32(ctx, &events, argv[2]);
+    JSValue callback = argc > 3 && JS_IsFunction(ctx, argv[3]) ? JS_DupValue(ctx, argv[3]) : JS_UNDEFINED;
+
+    int index = js_zmq_poller_find(poller, s);
+    if (index >= 0) {
+        poller->items[index].events = (short)events;
+        JS_FreeValue(ctx, poller->callbacks[index]);
+        poller->callbacks[index] = callback;
+        return JS_UNDEFINED;
+    }
+    if (poller->count == poller->capacity) {
+        int capacity = poller->capacity ? poller->capacity * 2 : 8;
+        zmq_pollitem_t* items = js_realloc(ctx, poller->items, capacity * sizeof(zmq_pollitem_t));
+        if (items)
+            poller->items = items;
+        JSValue* sockets = js_realloc(ctx, poller->sockets, capacity * sizeof(JSValue));
+        if (sockets)
+            poller->sockets = sockets;
+        JSValue* callbacks = js_realloc(ctx, poller->callbacks, capacity * sizeof(JSValue));
+        if (callbacks)
+            poller->callbacks = callbacks;
+        if (!items || !sockets || !callbacks) {
+            JS_FreeValue(ctx, callback);
+            return JS_EXCEPTION;
+        }
+        poller->capacity = capacity;
+    }
+    index = poller->count++;
+    poller->items[index] = (zmq_pollitem_t){ .socket = s->handle, .fd = 0, .events = (short)events, .revents = 0 };
+    poller->sockets[index] = JS_DupValue(ctx, argv[1]);
+    poller->callbacks[index] = callback;
+    return JS_UNDEFINED;
+}
+
+static JSValue js_zmq_poller_remove(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqPoller* poller = JS_GetOpaque2(ctx, argv[0], js_zmq_poller_class_id);
+    if (!poller)
+        return JS_EXCEPTION;
+    JSZmqSocket* s = JS_GetOpaque2(ctx, argv[1], js_zmq_socket_class_id);
+    if (!s)
+        return JS_EXCEPTION;
+    int index = js_zmq_poller_find(poller, s);
+    if (index < 0)
+        return JS_FALSE;
+    JS_FreeValue(ctx, poller->sockets[index]);
+    JS_FreeValue(ctx, poller->callbacks[index]);
+    int last = --poller->count;
+    poller->items[index] = poller->items[last];
+    poller->sockets[index] = poller->sockets[last];
+    poller->callbacks[index] = poller->callbacks[last];
+    return JS_TRUE;
+}
+
+// Runs zmq_poll over all registered sockets. Returns the number of ready
+// sockets, 0 on timeout or interruption, or -1 with a pending exception.
+static int js_zmq_poller_poll(JSContext* ctx, JSZmqPoller* poller, JSValueConst timeoutVal) {
+    int64_t timeout = -1;
+    if (!JS_IsUndefined(timeoutVal))
+        JS_ToInt64(ctx, &timeout, timeoutVal);
+    js_zmq_reclaim(ctx);
+    // Sockets closed since they were registered are skipped; zmq_poll ignores
+    // items with no socket and a negative fd.
+    for (int i = 0; i < poller->count; i++) {
+        JSZmqSocket* s = JS_GetOpaque(poller->sockets[i], js_zmq_socket_class_id);
+        poller->items[i].socket = s->detached ? NULL : s->handle;
+        poller->items[i].fd = poller->items[i].socket ? 0 : -1;
+    }
+    int ready = zmq_poll(poller->items, poller->count, (long)timeout);
+    if (ready < 0) {
+        if (zmq_errno() == EINTR)
+            return 0;
+        JS_ThrowInternalError(ctx, "%s", zmq_strerror(zmq_errno()));
+        return -1;
+    }
+    return ready;
+}
+
+/**
+ * Waits up to timeout milliseconds (-1 waits forever, 0 just checks) and
+ * returns the array of registered socket handles that are ready.
+ */
+static JSValue js_zmq_poller_wait(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqPoller* poller = JS_GetOpaque2(ctx, argv[0], js_zmq_poller_class_id);
+    if (!poller)
+        return JS_EXCEPTION;
+    int ready = js_zmq_poller_poll(ctx, poller, argc > 1 ? argv[1] : JS_UNDEFINED);
+    if (ready < 0)
+        return JS_EXCEPTION;
+    JSValue result = JS_NewArray(ctx);
+    uint32_t index = 0;
+    for (int i = 0; i < poller->count && (int)index < ready; i++) {
+        if (poller->items[i].revents)
+            JS_SetPropertyUint32(ctx, result, index++, JS_DupValue(ctx, poller->sockets[i]));
+    }
+    return result;
+}
+
+/**
+ * Waits like pollerWait, then calls callback(socket, revents) for every ready
+ * socket registered with a callback. Returns the number of ready sockets.
+ */
+static JSValue js_zmq_poller_dispatch(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqPoller* poller = JS_GetOpaque2(ctx, argv[0], js_zmq_poller_class_id);
+    if (!poller)
+        return JS_EXCEPTION;
+    int ready = js_zmq_poller_poll(ctx, poller, argc > 1 ? argv[1] : JS_UNDEFINED);
+    if (ready <= 0)
+        return ready < 0 ? JS_EXCEPTION : JS_NewInt32(ctx, 0);
+    // Callbacks may add or remove sockets, so snapshot the ready set first.
+    JSValue* pending = js_malloc(ctx, ready * 3 * sizeof(JSValue));
+    if (!pending)
+        return JS_EXCEPTION;
+    int pendingCount = 0;
+    for (int i = 0; i < poller->count && pendingCount < ready; i++) {
+        if (!poller->items[i].revents || JS_IsUndefined(poller->callbacks[i]))
+            continue;
+        pending[pendingCount * 3] = JS_DupValue(ctx, poller->callbacks[i]);
+        pending[pendingCount * 3 + 1] = JS_DupValue(ctx, poller->sockets[i]);
+        pending[pendingCount * 3 + 2] = JS_NewInt32(ctx, poller->items[i].revents);
+        pendingCount++;
+    }
+    JSValue result = JS_NewInt32(ctx, ready);
+    for (int i = 0; i < pendingCount; i++) {
+        if (!JS_IsException(result)) {
+            JSValue ret = JS_Call(ctx, pending[i * 3], JS_UNDEFINED, 2, &pending[i * 3 + 1]);
+            if (JS_IsException(ret))
+                result = JS_EXCEPTION;
+            JS_FreeValue(ctx, ret);
+        }
+        JS_FreeValue(ctx, pending[i * 3]);
+        JS_FreeValue(ctx, pending[i * 3 + 1]);
+    }
+    js_free(ctx, pending);
+    return result;
+}
+
+
+/***************************************************************
+ * Background I/O actor.
+ * A zactor thread takes over a socket and exchanges messages with the
+ * interpreter through two lock-free single-producer/single-consumer rings.
+ * Each direction has an eventfd wakeup; the inbound one is meant for
+ * os.setReadHandler. Network progress then continues during GC pauses and
+ * long callbacks, and libzmq work moves to a second core.
+ **************************************************************/
+#define JS_ZMQ_RING_SIZE 4096
+
+// One complete (possibly multipart) message in flight between threads.
+typedef struct JSZmqFrames {
+    uint32_t count;
+    zmq_msg_t parts[];
+} JSZmqFrames;
+
+typedef struct JSZmqRing {
+    JSZmqFrames* slots[JS_ZMQ_RING_SIZE];
+    size_t head; // next slot to read, only advanced by the consumer
+    size_t tail; // next slot to write, only advanced by the producer
+} JSZmqRing;
+
+static bool js_zmq_ring_push(JSZmqRing* ring, JSZmqFrames* frames) {
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    if (tail - head == JS_ZMQ_RING_SIZE)
+        return false;
+    ring->slots[tail & (JS_ZMQ_RING_SIZE - 1)] = frames;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static JSZmqFrames* js_zmq_ring_pop(JSZmqRing* ring) {
+    size_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    size_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+    if (head == tail)
+        return NULL;
+    JSZmqFrames* frames = ring->slots[head & (JS_ZMQ_RING_SIZE - 1)];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_RELEASE);
+    return frames;
+}
+
+static bool js_zmq_ring_full(JSZmqRing* ring) {
+    return __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) -
+           __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == JS_ZMQ_RING_SIZE;
+}
+
+static void js_zmq_frames_free(JSZmqFrames* frames) {
+    for (uint32_t i = 0; i < frames->count; i++)
+        zmq_msg_close(&frames->parts[i]);
+    free(frames);
+}
+
+static void js_zmq_eventfd_signal(int fd) {
+    uint64_t one = 1;
+    while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR)
+        ;
+}
+
+static void js_zmq_eventfd_clear(int fd) {
+    uint64_t value;
+    while (read(fd, &value, sizeof(value)) < 0 && errno == EINTR)
+        ;
+}
+
+typedef struct JSZmqActor {
+    zactor_t* actor;
+    JSValue socketVal;  // keeps the detached socket handle alive
+    JSZmqSocket* socket;
+    void* handle;       // libzmq socket, only touched by the actor thread
+    JSZmqRing inbound;  // actor thread -> interpreter
+    JSZmqRing outbound; // interpreter -> actor thread
+    int inboundFd;      // signalled when inbound gains messages
+    int outboundFd;     // signalled when outbound gains messages or inbound drains
+    int stalled;        // set by the actor thread while inbound is full
+    JSZmqFrames* unsent; // message the thread was retrying when it stopped
+} JSZmqActor;
+
+static JSClassID js_zmq_actor_class_id;
+
+// Sends one message and returns its size, or -1. Only the first part can fail
+// with EAGAIN since libzmq queues multipart messages atomically. The parts are
+// emptied on success. The interpreter leaves capture alone while the socket is
+// detached.
+static int64_t js_zmq_frames_send(void* sock, JSZmqCapture* capture, JSZmqFrames* frames) {
+    int64_t total = 0;
+    for (uint32_t i = 0; i < frames->count; i++) {
+        int more = i + 1 < frames->count ? ZMQ_SNDMORE : 0;
+        int sent = js_zmq_capture_send(capture, sock, &frames->parts[i], ZMQ_DONTWAIT | more);
+        if (sent < 0)
+            return -1;
+        total += sent;
+    }
+    return total;
+}
+
+// Receives one complete message, or returns NULL when nothing is queued.
+static JSZmqFrames* js_zmq_frames_recv(void* sock) {
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
+    if (zmq_msg_recv(&msg, sock, ZMQ_DONTWAIT) < 0) {
+        zmq_msg_close(&msg);
+        return NULL;
+    }
+    uint32_t capacity = zmq_msg_more(&msg) ? 4 : 1;
+    JSZmqFrames* frames = malloc(sizeof(JSZmqFrames) + capacity * sizeof(zmq_msg_t));
+    if (!frames) {
+        zmq_msg_close(&msg);
+        return NULL;
+    }
+    frames->count = 0;
+    while (true) {
+        if (frames->count == capacity) {
+            capacity *= 2;
+            JSZmqFrames* grown = realloc(frames, sizeof(JSZmqFrames) + capacity * sizeof(zmq_msg_t));
+            if (!grown) {
+                zmq_msg_close(&msg);
+                break;
+            }
+            frames = grown;
+        }
+        zmq_msg_init(&frames->parts[frames->count]);
+        zmq_msg_move(&frames->parts[frames->count++], &msg);
+        if (!zmq_msg_more(&frames->parts[frames->count - 1]))
+            break;
+        zmq_msg_init(&msg);
+        if (zmq_msg_recv(&msg, sock, ZMQ_DONTWAIT) < 0) {
+            zmq_msg_close(&msg);
+            break;
+        }
+    }
+    return frames;
+}
+
+static void js_zmq_actor_run(zsock_t* pipe, void* args) {
+    JSZmqActor* actor = args;
+    zmq_pollitem_t items[] = {
+        { zsock_resolve(pipe), 0, ZMQ_POLLIN, 0 },
+        { actor->handle, 0, ZMQ_POLLIN, 0 },
+        { NULL, actor->outboundFd, ZMQ_POLLIN, 0 },
+    };
+    JSZmqFrames* pendingOut = NULL;
+    zsock_signal(pipe, 0);
+    while (true) {
+        bool inboundFull = js_zmq_ring_full(&actor->inbound);
+        __atomic_store_n(&actor->stalled, inboundFull, __ATOMIC_SEQ_CST);
+        // Re-check after publishing the flag so a drain that raced with it
+        // cannot leave the thread asleep with room in the ring.
+        if (inboundFull && !js_zmq_ring_full(&actor->inbound))
+            continue;
+        items[1].events = (inboundFull ? 0 : ZMQ_POLLIN) | (pendingOut ? ZMQ_POLLOUT : 0);
+        if (zmq_poll(items, countof(items), -1) < 0) {
+            if (zmq_errno() == EINTR)
+                continue;
+            break;
+        }
+        if (items[0].revents & ZMQ_POLLIN) {
+            char* command = zstr_recv(pipe);
+            bool terminate = !command || strcmp(command, "$TERM") == 0;
+            zstr_free(&command);
+            if (terminate)
+                break;
+        }
+        if (items[2].revents & ZMQ_POLLIN)
+            js_zmq_eventfd_clear(actor->outboundFd);
+
+        // Messages count as sent once libzmq takes them; the interpreter may
+        // read and reset the counters concurrently (getSocketStats).
+        JSZmqStats* stats = &actor->socket->stats;
+        while (pendingOut || (pendingOut = js_zmq_ring_pop(&actor->outbound))) {
+            int64_t sent = js_zmq_frames_send(actor->handle, actor->socket->capture, pendingOut);
+            if (sent < 0 && zmq_errno() == EAGAIN)
+                break;
+            if (sent < 0) {
+                __atomic_fetch_add(&stats->sendErrors, 1, __ATOMIC_RELAXED);
+            } else {
+                __atomic_fetch_add(&stats->messagesOut, 1, __ATOMIC_RELAXED);
+                __atomic_fetch_add(&stats->bytesOut, sent, __ATOMIC_RELAXED);
+            }
+            js_zmq_frames_free(pendingOut);
+            pendingOut = NULL;
+        }
+
+        bool received = false;
+        while (!js_zmq_ring_full(&actor->inbound)) {
+            JSZmqFrames* frames = js_zmq_frames_recv(actor->handle);
+            if (!frames)
+                break;
+            js_zmq_ring_push(&actor->inbound, frames);
+            received = true;
+        }
+        if (received)
+            js_zmq_eventfd_signal(actor->inboundFd);
+    }
+    // It goes out before the rest of the outbound ring, see js_zmq_actor_stop.
+    actor->unsent = pendingOut;
+}
+
+// Stops the thread and hands the socket back to the interpreter. With flush,
+// messages the thread had not sent yet are sent directly, without blocking.
+// Returns how many outbound messages were dropped.
+static uint32_t js_zmq_actor_stop(JSRuntime* rt, JSZmqActor* actor, bool flush) {
+    if (!actor->actor)
+        return 0;
+    zactor_destroy(&actor->actor);
+    JSZmqFrames* frames;
+    while ((frames = js_zmq_ring_pop(&actor->inbound)))
+        js_zmq_frames_free(frames);
+    close(actor->inboundFd);
+    close(actor->outboundFd);
+    js_zmq_socket_reattach(rt, actor->socket);
+    JSZmqSocket* s = actor->socket;
+    uint32_t dropped = 0;
+    frames = actor->unsent;
+    actor->unsent = NULL;
+    for (; frames || (frames = js_zmq_ring_pop(&actor->outbound)); frames = NULL) {
+        if (!flush || !s->handle || js_zmq_send_msgs(s, frames->parts, frames->count, ZMQ_DONTWAIT) < 0)
+            dropped++;
+        js_zmq_frames_free(frames);
+    }
+    JS_FreeValueRT(rt, actor->socketVal);
+    actor->socketVal = JS_UNDEFINED;
+    return dropped;
+}
+
+static void js_zmq_actor_finalizer(JSRuntime* rt, JSValue val) {
+    JSZmqActor* actor = JS_GetOpaque(val, js_zmq_actor_class_id);
+    if (!actor)
+        return;
+    js_zmq_actor_stop(rt, actor, false);
+    free(actor);
+}
+
+static void js_zmq_actor_mark(JSRuntime* rt, JSValueConst val, JS_MarkFunc* mark_func) {
+    JSZmqActor* actor = JS_GetOpaque(val, js_zmq_actor_class_id);
+    if (actor)
+        JS_MarkValue(rt, actor->socketVal, mark_func);
+}
+
+static JSClassDef js_zmq_actor_class = {
+    "Actor",
+    .finalizer = js_zmq_actor_finalizer,
+    .gc_mark = js_zmq_actor_mark,
+};
+
+static JSZmqActor* js_zmq_actor_arg(JSContext* ctx, JSValueConst val) {
+    JSZmqActor* actor = JS_GetOpaque2(ctx, val, js_zmq_actor_class_id);
+    if (actor && !actor->actor) {
+        JS_ThrowTypeError(ctx, "actor is stopped");
+        return NULL;
+    }
+    return actor;
+}
+
+/**
+ * Moves a socket onto a background thread. Until actorStop the socket can only
+ * be used through actorSend/actorRecv; direct calls on it throw.
+ */
+static JSValue js_zmq_start_actor(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    if (!js_zmq_socket_get(ctx, argv[0]))
+        return JS_EXCEPTION;
+    JSValue obj = JS_NewObjectClass(ctx, js_zmq_actor_class_id);
+    if (JS_IsException(obj))
+        return obj;
+    JSZmqActor* actor = calloc(1, sizeof(JSZmqActor));
+    if (!actor) {
+        JS_FreeValue(ctx, obj);
+        return JS_ThrowOutOfMemory(ctx);
+    }
+    actor->socketVal = JS_UNDEFINED;
+    actor->inboundFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    actor->outboundFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (actor->inboundFd < 0 || actor->outboundFd < 0) {
+        if (actor->inboundFd >= 0)
+            close(actor->inboundFd);
+        if (actor->outboundFd >= 0)
+            close(actor->outboundFd);
+        free(actor);
+        JS_FreeValue(ctx, obj);
+        return JS_ThrowInternalError(ctx, "eventfd: %s", strerror(errno));
+    }
+    actor->socket = js_zmq_socket_detach(ctx, argv[0]);
+    actor->handle = actor->socket->handle;
+    actor->socketVal = JS_DupValue(ctx, argv[0]);
+    JS_SetOpaque(obj, actor);
+    // zactor_new returns once the thread has signalled that it is running.
+    actor->actor = zactor_new(js_zmq_actor_run, actor);
+    if (!actor->actor) {
+        close(actor->inboundFd);
+        close(actor->outboundFd);
+        js_zmq_socket_reattach(JS_GetRuntime(ctx), actor->socket);
+        JS_FreeValue(ctx, actor->socketVal);
+        actor->socketVal = JS_UNDEFINED;
+        JS_FreeValue(ctx, obj);
+        return JS_ThrowInternalError(ctx, "could not start actor thread");
+    }
+    return obj;
+}
+
+/**
+ * Returns the eventfd that becomes readable when received messages are ready;
+ * register it with os.setReadHandler.
+ */
+static JSValue js_zmq_actor_fd(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqActor* actor = js_zmq_actor_arg(ctx, argv[0]);
+    if (!actor)
+        return JS_EXCEPTION;
+    return JS_NewInt32(ctx, actor->inboundFd);
+}
+
+/**
+ * Takes up to max messages received by the actor thread, in the same shape as
+ * recvBatch. Never touches libzmq sockets.
+ */
+static JSValue js_zmq_actor_recv(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqActor* actor = js_zmq_actor_arg(ctx, argv[0]);
+    if (!actor)
+        return JS_EXCEPTION;
+    JSZmqSocket* s = actor->socket;
+    uint32_t max = 1024;
+    if (argc > 1 && !JS_IsUndefined(argv[1]))
+        JS_ToUint32(ctx, &max, argv[1]);
+    bool binary = argc > 2 && JS_ToBool(ctx, argv[2]);
+    js_zmq_reclaim(ctx);
+    js_zmq_stats_dispatch_end(s);
+    js_zmq_eventfd_clear(actor->inboundFd);
+    JSValue batch = JS_NewArray(ctx);
+    uint32_t received = 0;
+    JSZmqFrames* frames;
+    while (received < max && (frames = js_zmq_ring_pop(&actor->inbound))) {
+        JSValue entry;
+        uint32_t last = frames->count - 1;
+        if (last == 0) {
+            entry = js_zmq_msg_decode(ctx, s, &frames->parts[0], binary);
+        } else {
+            entry = JS_NewArray(ctx);
+            for (uint32_t i = 0; i <= last && !JS_IsException(entry); i++) {
+                JSValue frame;
+                if (i < last) {
+                    js_zmq_frame_in(s, &frames->parts[i]);
+                    frame = js_zmq_msg_to_value(ctx, &frames->parts[i], binary);
+                } else {
+                    frame = js_zmq_msg_decode(ctx, s, &frames->parts[i], binary);
+                }
+                if (JS_IsException(frame)) {
+                    JS_FreeValue(ctx, entry);
+                    entry = JS_EXCEPTION;
+                } else {
+                    JS_SetPropertyUint32(ctx, entry, i, frame);
+                }
+            }
+        }
+        js_zmq_frames_free(frames);
+        if (JS_IsException(entry)) {
+            // A payload that does not decode; messages still in the ring
+            // stay queued for the next call.
+            JS_FreeValue(ctx, batch);
+            batch = JS_EXCEPTION;
+            received++;
+            break;
+        }
+        JS_SetPropertyUint32(ctx, batch, received++, entry);
+    }
+    if (received > 0)
+        js_zmq_stats_dispatch_start(s);
+    // Leftovers would not raise another wakeup, so re-arm the eventfd.
+    if ((received == max || JS_IsException(batch)) &&
+        __atomic_load_n(&actor->inbound.tail, __ATOMIC_ACQUIRE) != actor->inbound.head)
+        js_zmq_eventfd_signal(actor->inboundFd);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (received > 0 && __atomic_load_n(&actor->stalled, __ATOMIC_SEQ_CST))
+        js_zmq_eventfd_signal(actor->outboundFd);
+    return batch;
+}
+
+/**
+ * Hands an array of messages (frames or arrays of frames, as in sendMany) to
+ * the actor thread. Returns how many were queued; fewer than requested means
+ * the outbound ring is full.
+ */
+static JSValue js_zmq_actor_send(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqActor* actor = js_zmq_actor_arg(ctx, argv[0]);
+    if (!actor)
+        return JS_EXCEPTION;
+    JSZmqSocket* s = actor->socket;
+    JSValueConst messages = argv[1];
+    js_zmq_reclaim(ctx);
+    JSValue lengthVal = JS_GetPropertyStr(ctx, messages, "length");
+    uint32_t count;
+    if (JS_ToUint32(ctx, &count, lengthVal) < 0) {
+        JS_FreeValue(ctx, lengthVal);
+        return JS_EXCEPTION;
+    }
+    JS_FreeValue(ctx, lengthVal);
+    uint32_t queued = 0;
+    for (; queued < count && !js_zmq_ring_full(&actor->outbound); queued++) {
+        JSValue message = JS_GetPropertyUint32(ctx, messages, queued);
+        bool multipart = JS_IsArray(ctx, message);
+        uint32_t parts = 1;
+        if (multipart) {
+            JSValue partsVal = JS_GetPropertyStr(ctx, message, "length");
+            JS_ToUint32(ctx, &parts, partsVal);
+            JS_FreeValue(ctx, partsVal);
+        }
+        JSZmqFrames* frames = parts ? malloc(sizeof(JSZmqFrames) + parts * sizeof(zmq_msg_t)) : NULL;
+        if (!frames) {
+            JS_FreeValue(ctx, message);
+            return parts ? JS_ThrowOutOfMemory(ctx) : JS_ThrowRangeError(ctx, "a multipart message needs at least one frame");
+        }
+        frames->count = 0;
+        for (uint32_t i = 0; i < parts; i++) {
+            JSValue frame = multipart ? JS_GetPropertyUint32(ctx, message, i) : JS_DupValue(ctx, message);
+            int rc = i + 1 < parts ?
+                js_zmq_msg_from_value(ctx, &frames->parts[i], frame) :
+                js_zmq_msg_encode(ctx, s, &frames->parts[i], frame);
+            JS_FreeValue(ctx, frame);
+            if (rc < 0) {
+                js_zmq_frames_free(frames);
+                JS_FreeValue(ctx, message);
+                return JS_EXCEPTION;
+            }
+            frames->count++;
+        }
+        JS_FreeValue(ctx, message);
+        js_zmq_ring_push(&actor->outbound, frames);
+    }
+    if (queued > 0)
+        js_zmq_eventfd_signal(actor->outboundFd);
+    return JS_NewUint32(ctx, queued);
+}
+
+/**
+ * Stops the actor thread and returns the socket to direct use. Messages the
+ * thread had not sent yet are sent on the socket without blocking; received
+ * messages not yet taken by actorRecv are dropped. Returns the number of
+ * outbound messages that could not be sent.
+ */
+static JSValue js_zmq_actor_stop_fn(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqActor* actor = JS_GetOpaque2(ctx, argv[0], js_zmq_actor_class_id);
+    if (!actor)
+        return JS_EXCEPTION;
+    js_zmq_reclaim(ctx);
+    return JS_NewUint32(ctx, js_zmq_actor_stop(JS_GetRuntime(ctx), actor, true));
+}
+
+
+/***************************************************************
+ * Proxy.
+ * Forwards messages between two sockets on a dedicated thread so brokers never
+ * move payloads through JS. JS steers it over an inproc PAIR with the
+ * zmq_proxy_steerable commands PAUSE, RESUME, TERMINATE and STATISTICS.
+ **************************************************************/
+typedef struct JSZmqProxyCounters {
+    uint64_t messagesIn;
+    uint64_t bytesIn;
+    uint64_t messagesOut;
+    uint64_t bytesOut;
+} JSZmqProxyCounters;
+
+typedef struct JSZmqProxy {
+    pthread_t thread;
+    bool running;
+    JSValue socketVals[3];     // frontend, backend and optional capture
+    JSZmqSocket* sockets[3];
+    void* control;             // JS end of the control pair
+    void* steer;               // proxy thread end of the control pair
+    JSZmqContext* context;     // keeps the pair's context alive, NULL for zsys
+    uint32_t sampleEvery;      // capture every Nth message, 0/1 = all of them
+    int exited;                // set by the thread when the proxy loop returns
+} JSZmqProxy;
+
+static JSClassID js_zmq_proxy_class_id;
+
+// How long proxyControl waits on the control pair, in ms. The proxy thread can
+// exit on a socket error at any time, and nothing would ever answer.
+#define JS_ZMQ_PROXY_CONTROL_TIMEOUT 1000
+
+// Moves one whole message between sockets. Every part is copied to capture as
+// well when sample is set; the capture never blocks the proxy, a full capture
+// socket just misses the sample. Returns 1 if a message was moved, 0 if none
+// was queued, -1 on error.
+static int js_zmq_proxy_move(void* from, void* to, void* capture, bool sample,
+                             JSZmqProxyCounters* in, JSZmqProxyCounters* out) {
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
+    int flags = ZMQ_DONTWAIT;
+    bool more;
+    do {
+        int size = zmq_msg_recv(&msg, from, flags);
+        if (size < 0) {
+            int error = zmq_errno();
+            zmq_msg_close(&msg);
+            return (flags & ZMQ_DONTWAIT) && error == EAGAIN ? 0 : -1;
+        }
+        // The remaining parts of a message arrive together with the first.
+        flags = 0;
+        more = zmq_msg_more(&msg);
+        in->bytesIn += size;
+        if (sample) {
+            zmq_msg_t copy;
+            zmq_msg_init(&copy);
+            zmq_msg_copy(&copy, &msg);
+            // Once the first part is accepted the rest is too, so a refused
+            // first part drops the whole sample rather than splitting it.
+            if (zmq_msg_send(&copy, capture, ZMQ_DONTWAIT | (more ? ZMQ_SNDMORE : 0)) < 0) {
+                zmq_msg_close(&copy);
+                sample = false;
+            }
+        }
+        if (zmq_msg_send(&msg, to, more ? ZMQ_SNDMORE : 0) < 0) {
+            zmq_msg_close(&msg);
+            return -1;
+        }
+        out->bytesOut += size;
+    } while (more);
+    in->messagesIn++;
+    out->messagesOut++;
+    return 1;
+}
+
+// zmq_proxy_steerable with sampled capture. Replies to STATISTICS like libzmq:
+// eight uint64 frames, frontend counters first.
+static int js_zmq_proxy_sampled(JSZmqProxy* proxy) {
+    void* frontend = proxy->sockets[0]->handle;
+    void* backend = proxy->sockets[1]->handle;
+    void* capture = proxy->sockets[2]->handle;
+    JSZmqProxyCounters counters[2] = { 0 };
+    uint64_t seen = 0;
+    bool paused = false;
+    zmq_pollitem_t items[] = {
+        { proxy->steer, 0, ZMQ_POLLIN, 0 },
+        { frontend, 0, ZMQ_POLLIN, 0 },
+        { backend, 0, ZMQ_POLLIN, 0 },
+    };
+    while (true) {
+        if (zmq_poll(items, paused ? 1 : countof(items), -1) < 0) {
+            if (zmq_errno() == EINTR)
+                continue;
+            return -1;
+        }
+        if (items[0].revents & ZMQ_POLLIN) {
+            char command[16] = { 0 };
+            int size = zmq_recv(proxy->steer, command, sizeof(command) - 1, 0);
+            if (size < 0)
+                return -1;
+            if (strcmp(command, "TERMINATE") == 0)
+                return 0;
+            if (strcmp(command, "PAUSE") == 0) {
+                paused = true;
+            } else if (strcmp(command, "RESUME") == 0) {
+                paused = false;
+            } else if (strcmp(command, "STATISTICS") == 0) {
+                uint64_t values[8] = {
+                    counters[0].messagesIn, counters[0].bytesIn, counters[0].messagesOut, counters[0].bytesOut,
+                    counters[1].messagesIn, counters[1].bytesIn, counters[1].messagesOut, counters[1].bytesOut,
+                };
+                for (int i = 0; i < 8; i++)
+                    zmq_send(proxy->steer, &values[i], sizeof(values[i]), i < 7 ? ZMQ_SNDMORE : 0);
+            }
+            continue;
+        }
+        if (paused)
+            continue;
+        // Forward in bounded bursts so one busy direction cannot starve the
+        // other or the control socket.
+        for (int side = 0; side < 2; side++) {
+            if (!(items[side + 1].revents & ZMQ_POLLIN))
+                continue;
+            void* from = side == 0 ? frontend : backend;
+            void* to = side == 0 ? backend : frontend;
+            for (int burst = 0; burst < 1000; burst++) {
+                bool sample = ++seen % proxy->sampleEvery == 0;
+                int rc = js_zmq_proxy_move(from, to, capture, sample, &counters[side], &counters[!side]);
+                if (rc < 0)
+                    return -1;
+                if (rc == 0) {
+                    seen--;
+                    break;
+                }
+            }
+        }
+    }
+}
+
+static void* js_zmq_proxy_run(void* arg) {
+    JSZmqProxy* proxy = arg;
+    void* capture = proxy->sockets[2] ? proxy->sockets[2]->handle : NULL;
+    if (capture && proxy->sampleEvery > 1)
+        js_zmq_proxy_sampled(proxy);
+    else
+        zmq_proxy_steerable(proxy->sockets[0]->handle, proxy->sockets[1]->handle, capture, proxy->steer);
+    __atomic_store_n(&proxy->exited, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+// Terminates the proxy thread and hands the sockets back to the interpreter.
+static void js_zmq_proxy_stop(JSRuntime* rt, JSZmqProxy* proxy) {
+    if (!proxy->running)
+        return;
+    zmq_send(proxy->control, "TERMINATE", 9, 0);
+    pthread_join(proxy->thread, NULL);
+    proxy->running = false;
+    int linger = 0;
+    zmq_setsockopt(proxy->control, ZMQ_LINGER, &linger, sizeof(linger));
+    zmq_setsockopt(proxy->steer, ZMQ_LINGER, &linger, sizeof(linger));
+    zmq_close(proxy->control);
+    zmq_close(proxy->steer);
+    if (proxy->context)
+        js_zmq_context_unref(proxy->context);
+    for (int i = 0; i < 3; i++) {
+        if (proxy->sockets[i])
+            js_zmq_socket_reattach(rt, proxy->sockets[i]);
+        JS_FreeValueRT(rt, proxy->socketVals[i]);
+        proxy->socketVals[i] = JS_UNDEFINED;
+        proxy->sockets[i] = NULL;
+    }
+}
+
+static void js_zmq_proxy_finalizer(JSRuntime* rt, JSValue val) {
+    JSZmqProxy* proxy = JS_GetOpaque(val, js_zmq_proxy_class_id);
+    if (!proxy)
+        return;
+    js_zmq_proxy_stop(rt, proxy);
+    js_free_rt(rt, proxy);
+}
+
+static void js_zmq_proxy_mark(JSRuntime* rt, JSValueConst val, JS_MarkFunc* mark_func) {
+    JSZmqProxy* proxy = JS_GetOpaque(val, js_zmq_proxy_class_id);
+    if (!proxy)
+        return;
+    for (int i = 0; i < 3; i++)
+        JS_MarkValue(rt, proxy->socketVals[i], mark_func);
+}
+
+static JSClassDef js_zmq_proxy_class = {
+    "Proxy",
+    .finalizer = js_zmq_proxy_finalizer,
+    .gc_mark = js_zmq_proxy_mark,
+};
+
+/**
+ * Starts forwarding between frontend and backend on a new thread, like
+ * zmq_proxy_steerable. With a capture socket, every sampleEvery-th message
+ * (default 1, i.e. all) is mirrored to it. The sockets belong to the proxy
+ * until it is terminated through proxyControl.
+ */
+static JSValue js_zmq_start_proxy(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    bool hasCapture = argc > 2 && !JS_IsUndefined(argv[2]) && !JS_IsNull(argv[2]);
+    uint32_t sampleEvery = 1;
+    if (argc > 3 && !JS_IsUndefined(argv[3]) && JS_ToUint32(ctx, &sampleEvery, argv[3]) < 0)
+        return JS_EXCEPTION;
+    JSZmqSocket* sockets[3] = { NULL };
+    for (int i = 0; i < (hasCapture ? 3 : 2); i++) {
+        sockets[i] = js_zmq_socket_get(ctx, argv[i]);
+        if (!sockets[i])
+            return JS_EXCEPTION;
+        for (int j = 0; j < i; j++) {
+            if (sockets[j] == sockets[i])
+                return JS_ThrowTypeError(ctx, "proxy sockets must be distinct");
+        }
+    }
+    JSValue obj = JS_NewObjectClass(ctx, js_zmq_proxy_class_id);
+    if (JS_IsException(obj))
+        return obj;
+    JSZmqProxy* proxy = js_mallocz(ctx, sizeof(JSZmqProxy));
+    if (!proxy) {
+        JS_FreeValue(ctx, obj);
+        return JS_EXCEPTION;
+    }
+    for (int i = 0; i < 3; i++)
+        proxy->socketVals[i] = JS_UNDEFINED;
+    proxy->sampleEvery = sampleEvery ? sampleEvery : 1;
+    JS_SetOpaque(obj, proxy);
+
+    // The control pair lives in the frontend's context (czmq's for zsock
+    // sockets); inproc only connects within one context.
+    JSZmqContext* context = sockets[0]->context;
+    void* zmqContext = context ? context->context : zsys_init();
+    char endpoint[64];
+    snprintf(endpoint, sizeof(endpoint), "inproc://quickjs-zmq-proxy-%p", (void*)proxy);
+    proxy->steer = zmq_socket(zmqContext, ZMQ_PAIR);
+    proxy->control = zmq_socket(zmqContext, ZMQ_PAIR);
+    if (!proxy->steer || !proxy->control ||
+        zmq_bind(proxy->steer, endpoint) != 0 || zmq_connect(proxy->control, endpoint) != 0) {
+        int error = zmq_errno();
+        if (proxy->steer)
+            zmq_close(proxy->steer);
+        if (proxy->control)
+            zmq_close(proxy->control);
+        JS_FreeValue(ctx, obj);
+        return JS_ThrowInternalError(ctx, "%s", zmq_strerror(error));
+    }
+    int timeout = JS_ZMQ_PROXY_CONTROL_TIMEOUT;
+    zmq_setsockopt(proxy->control, ZMQ_RCVTIMEO, &timeout, sizeof(timeout));
+    zmq_setsockopt(proxy->control, ZMQ_SNDTIMEO, &timeout, sizeof(timeout));
+    proxy->context = context ? js_zmq_context_ref(context) : NULL;
+    for (int i = 0; i < 3; i++) {
+        if (!sockets[i])
+            continue;
+        proxy->sockets[i] = js_zmq_socket_detach(ctx, argv[i]);
+        proxy->socketVals[i] = JS_DupValue(ctx, argv[i]);
+    }
+    proxy->running = true;
+    if (pthread_create(&proxy->thread, NULL, js_zmq_proxy_run, proxy) != 0) {
+        // Nothing runs yet, so stopping would wait for a TERMINATE reply that
+        // never comes; undo by hand.
+        proxy->running = false;
+        zmq_close(proxy->steer);
+        zmq_close(proxy->control);
+        if (proxy->context)
+            js_zmq_context_unref(proxy->context);
+        for (int i = 0; i < 3; i++) {
+            if (proxy->sockets[i])
+                js_zmq_socket_reattach(JS_GetRuntime(ctx), proxy->sockets[i]);
+            JS_FreeValue(ctx, proxy->socketVals[i]);
+            proxy->socketVals[i] = JS_UNDEFINED;
+        }
+        JS_FreeValue(ctx, obj);
+        return JS_ThrowInternalError(ctx, "could not start proxy thread");
+    }
+    return obj;
+}
+
+/**
+ * Sends a command to a running proxy: "PAUSE", "RESUME", "TERMINATE" or
+ * "STATISTICS". TERMINATE waits for the thread to finish and returns the
+ * sockets to direct use. STATISTICS returns {frontend, backend}, each with
+ * messagesIn, bytesIn, messagesOut and bytesOut, and throws if the proxy
+ * does not answer within a second.
+ */
+static JSValue js_zmq_proxy_control(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqProxy* proxy = JS_GetOpaque2(ctx, argv[0], js_zmq_proxy_class_id);
+    if (!proxy)
+        return JS_EXCEPTION;
+    if (!proxy->running)
+        return JS_ThrowTypeError(ctx, "proxy is terminated");
+    const char* command = JS_ToCString(ctx, argv[1]);
+    if (!command)
+        return JS_EXCEPTION;
+    JSValue result = JS_UNDEFINED;
+    if (strcmp(command, "TERMINATE") == 0) {
+        js_zmq_proxy_stop(JS_GetRuntime(ctx), proxy);
+    } else if (strcmp(command, "PAUSE") == 0 || strcmp(command, "RESUME") == 0) {
+        zmq_send(proxy->control, command, strlen(command), 0);
+    } else if (__atomic_load_n(&proxy->exited, __ATOMIC_ACQUIRE)) {
+        result = JS_ThrowInternalError(ctx, "proxy stopped on a socket error");
+    } else if (strcmp(command, "STATISTICS") == 0) {
+        uint64_t values[8] = { 0 };
+        // Drop what is left of a reply that arrived after an earlier timeout.
+        while (zmq_recv(proxy->control, &values[0], sizeof(values[0]), ZMQ_DONTWAIT) >= 0)
+            ;
+        bool answered = zmq_send(proxy->control, command, strlen(command), 0) >= 0;
+        for (int i = 0; i < 8 && answered; i++)
+            answered = zmq_recv(proxy->control, &values[i], sizeof(values[i]), 0) >= 0;
+        if (!answered) {
+            int error = zmq_errno();
+            JS_FreeCString(ctx, command);
+            if (error == EAGAIN)
+                return JS_ThrowInternalError(ctx, "proxy did not answer");
+            return JS_ThrowInternalError(ctx, "%s", zmq_strerror(error));
+        }
+        static const char* names[] = { "messagesIn", "bytesIn", "messagesOut", "bytesOut" };
+        result = JS_NewObject(ctx);
+        for (int side = 0; side < 2; side++) {
+            JSValue counters = JS_NewObject(ctx);
+            for (int i = 0; i < 4; i++)
+                JS_SetPropertyStr(ctx, counters, names[i], JS_NewInt64(ctx, values[side * 4 + i]));
+            JS_SetPropertyStr(ctx, result, side == 0 ? "frontend" : "backend", counters);
+        }
+    } else {
+        result = JS_ThrowRangeError(ctx, "unknown proxy command %s", command);
+    }
+    JS_FreeCString(ctx, command);
+    return result;
+}
+
+
+/***************************************************************
+ * Request/reply over DEALER and ROUTER.
+ * Clients tag every request with a 64-bit correlation id frame so any number
+ * of requests can be in flight on one socket; replies are matched natively
+ * and timeouts are tracked in a timer wheel instead of one JS timer each.
+ * Servers get the routing envelope as an opaque token that is sent back with
+ * the reply, so it never has to be decoded in JS.
+ **************************************************************/
+#define JS_ZMQ_WHEEL_SLOTS 4096 // one slot per millisecond, about 4s per turn
+
+typedef struct JSZmqPending {
+    uint64_t id;       // 0 marks a free slot; ids start at 1
+    uint64_t deadline; // in milliseconds
+} JSZmqPending;
+
+typedef struct JSZmqWheelSlot {
+    uint64_t* ids;
+    uint32_t count;
+    uint32_t capacity;
+} JSZmqWheelSlot;
+
+typedef struct JSZmqRpcClient {
+    JSValue socketVal;
+    uint64_t nextId;
+    JSZmqPending* pending; // open addressing, linear probing
+    size_t pendingCapacity;
+    size_t pendingCount;
+    // Ids are filed under the slot of their deadline. Entries are not removed
+    // when a reply arrives; expiry checks the pending table instead, and ids
+    // due more than one turn ahead are filed again.
+    JSZmqWheelSlot wheel[JS_ZMQ_WHEEL_SLOTS];
+    uint64_t wheelTime; // last millisecond processed
+} JSZmqRpcClient;
+
+static JSClassID js_zmq_rpc_client_class_id;
+static JSClassID js_zmq_envelope_class_id;
+
+static size_t js_zmq_pending_slot(JSZmqRpcClient* client, uint64_t id) {
+    return (size_t)(id * 0x9E3779B97F4A7C15ull) & (client->pendingCapacity - 1);
+}
+
+static JSZmqPending* js_zmq_pending_find(JSZmqRpcClient* client, uint64_t id) {
+    if (!client->pendingCount)
+        return NULL;
+    size_t mask = client->pendingCapacity - 1;
+    for (size_t i = js_zmq_pending_slot(client, id); client->pending[i].id; i = (i + 1) & mask) {
+        if (client->pending[i].id == id)
+            return &client->pending[i];
+    }
+    return NULL;
+}
+
+static int js_zmq_pending_insert(JSContext* ctx, JSZmqRpcClient* client, uint64_t id, uint64_t deadline) {
+    if ((client->pendingCount + 1) * 2 > client->pendingCapacity) {
+        size_t capacity = client->pendingCapacity ? client->pendingCapacity * 2 : 256;
+        JSZmqPending* table = js_mallocz(ctx, capacity * sizeof(JSZmqPending));
+        if (!table)
+            return -1;
+        JSZmqPending* old = client->pending;
+        size_t oldCapacity = client->pendingCapacity;
+        client->pending = table;
+        client->pendingCapacity = capacity;
+        for (size_t i = 0; i < oldCapacity; i++) {
+            if (!old[i].id)
+                continue;
+            size_t j = js_zmq_pending_slot(client, old[i].id);
+            while (table[j].id)
+                j = (j + 1) & (capacity - 1);
+            table[j] = old[i];
+        }
+        js_free(ctx, old);
+    }
+    size_t i = js_zmq_pending_slot(client, id);
+    while (client->pending[i].id)
+        i = (i + 1) & (client->pendingCapacity - 1);
+    client->pending[i].id = id;
+    client->pending[i].deadline = deadline;
+    client->pendingCount++;
+    return 0;
+}
+
+static void js_zmq_pending_remove(JSZmqRpcClient* client, JSZmqPending* entry) {
+    size_t mask = client->pendingCapacity - 1;
+    size_t i = entry - client->pending;
+    // Shift later entries of the probe run back so lookups never hit a hole.
+    for (size_t j = (i + 1) & mask; client->pending[j].id; j = (j + 1) & mask) {
+        size_t home = js_zmq_pending_slot(client, client->pending[j].id);
+        if (((j - home) & mask) >= ((j - i) & mask)) {
+            client->pending[i] = client->pending[j];
+            i = j;
+        }
+    }
+    client->pending[i].id = 0;
+    client->pendingCount--;
+}
+
+static int js_zmq_wheel_add(JSContext* ctx, JSZmqRpcClient* client, uint64_t id, uint64_t deadline) {
+    JSZmqWheelSlot* slot = &client->wheel[deadline % JS_ZMQ_WHEEL_SLOTS];
+    if (slot->count == slot->capacity) {
+        uint32_t capacity = slot->capacity ? slot->capacity * 2 : 8;
+        uint64_t* ids = js_realloc(ctx, slot->ids, capacity * sizeof(uint64_t));
+        if (!ids)
+            return -1;
+        slot->ids = ids;
+        slot->capacity = capacity;
+    }
+    slot->ids[slot->count++] = id;
+    return 0;
+}
+
+static JSValue js_zmq_rpc_socket(JSContext* ctx, JSZmqRpcClient* client, JSZmqSocket** s) {
+    *s = js_zmq_socket_get(ctx, client->socketVal);
+    return *s ? JS_UNDEFINED : JS_EXCEPTION;
+}
+
+static void js_zmq_rpc_client_finalizer(JSRuntime* rt, JSValue val) {
+    JSZmqRpcClient* client = JS_GetOpaque(val, js_zmq_rpc_client_class_id);
+    if (!client)
+        return;
+    JS_FreeValueRT(rt, client->socketVal);
+    for (int i = 0; i < JS_ZMQ_WHEEL_SLOTS; i++)
+        js_free_rt(rt, client->wheel[i].ids);
+    js_free_rt(rt, client->pending);
+    js_free_rt(rt, client);
+}
+
+static void js_zmq_rpc_client_mark(JSRuntime* rt, JSValueConst val, JS_MarkFunc* mark_func) {
+    JSZmqRpcClient* client = JS_GetOpaque(val, js_zmq_rpc_client_class_id);
+    if (client)
+        JS_MarkValue(rt, client->socketVal, mark_func);
+}
+
+static JSClassDef js_zmq_rpc_client_class = {
+    "RpcClient",
+    .finalizer = js_zmq_rpc_client_finalizer,
+    .gc_mark = js_zmq_rpc_client_mark,
+};
+
+static void js_zmq_envelope_finalizer(JSRuntime* rt, JSValue val) {
+    JSZmqFrames* envelope = JS_GetOpaque(val, js_zmq_envelope_class_id);
+    if (envelope)
+        js_zmq_frames_free(envelope);
+}
+
+static JSClassDef js_zmq_envelope_class = {
+    "Envelope",
+    .finalizer = js_zmq_envelope_finalizer,
+};
+
+/**
+ * Creates the request tracking state for a DEALER socket.
+ */
+static JSValue js_zmq_create_rpc_client(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    if (!js_zmq_socket_get(ctx, argv[0]))
+        return JS_EXCEPTION;
+    JSValue obj = JS_NewObjectClass(ctx, js_zmq_rpc_client_class_id);
+    if (JS_IsException(obj))
+        return obj;
+    JSZmqRpcClient* client = js_mallocz(ctx, sizeof(JSZmqRpcClient));
+    if (!client) {
+        JS_FreeValue(ctx, obj);
+        return JS_EXCEPTION;
+    }
+    client->socketVal = JS_DupValue(ctx, argv[0]);
+    client->nextId = 1;
+    client->wheelTime = js_zmq_now_us() / 1000;
+    JS_SetOpaque(obj, client);
+    return obj;
+}
+
+/**
+ * Sends payload as a request that expires after timeout milliseconds.
+ * Returns the request's correlation id, or -1 if libzmq refused the message
+ * (see errno()); sending never blocks.
+ */
+static JSValue js_zmq_rpc_send(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqRpcClient* client = JS_GetOpaque2(ctx, argv[0], js_zmq_rpc_client_class_id);
+    if (!client)
+        return JS_EXCEPTION;
+    JSZmqSocket* s;
+    if (JS_IsException(js_zmq_rpc_socket(ctx, client, &s)))
+        return JS_EXCEPTION;
+    int64_t timeout;
+    if (JS_ToInt64(ctx, &timeout, argv[2]) < 0)
+        return JS_EXCEPTION;
+    js_zmq_reclaim(ctx);
+    zmq_msg_t payload;
+    if (js_zmq_msg_encode(ctx, s, &payload, argv[1]) < 0)
+        return JS_EXCEPTION;
+    uint64_t id = client->nextId++;
+    uint64_t deadline = js_zmq_now_us() / 1000 + (timeout > 0 ? timeout : 0);
+    // rpcPoll has already swept wheelTime's slot; a deadline there would only
+    // come round again a full wheel turn later.
+    if (deadline <= client->wheelTime)
+        deadline = client->wheelTime + 1;
+    if (js_zmq_pending_insert(ctx, client, id, deadline) < 0 ||
+        js_zmq_wheel_add(ctx, client, id, deadline) < 0) {
+        zmq_msg_close(&payload);
+        JSZmqPending* entry = js_zmq_pending_find(client, id);
+        if (entry)
+            js_zmq_pending_remove(client, entry);
+        return JS_EXCEPTION;
+    }
+    // Nothing follows an accepted first frame, so only it can fail with EAGAIN.
+    int64_t sent = js_zmq_send_out(s, &id, sizeof(id), ZMQ_DONTWAIT | ZMQ_SNDMORE);
+    if (sent >= 0) {
+        int rc = js_zmq_msg_send_out(s, &payload, ZMQ_DONTWAIT);
+        sent = rc < 0 ? -1 : sent + rc;
+    }
+    js_zmq_stats_sent(s, sent);
+    if (sent < 0) {
+        zmq_msg_close(&payload);
+        js_zmq_pending_remove(client, js_zmq_pending_find(client, id));
+        return JS_NewInt32(ctx, -1);
+    }
+    return JS_NewInt64(ctx, id);
+}
+
+/**
+ * Collects replies and expired requests. Returns {replies, expired}: replies
+ * is an array of [id, payload] for up to max replies received, expired the ids
+ * whose timeout passed. Replies to expired or unknown requests are dropped.
+ */
+static JSValue js_zmq_rpc_poll(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqRpcClient* client = JS_GetOpaque2(ctx, argv[0], js_zmq_rpc_client_class_id);
+    if (!client)
+        return JS_EXCEPTION;
+    JSZmqSocket* s;
+    if (JS_IsException(js_zmq_rpc_socket(ctx, client, &s)))
+        return JS_EXCEPTION;
+    uint32_t max = 1024;
+    if (argc > 1 && !JS_IsUndefined(argv[1]))
+        JS_ToUint32(ctx, &max, argv[1]);
+    bool binary = argc > 2 && JS_ToBool(ctx, argv[2]);
+    js_zmq_reclaim(ctx);
+    js_zmq_stats_dispatch_end(s);
+
+    JSValue replies = JS_NewArray(ctx);
+    uint32_t received = 0;
+    JSZmqFrames* frames;
+    while (received < max && (frames = js_zmq_frames_recv(s->handle))) {
+        uint64_t id;
+        JSZmqPending* entry = NULL;
+        if (frames->count == 2 && zmq_msg_size(&frames->parts[0]) == sizeof(id)) {
+            memcpy(&id, zmq_msg_data(&frames->parts[0]), sizeof(id));
+            entry = js_zmq_pending_find(client, id);
+        }
+        // Everything but a decoded payload is accounted for here.
+        for (uint32_t i = 0; i < frames->count - (entry ? 1 : 0); i++)
+            js_zmq_frame_in(s, &frames->parts[i]);
+        if (entry) {
+            JSValue payload = js_zmq_msg_decode(ctx, s, &frames->parts[1], binary);
+            if (JS_IsException(payload)) {
+                // The request stays pending and expires if nothing better
+                // arrives.
+                js_zmq_frames_free(frames);
+                JS_FreeValue(ctx, replies);
+                return JS_EXCEPTION;
+            }
+            js_zmq_pending_remove(client, entry);
+            JSValue reply = JS_NewArray(ctx);
+            JS_SetPropertyUint32(ctx, reply, 0, JS_NewInt64(ctx, id));
+            JS_SetPropertyUint32(ctx, reply, 1, payload);
+            JS_SetPropertyUint32(ctx, replies, received++, reply);
+        }
+        js_zmq_frames_free(frames);
+    }
+    if (received > 0)
+        js_zmq_stats_dispatch_start(s);
+
+    JSValue expired = JS_NewArray(ctx);
+    uint32_t expiredCount = 0;
+    uint64_t now = js_zmq_now_us() / 1000;
+    uint64_t from = client->wheelTime + 1;
+    if (now - client->wheelTime > JS_ZMQ_WHEEL_SLOTS)
+        from = now - JS_ZMQ_WHEEL_SLOTS + 1; // a full turn visits every slot
+    // Every slot passed is swept, even with nothing in flight: it still holds
+    // the ids of answered requests and would not be visited again for a turn.
+    for (uint64_t t = from; t <= now; t++) {
+        JSZmqWheelSlot* slot = &client->wheel[t % JS_ZMQ_WHEEL_SLOTS];
+        if (!client->pendingCount) {
+            slot->count = 0;
+            continue;
+        }
+        uint32_t kept = 0;
+        for (uint32_t i = 0; i < slot->count; i++) {
+            JSZmqPending* entry = js_zmq_pending_find(client, slot->ids[i]);
+            if (!entry)
+                continue; // answered already
+            if (entry->deadline <= now) {
+                JS_SetPropertyUint32(ctx, expired, expiredCount++, JS_NewInt64(ctx, entry->id));
+                js_zmq_pending_remove(client, entry);
+            } else {
+                slot->ids[kept++] = slot->ids[i]; // due on a later turn
+            }
+        }
+        slot->count = kept;
+    }
+    client->wheelTime = now;
+
+    JSValue result = JS_NewObject(ctx);
+    JS_SetPropertyStr(ctx, result, "replies", replies);
+    JS_SetPropertyStr(ctx, result, "expired", expired);
+    return result;
+}
+
+/**
+ * Receives up to max requests from a ROUTER socket without blocking. Returns
+ * an array of [token, payload]; the token holds the routing envelope (every
+ * frame before the payload) and is passed to rpcServerReply.
+ */
+static JSValue js_zmq_rpc_server_recv(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    uint32_t max = 1024;
+    if (argc > 1 && !JS_IsUndefined(argv[1]))
+        JS_ToUint32(ctx, &max, argv[1]);
+    bool binary = argc > 2 && JS_ToBool(ctx, argv[2]);
+    js_zmq_reclaim(ctx);
+    js_zmq_stats_dispatch_end(s);
+    JSValue requests = JS_NewArray(ctx);
+    uint32_t received = 0;
+    JSZmqFrames* frames;
+    while (received < max && (frames = js_zmq_frames_recv(s->handle))) {
+        // Envelope frames here, the payload when it is decoded.
+        for (uint32_t i = 0; i + 1 < frames->count; i++)
+            js_zmq_frame_in(s, &frames->parts[i]);
+        if (frames->count < 2) {
+            js_zmq_frame_in(s, &frames->parts[0]);
+            js_zmq_frames_free(frames); // no envelope, nowhere to reply to
+            continue;
+        }
+        JSValue token = JS_NewObjectClass(ctx, js_zmq_envelope_class_id);
+        if (JS_IsException(token)) {
+            js_zmq_frames_free(frames);
+            JS_FreeValue(ctx, requests);
+            return token;
+        }
+        JSValue payload = js_zmq_msg_decode(ctx, s, &frames->parts[frames->count - 1], binary);
+        if (JS_IsException(payload)) {
+            js_zmq_frames_free(frames);
+            JS_FreeValue(ctx, token);
+            JS_FreeValue(ctx, requests);
+            return JS_EXCEPTION;
+        }
+        // The payload part is empty now and stays behind as spare capacity.
+        frames->count--;
+        JS_SetOpaque(token, frames);
+        JSValue request = JS_NewArray(ctx);
+        JS_SetPropertyUint32(ctx, request, 0, token);
+        JS_SetPropertyUint32(ctx, request, 1, payload);
+        JS_SetPropertyUint32(ctx, requests, received++, request);
+    }
+    if (received > 0)
+        js_zmq_stats_dispatch_start(s);
+    return requests;
+}
+
+/**
+ * Sends payload back along the envelope of a request token. The token is used
+ * up. Returns the number of bytes sent or -1 (see errno()).
+ */
+static JSValue js_zmq_rpc_server_reply(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    JSZmqFrames* envelope = JS_GetOpaque2(ctx, argv[1], js_zmq_envelope_class_id);
+    if (!envelope)
+        return JS_EXCEPTION;
+    js_zmq_reclaim(ctx);
+    zmq_msg_t payload;
+    if (js_zmq_msg_encode(ctx, s, &payload, argv[2]) < 0)
+        return JS_EXCEPTION;
+    JS_SetOpaque(argv[1], NULL);
+    int64_t sent = 0;
+    for (uint32_t i = 0; i < envelope->count && sent >= 0; i++) {
+        int rc = js_zmq_msg_send_out(s, &envelope->parts[i], ZMQ_DONTWAIT | ZMQ_SNDMORE);
+        sent = rc < 0 ? -1 : sent + rc;
+    }
+    if (sent >= 0) {
+        int rc = js_zmq_msg_send_out(s, &payload, ZMQ_DONTWAIT);
+        sent = rc < 0 ? -1 : sent + rc;
+    }
+    js_zmq_stats_sent(s, sent);
+    zmq_msg_close(&payload);
+    js_zmq_frames_free(envelope);
+    return JS_NewInt64(ctx, sent);
+}
+
+
+/***************************************************************
+ * Last value cache.
+ * Remembers the latest message of every topic published on an XPUB socket and
+ * replays the matching ones as soon as XPUB reports a new subscription, so
+ * late joiners do not wait a full publish interval for their first update.
+ * XPUB cannot address a single subscriber, so a replay reaches every
+ * subscriber of the topic and existing ones see its last value again.
+ * Topics are kept in a sorted array; a subscription prefix selects a
+ * contiguous range of it.
+ **************************************************************/
+typedef struct JSZmqLvcEntry {
+    zmq_msg_t topic;
+    zmq_msg_t payload; // shares the published message's content
+    uint64_t replayedIn; // last lvcPoll call that sent this entry
+} JSZmqLvcEntry;
+
+typedef struct JSZmqLvc {
+    JSValue socketVal;
+    JSZmqLvcEntry** entries; // sorted by topic bytes
+    size_t count;
+    size_t capacity;
+    uint64_t polls; // lvcPoll calls so far, numbered from 1
+} JSZmqLvc;
+
+static JSClassID js_zmq_lvc_class_id;
+
+static int js_zmq_topic_compare(const void* a, size_t aLength, const void* b, size_t bLength) {
+    int rc = memcmp(a, b, aLength < bLength ? aLength : bLength);
+    if (rc != 0)
+        return rc;
+    return aLength < bLength ? -1 : aLength > bLength;
+}
+
+// Index of the first entry whose topic is not less than the given bytes.
+static size_t js_zmq_lvc_lower_bound(JSZmqLvc* lvc, const void* topic, size_t length) {
+    size_t low = 0, high = lvc->count;
+    while (low < high) {
+        size_t mid = low + (high - low) / 2;
+        zmq_msg_t* entryTopic = &lvc->entries[mid]->topic;
+        if (js_zmq_topic_compare(zmq_msg_data(entryTopic), zmq_msg_size(entryTopic), topic, length) < 0)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return low;
+}
+
+static void js_zmq_lvc_finalizer(JSRuntime* rt, JSValue val) {
+    JSZmqLvc* lvc = JS_GetOpaque(val, js_zmq_lvc_class_id);
+    if (!lvc)
+        return;
+    for (size_t i = 0; i < lvc->count; i++) {
+        zmq_msg_close(&lvc->entries[i]->topic);
+        zmq_msg_close(&lvc->entries[i]->payload);
+        js_free_rt(rt, lvc->entries[i]);
+    }
+    js_free_rt(rt, lvc->entries);
+    JS_FreeValueRT(rt, lvc->socketVal);
+    js_free_rt(rt, lvc);
+}
+
+static void js_zmq_lvc_mark(JSRuntime* rt, JSValueConst val, JS_MarkFunc* mark_func) {
+    JSZmqLvc* lvc = JS_GetOpaque(val, js_zmq_lvc_class_id);
+    if (lvc)
+        JS_MarkValue(rt, lvc->socketVal, mark_func);
+}
+
+static JSClassDef js_zmq_lvc_class = {
+    "LastValueCache",
+    .finalizer = js_zmq_lvc_finalizer,
+    .gc_mark = js_zmq_lvc_mark,
+};
+
+/**
+ * Attaches a last value cache to an XPUB socket and turns on ZMQ_XPUB_VERBOSE
+ * so every subscription, including repeated ones, is reported.
+ */
+static JSValue js_zmq_create_lvc(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    int verbose = 1;
+    if (zmq_setsockopt(s->handle, ZMQ_XPUB_VERBOSE, &verbose, sizeof(verbose)) != 0)
+        return JS_ThrowTypeError(ctx, "last value caches need an XPUB socket");
+    JSValue obj = JS_NewObjectClass(ctx, js_zmq_lvc_class_id);
+    if (JS_IsException(obj))
+        return obj;
+    JSZmqLvc* lvc = js_mallocz(ctx, sizeof(JSZmqLvc));
+    if (!lvc) {
+        JS_FreeValue(ctx, obj);
+        return JS_EXCEPTION;
+    }
+    lvc->socketVal = JS_DupValue(ctx, argv[0]);
+    JS_SetOpaque(obj, lvc);
+    return obj;
+}
+
+/**
+ * Publishes payload under topic as a two-frame message and keeps it as the
+ * topic's last value. The cache shares the message content, so published
+ * buffers must not be modified afterwards. Returns the bytes sent or -1.
+ */
+static JSValue js_zmq_lvc_publish(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqLvc* lvc = JS_GetOpaque2(ctx, argv[0], js_zmq_lvc_class_id);
+    if (!lvc)
+        return JS_EXCEPTION;
+    JSZmqSocket* s = js_zmq_socket_get(ctx, lvc->socketVal);
+    if (!s)
+        return JS_EXCEPTION;
+    js_zmq_reclaim(ctx);
+    zmq_msg_t topic, payload;
+    if (js_zmq_msg_from_value(ctx, &topic, argv[1]) < 0)
+        return JS_EXCEPTION;
+    if (js_zmq_msg_encode(ctx, s, &payload, argv[2]) < 0) {
+        zmq_msg_close(&topic);
+        return JS_EXCEPTION;
+    }
+
+    size_t index = js_zmq_lvc_lower_bound(lvc, zmq_msg_data(&topic), zmq_msg_size(&topic));
+    JSZmqLvcEntry* entry = NULL;
+    if (index < lvc->count &&
+        js_zmq_topic_compare(zmq_msg_data(&lvc->entries[index]->topic), zmq_msg_size(&lvc->entries[index]->topic),
+                             zmq_msg_data(&topic), zmq_msg_size(&topic)) == 0) {
+        entry = lvc->entries[index];
+        zmq_msg_close(&entry->payload);
+        zmq_msg_init(&entry->payload);
+    } else {
+        if (lvc->count == lvc->capacity) {
+            size_t capacity = lvc->capacity ? lvc->capacity * 2 : 64;
+            JSZmqLvcEntry** entries = js_realloc(ctx, lvc->entries, capacity * sizeof(JSZmqLvcEntry*));
+            if (!entries)
+                goto fail;
+            lvc->entries = entries;
+            lvc->capacity = capacity;
+        }
+        entry = js_malloc(ctx, sizeof(JSZmqLvcEntry));
+        if (!entry)
+            goto fail;
+        zmq_msg_init(&entry->topic);
+        zmq_msg_copy(&entry->topic, &topic);
+        zmq_msg_init(&entry->payload);
+        entry->replayedIn = 0;
+        memmove(&lvc->entries[index + 1], &lvc->entries[index], (lvc->count - index) * sizeof(JSZmqLvcEntry*));
+        lvc->entries[index] = entry;
+        lvc->count++;
+    }
+    zmq_msg_copy(&entry->payload, &payload);
+
+    int64_t sent = js_zmq_msg_send_out(s, &topic, ZMQ_DONTWAIT | ZMQ_SNDMORE);
+    if (sent >= 0) {
+        int rc = js_zmq_msg_send_out(s, &payload, ZMQ_DONTWAIT);
+        sent = rc < 0 ? -1 : sent + rc;
+    }
+    js_zmq_stats_sent(s, sent);
+    zmq_msg_close(&topic);
+    zmq_msg_close(&payload);
+    return JS_NewInt64(ctx, sent);
+fail:
+    zmq_msg_close(&topic);
+    zmq_msg_close(&payload);
+    return JS_EXCEPTION;
+}
+
+/**
+ * Processes the subscription messages queued on the XPUB socket, replaying
+ * the cached value of every topic matching a new subscription. Replies go to
+ * all subscribers of the topic. A topic is replayed at most once per call, so
+ * a burst of (re)subscriptions does not repeat it for each of them. Returns
+ * the number of cached messages sent.
+ */
+static JSValue js_zmq_lvc_poll(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqLvc* lvc = JS_GetOpaque2(ctx, argv[0], js_zmq_lvc_class_id);
+    if (!lvc)
+        return JS_EXCEPTION;
+    JSZmqSocket* s = js_zmq_socket_get(ctx, lvc->socketVal);
+    if (!s)
+        return JS_EXCEPTION;
+    js_zmq_reclaim(ctx);
+    uint64_t poll = ++lvc->polls;
+    uint32_t replayed = 0;
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
+    while (zmq_msg_recv(&msg, s->handle, ZMQ_DONTWAIT) >= 0) {
+        js_zmq_capture_in(s, &msg);
+        const uint8_t* data = zmq_msg_data(&msg);
+        size_t length = zmq_msg_size(&msg);
+        // Subscriptions are a 1 byte followed by the prefix; 0 unsubscribes.
+        if (length == 0 || data[0] != 1)
+            continue;
+        const uint8_t* prefix = data + 1;
+        size_t prefixLength = length - 1;
+        for (size_t i = js_zmq_lvc_lower_bound(lvc, prefix, prefixLength); i < lvc->count; i++) {
+            JSZmqLvcEntry* entry = lvc->entries[i];
+            if (zmq_msg_size(&entry->topic) < prefixLength ||
+                memcmp(zmq_msg_data(&entry->topic), prefix, prefixLength) != 0)
+                break; // past the range of topics sharing the prefix
+            if (entry->replayedIn == poll)
+                continue;
+            entry->replayedIn = poll;
+            zmq_msg_t topic, payload;
+            zmq_msg_init(&topic);
+            zmq_msg_init(&payload);
+            zmq_msg_copy(&topic, &entry->topic);
+            zmq_msg_copy(&payload, &entry->payload);
+            if (js_zmq_msg_send_out(s, &topic, ZMQ_DONTWAIT | ZMQ_SNDMORE) >= 0 &&
+                js_zmq_msg_send_out(s, &payload, ZMQ_DONTWAIT) >= 0)
+                replayed++;
+            zmq_msg_close(&topic);
+            zmq_msg_close(&payload);
+        }
+    }
+    zmq_msg_close(&msg);
+    return JS_NewUint32(ctx, replayed);
+}
+
+
+#ifdef ZMQ_BUILD_DRAFT_API
+/***************************************************************
+ * Draft thread-safe sockets.
+ * SERVER/CLIENT, RADIO/DISH, SCATTER/GATHER, PEER and CHANNEL sockets carry
+ * single-frame messages with a routing id or group attached instead of
+ * envelope frames, and may be shared by several threads.
+ **************************************************************/
+
+/**
+ * Publishes a thread-safe socket under name so other workers can open it with
+ * openSharedSocket. The socket stays open until every holder closed it.
+ */
+static JSValue js_zmq_share_socket(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    int threadSafe = 0;
+    size_t threadSafeLength = sizeof(threadSafe);
+    if (s->zsock || !s->context || zmq_getsockopt(s->handle, ZMQ_THREAD_SAFE, &threadSafe, &threadSafeLength) != 0 ||
+        !threadSafe)
+        return JS_ThrowTypeError(ctx, "only thread-safe sockets can be shared");
+    if (s->shared)
+        return JS_ThrowTypeError(ctx, "socket is already shared as '%s'", s->shared->name);
+    const char* name = JS_ToCString(ctx, argv[1]);
+    if (!name)
+        return JS_EXCEPTION;
+    size_t nameLength = strlen(name);
+    pthread_mutex_lock(&js_zmq_shared_sockets_lock);
+    JSZmqSharedSocket* shared = js_zmq_shared_sockets;
+    while (shared && strcmp(shared->name, name) != 0)
+        shared = shared->next;
+    if (shared) {
+        pthread_mutex_unlock(&js_zmq_shared_sockets_lock);
+        JS_ThrowTypeError(ctx, "a socket named '%s' is already shared", name);
+        JS_FreeCString(ctx, name);
+        return JS_EXCEPTION;
+    }
+    shared = malloc(sizeof(JSZmqSharedSocket) + nameLength + 1);
+    if (shared) {
+        shared->handle = s->handle;
+        shared->context = s->context;
+        shared->refCount = 1;
+        memcpy(shared->name, name, nameLength + 1);
+        shared->next = js_zmq_shared_sockets;
+        js_zmq_shared_sockets = shared;
+        s->shared = shared;
+    }
+    pthread_mutex_unlock(&js_zmq_shared_sockets_lock);
+    JS_FreeCString(ctx, name);
+    if (!shared)
+        return JS_ThrowOutOfMemory(ctx);
+    return JS_UNDEFINED;
+}
+
+/**
+ * Opens a socket published with shareSocket, typically from another worker.
+ * Returns null when no open socket has that name.
+ */
+static JSValue js_zmq_open_shared_socket(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    const char* name = JS_ToCString(ctx, argv[0]);
+    if (!name)
+        return JS_EXCEPTION;
+    pthread_mutex_lock(&js_zmq_shared_sockets_lock);
+    JSZmqSharedSocket* shared = js_zmq_shared_sockets;
+    while (shared && strcmp(shared->name, name) != 0)
+        shared = shared->next;
+    if (shared) {
+        shared->refCount++;
+        js_zmq_context_ref(shared->context);
+    }
+    pthread_mutex_unlock(&js_zmq_shared_sockets_lock);
+    JS_FreeCString(ctx, name);
+    if (!shared)
+        return JS_NULL;
+    JSValue obj = JS_NewObjectClass(ctx, js_zmq_socket_class_id);
+    JSZmqSocket* s = JS_IsException(obj) ? NULL : js_mallocz(ctx, sizeof(JSZmqSocket));
+    if (!s) {
+        void* handle = shared->handle;
+        JSZmqContext* context = shared->context;
+        JS_FreeValue(ctx, obj);
+        if (js_zmq_shared_release(shared))
+            zmq_close(handle);
+        js_zmq_context_unref(context);
+        return JS_EXCEPTION;
+    }
+    s->handle = shared->handle;
+    s->context = shared->context;
+    s->shared = shared;
+    JS_SetOpaque(obj, s);
+    return obj;
+}
+
+/**
+ * Sends one message to a peer of a SERVER or PEER socket, identified by the
+ * routing id of a message received from it. Returns the bytes queued or -1.
+ */
+static JSValue js_zmq_send_routed(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    uint32_t routingId;
+    int32_t flags = 0;
+    if (JS_ToUint32(ctx, &routingId, argv[2]) < 0 || (argc > 3 && JS_ToInt32(ctx, &flags, argv[3]) < 0))
+        return JS_EXCEPTION;
+    js_zmq_reclaim(ctx);
+    zmq_msg_t msg;
+    if (js_zmq_msg_encode(ctx, s, &msg, argv[1]) < 0)
+        return JS_EXCEPTION;
+    int sent = zmq_msg_set_routing_id(&msg, routingId);
+    if (sent == 0)
+        sent = js_zmq_msg_send_out(s, &msg, flags);
+    js_zmq_stats_sent(s, sent);
+    zmq_msg_close(&msg);
+    return JS_NewInt32(ctx, sent);
+}
+
+/**
+ * Sends one message to a group of a RADIO socket. Group names are at most
+ * ZMQ_GROUP_MAX_LENGTH bytes. Returns the bytes queued or -1.
+ */
+static JSValue js_zmq_send_group(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    int32_t flags = 0;
+    if (argc > 3 && JS_ToInt32(ctx, &flags, argv[3]) < 0)
+        return JS_EXCEPTION;
+    const char* group = JS_ToCString(ctx, argv[1]);
+    if (!group)
+        return JS_EXCEPTION;
+    js_zmq_reclaim(ctx);
+    zmq_msg_t msg;
+    if (js_zmq_msg_encode(ctx, s, &msg, argv[2]) < 0) {
+        JS_FreeCString(ctx, group);
+        return JS_EXCEPTION;
+    }
+    int sent = zmq_msg_set_group(&msg, group);
+    if (sent == 0)
+        sent = js_zmq_msg_send_out(s, &msg, flags);
+    js_zmq_stats_sent(s, sent);
+    zmq_msg_close(&msg);
+    JS_FreeCString(ctx, group);
+    return JS_NewInt32(ctx, sent);
+}
+
+/**
+ * Receives one message from a draft socket as {payload, routingId, group};
+ * routingId is 0 and group empty when the socket type sets neither. Returns
+ * null when nothing is queued and flags contains ZMQ_DONTWAIT.
+ */
+static JSValue js_zmq_recv_routed(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    int32_t flags = 0;
+    if (argc > 1)
+        JS_ToInt32(ctx, &flags, argv[1]);
+    bool binary = argc > 2 && JS_ToBool(ctx, argv[2]);
+    js_zmq_reclaim(ctx);
+    js_zmq_stats_dispatch_end(s);
+    zmq_msg_t msg;
+    zmq_msg_init(&msg);
+    if (zmq_msg_recv(&msg, s->handle, flags) < 0) {
+        int error = zmq_errno();
+        zmq_msg_close(&msg);
+        if (error == EAGAIN)
+            return JS_NULL;
+        return JS_ThrowInternalError(ctx, "%s", zmq_strerror(error));
+    }
+    uint32_t routingId = zmq_msg_routing_id(&msg);
+    const char* group = zmq_msg_group(&msg);
+    JSValue groupVal = JS_NewString(ctx, group ? group : "");
+    JSValue payload = js_zmq_msg_decode(ctx, s, &msg, binary);
+    if (JS_IsException(payload)) {
+        JS_FreeValue(ctx, groupVal);
+        return payload;
+    }
+    JSValue result = JS_NewObject(ctx);
+    JS_DefinePropertyValueStr(ctx, result, "payload", payload, JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, result, "routingId", JS_NewUint32(ctx, routingId), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, result, "group", groupVal, JS_PROP_C_W_E);
+    js_zmq_stats_dispatch_start(s);
+    return result;
+}
+
+// Subscribes a DISH socket to a group.
+static JSValue js_zmq_join_group(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    void* zmqSocketPtr = js_zmq_socket_arg(ctx, argv[0]);
+    if (!zmqSocketPtr)
+        return JS_EXCEPTION;
+    const char* group = JS_ToCString(ctx, argv[1]);
+    if (!group)
+        return JS_EXCEPTION;
+    int returnCode = zmq_join(zmqSocketPtr, group);
+    JS_FreeCString(ctx, group);
+    return JS_NewInt32(ctx, returnCode);
+}
+
+static JSValue js_zmq_leave_group(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    void* zmqSocketPtr = js_zmq_socket_arg(ctx, argv[0]);
+    if (!zmqSocketPtr)
+        return JS_EXCEPTION;
+    const char* group = JS_ToCString(ctx, argv[1]);
+    if (!group)
+        return JS_EXCEPTION;
+    int returnCode = zmq_leave(zmqSocketPtr, group);
+    JS_FreeCString(ctx, group);
+    return JS_NewInt32(ctx, returnCode);
+}
+#endif
+
+
+/***************************************************************
+ * Stream framing.
+ * ZMQ_STREAM sockets deliver raw TCP data in arbitrary chunks. A framer keeps
+ * a reassembly buffer per connection (routing id) and hands JS only complete
+ * frames. Connections are identified to JS by their routing id in hex.
+ **************************************************************/
+#define JS_ZMQ_FRAMING_U16_BE 1
+#define JS_ZMQ_FRAMING_U16_LE 2
+#define JS_ZMQ_FRAMING_U32_BE 3
+#define JS_ZMQ_FRAMING_U32_LE 4
+#define JS_ZMQ_FRAMING_LINE 5 // '\n' terminated, a trailing '\r' is dropped
+#define JS_ZMQ_FRAMING_HTTP 6 // HTTP/1.1 headers plus Content-Length body
+
+typedef struct JSZmqConnection {
+    struct JSZmqConnection* next;
+    uint8_t* data; // bytes of the incomplete frame received so far
+    size_t length;
+    size_t capacity;
+    size_t scanned; // bytes already searched for a delimiter
+    uint32_t hash;
+    uint8_t idLength;
+    uint8_t id[];
+} JSZmqConnection;
+
+typedef struct JSZmqFramer {
+    JSValue socketVal;
+    int framing;
+    size_t maxFrame; // larger frames are a protocol error and close the connection
+    JSZmqConnection** buckets;
+    size_t bucketCount; // power of two
+    size_t count;
+} JSZmqFramer;
+
+static JSClassID js_zmq_framer_class_id;
+
+static uint32_t js_zmq_fnv1a(const uint8_t* data, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++)
+        hash = (hash ^ data[i]) * 16777619u;
+    return hash;
+}
+
+static JSZmqConnection** js_zmq_framer_find(JSZmqFramer* f, const uint8_t* id, size_t idLength, uint32_t hash) {
+    JSZmqConnection** link = &f->buckets[hash & (f->bucketCount - 1)];
+    while (*link && ((*link)->hash != hash || (*link)->idLength != idLength || memcmp((*link)->id, id, idLength) != 0))
+        link = &(*link)->next;
+    return link;
+}
+
+static JSZmqConnection* js_zmq_framer_add(JSZmqFramer* f, const uint8_t* id, size_t idLength, uint32_t hash) {
+    if (f->count + 1 > f->bucketCount) {
+        size_t bucketCount = f->bucketCount * 2;
+        JSZmqConnection** buckets = calloc(bucketCount, sizeof(JSZmqConnection*));
+        if (buckets) {
+            for (size_t i = 0; i < f->bucketCount; i++) {
+                for (JSZmqConnection* c = f->buckets[i], *next; c; c = next) {
+                    next = c->next;
+                    c->next = buckets[c->hash & (bucketCount - 1)];
+                    buckets[c->hash & (bucketCount - 1)] = c;
+                }
+            }
+            free(f->buckets);
+            f->buckets = buckets;
+            f->bucketCount = bucketCount;
+        }
+    }
+    JSZmqConnection* c = calloc(1, sizeof(JSZmqConnection) + idLength);
+    if (!c)
+        return NULL;
+    c->hash = hash;
+    c->idLength = idLength;
+    memcpy(c->id, id, idLength);
+    JSZmqConnection** bucket = &f->buckets[hash & (f->bucketCount - 1)];
+    c->next = *bucket;
+    *bucket = c;
+    f->count++;
+    return c;
+}
+
+static void js_zmq_framer_remove(JSZmqFramer* f, JSZmqConnection** link) {
+    JSZmqConnection* c = *link;
+    *link = c->next;
+    f->count--;
+    free(c->data);
+    free(c);
+}
+
+static void js_zmq_framer_finalizer(JSRuntime* rt, JSValue val) {
+    JSZmqFramer* f = JS_GetOpaque(val, js_zmq_framer_class_id);
+    if (!f)
+        return;
+    for (size_t i = 0; i < f->bucketCount; i++) {
+        while (f->buckets[i])
+            js_zmq_framer_remove(f, &f->buckets[i]);
+    }
+    free(f->buckets);
+    JS_FreeValueRT(rt, f->socketVal);
+    js_free_rt(rt, f);
+}
+
+static void js_zmq_framer_mark(JSRuntime* rt, JSValueConst val, JS_MarkFunc* mark_func) {
+    JSZmqFramer* f = JS_GetOpaque(val, js_zmq_framer_class_id);
+    if (f)
+        JS_MarkValue(rt, f->socketVal, mark_func);
+}
+
+static JSClassDef js_zmq_framer_class = {
+    "StreamFramer",
+    .finalizer = js_zmq_framer_finalizer,
+    .gc_mark = js_zmq_framer_mark,
+};
+
+static const uint8_t* js_zmq_find_bytes(const uint8_t* data, size_t length, const char* needle, size_t needleLength) {
+    for (size_t i = 0; i + needleLength <= length; i++) {
+        if (data[i] == (uint8_t)needle[0] && memcmp(data + i, needle, needleLength) == 0)
+            return data + i;
+    }
+    return NULL;
+}
+
+// Content-Length of an HTTP header block, 0 when there is none.
+static uint64_t js_zmq_http_content_length(const uint8_t* headers, size_t length) {
+    static const char name[] = "content-length:";
+    const uint8_t* line = headers;
+    const uint8_t* end = headers + length;
+    while (line < end) {
+        const uint8_t* eol = js_zmq_find_bytes(line, end - line, "\r\n", 2);
+        if (!eol)
+            eol = end;
+        if ((size_t)(eol - line) > sizeof(name) - 1 && strncasecmp((const char*)line, name, sizeof(name) - 1) == 0) {
+            const uint8_t* p = line + sizeof(name) - 1;
+            while (p < eol && (*p == ' ' || *p == '\t'))
+                p++;
+            uint64_t value = 0;
+            for (; p < eol && *p >= '0' && *p <= '9'; p++)
+                value = value > UINT64_MAX / 10 ? UINT64_MAX : value * 10 + (*p - '0');
+            return value;
+        }
+        line = eol + 2;
+    }
+    return 0;
+}
+
+// Looks for one complete frame at the start of data. Returns the bytes it
+// spans, 0 if more data is needed or -1 on a protocol error. *scanned carries
+// the delimiter search position over between calls on the same bytes.
+static int64_t js_zmq_framer_next(JSZmqFramer* f, const uint8_t* data, size_t length, size_t* scanned,
+                                  size_t* frameStart, size_t* frameLength) {
+    switch (f->framing) {
+    case JS_ZMQ_FRAMING_LINE: {
+        const uint8_t* eol = memchr(data + *scanned, '\n', length - *scanned);
+        if (!eol) {
+            *scanned = length;
+            return length > f->maxFrame ? -1 : 0;
+        }
+        size_t end = eol - data;
+        *frameStart = 0;
+        *frameLength = end > 0 && data[end - 1] == '\r' ? end - 1 : end;
+        // A whole line can arrive in one read, so the limit applies here too.
+        return *frameLength > f->maxFrame ? -1 : (int64_t)end + 1;
+    }
+    case JS_ZMQ_FRAMING_HTTP: {
+        size_t from = *scanned > 3 ? *scanned - 3 : 0;
+        const uint8_t* blank = js_zmq_find_bytes(data + from, length - from, "\r\n\r\n", 4);
+        if (!blank) {
+            *scanned = length;
+            return length > f->maxFrame ? -1 : 0;
+        }
+        size_t headerLength = blank - data + 4;
+        uint64_t contentLength = js_zmq_http_content_length(data, blank - data + 2);
+        if (contentLength > f->maxFrame || headerLength + contentLength > f->maxFrame)
+            return -1;
+        size_t total = headerLength + contentLength;
+        *scanned = headerLength - 1; // the headers need not be searched again
+        if (length < total)
+            return 0;
+        *frameStart = 0;
+        *frameLength = total;
+        return total;
+    }
+    default: {
+        size_t prefix = f->framing <= JS_ZMQ_FRAMING_U16_LE ? 2 : 4;
+        if (length < prefix)
+            return 0;
+        uint64_t size = 0;
+        bool bigEndian = f->framing == JS_ZMQ_FRAMING_U16_BE || f->framing == JS_ZMQ_FRAMING_U32_BE;
+        for (size_t i = 0; i < prefix; i++)
+            size |= (uint64_t)data[bigEndian ? i : prefix - 1 - i] << (8 * (prefix - 1 - i));
+        if (size > f->maxFrame)
+            return -1;
+        if (length < prefix + size)
+            return 0;
+        *frameStart = prefix;
+        *frameLength = size;
+        return prefix + size;
+    }
+    }
+}
+
+static int js_zmq_connection_append(JSZmqConnection* c, const uint8_t* data, size_t length) {
+    if (c->length + length > c->capacity) {
+        size_t capacity = c->capacity ? c->capacity : 256;
+        while (capacity < c->length + length)
+            capacity *= 2;
+        uint8_t* grown = realloc(c->data, capacity);
+        if (!grown)
+            return -1;
+        c->data = grown;
+        c->capacity = capacity;
+    }
+    memcpy(c->data + c->length, data, length);
+    c->length += length;
+    return 0;
+}
+
+static JSValue js_zmq_routing_id_hex(JSContext* ctx, const uint8_t* id, size_t length) {
+    static const char digits[] = "0123456789abcdef";
+    char hex[2 * 255];
+    for (size_t i = 0; i < length; i++) {
+        hex[2 * i] = digits[id[i] >> 4];
+        hex[2 * i + 1] = digits[id[i] & 15];
+    }
+    return JS_NewStringLen(ctx, hex, 2 * length);
+}
+
+// Decodes a hex connection id into id[255]. Returns its length or -1.
+static int js_zmq_routing_id_parse(JSContext* ctx, JSValueConst val, uint8_t* id) {
+    size_t length;
+    const char* hex = JS_ToCStringLen(ctx, &length, val);
+    if (!hex)
+        return -1;
+    int idLength = length % 2 == 0 && length <= 2 * 255 ? (int)length / 2 : -1;
+    for (int i = 0; i < idLength; i++) {
+        int high = hex[2 * i], low = hex[2 * i + 1];
+        high = high <= '9' ? high - '0' : (high | 0x20) - 'a' + 10;
+        low = low <= '9' ? low - '0' : (low | 0x20) - 'a' + 10;
+        if (high < 0 || high > 15 || low < 0 || low > 15) {
+            idLength = -1;
+            break;
+        }
+        id[i] = high << 4 | low;
+    }
+    JS_FreeCString(ctx, hex);
+    if (idLength < 0)
+        JS_ThrowTypeError(ctx, "invalid connection id");
+    return idLength;
+}
+
+static void js_zmq_framer_push(JSContext* ctx, JSValue events, uint32_t* count, JSValue id, JSValue payload) {
+    JSValue event = JS_NewArray(ctx);
+    JS_SetPropertyUint32(ctx, event, 0, id);
+    JS_SetPropertyUint32(ctx, event, 1, payload);
+    JS_SetPropertyUint32(ctx, events, (*count)++, event);
+}
+
+// Closes a STREAM connection: an empty frame to its routing id drops it.
+static void js_zmq_stream_disconnect(JSZmqSocket* s, const uint8_t* id, size_t idLength) {
+    if (js_zmq_send_out(s, id, idLength, ZMQ_DONTWAIT | ZMQ_SNDMORE) >= 0)
+        js_zmq_send_out(s, "", 0, ZMQ_DONTWAIT);
+}
+
+/**
+ * Attaches a framer to a ZMQ_STREAM socket. framing is one of the
+ * JS_ZMQ_FRAMING_* modes; frames over maxFrame bytes (default 1 MiB) close the
+ * connection.
+ */
+static JSValue js_zmq_create_stream_framer(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[0]);
+    if (!s)
+        return JS_EXCEPTION;
+    int32_t framing;
+    if (JS_ToInt32(ctx, &framing, argv[1]) < 0)
+        return JS_EXCEPTION;
+    if (framing < JS_ZMQ_FRAMING_U16_BE || framing > JS_ZMQ_FRAMING_HTTP)
+        return JS_ThrowRangeError(ctx, "unknown framing %d", framing);
+    int64_t maxFrame = 1 << 20;
+    if (argc > 2 && !JS_IsUndefined(argv[2]) && JS_ToInt64(ctx, &maxFrame, argv[2]) < 0)
+        return JS_EXCEPTION;
+    int type = 0;
+    size_t typeLength = sizeof(type);
+    if (zmq_getsockopt(s->handle, ZMQ_TYPE, &type, &typeLength) != 0 || type != ZMQ_STREAM)
+        return JS_ThrowTypeError(ctx, "stream framing needs a ZMQ_STREAM socket");
+    JSValue obj = JS_NewObjectClass(ctx, js_zmq_framer_class_id);
+    if (JS_IsException(obj))
+        return obj;
+    JSZmqFramer* f = js_mallocz(ctx, sizeof(JSZmqFramer));
+    if (f) {
+        f->bucketCount = 64;
+        f->buckets = calloc(f->bucketCount, sizeof(JSZmqConnection*));
+    }
+    if (!f || !f->buckets) {
+        if (f)
+            js_free(ctx, f);
+        JS_FreeValue(ctx, obj);
+        return JS_ThrowOutOfMemory(ctx);
+    }
+    f->socketVal = JS_DupValue(ctx, argv[0]);
+    f->framing = framing;
+    f->maxFrame = maxFrame > 0 ? (size_t)maxFrame : 1 << 20;
+    JS_SetOpaque(obj, f);
+    return obj;
+}
+
+/**
+ * Reads up to max chunks from the socket and returns what they completed:
+ * [id, frame] for each frame, [id, true] when a connection opens and
+ * [id, false] when it closes, including closes caused by framing errors.
+ */
+static JSValue js_zmq_framer_recv(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqFramer* f = JS_GetOpaque2(ctx, argv[0], js_zmq_framer_class_id);
+    if (!f)
+        return JS_EXCEPTION;
+    JSZmqSocket* s = js_zmq_socket_get(ctx, f->socketVal);
+    if (!s)
+        return JS_EXCEPTION;
+    uint32_t max = 1024;
+    if (argc > 1 && !JS_IsUndefined(argv[1]))
+        JS_ToUint32(ctx, &max, argv[1]);
+    bool binary = argc > 2 && JS_ToBool(ctx, argv[2]);
+    js_zmq_reclaim(ctx);
+    js_zmq_stats_dispatch_end(s);
+    JSValue events = JS_NewArray(ctx);
+    uint32_t count = 0;
+    JSZmqFrames* frames;
+    for (uint32_t chunks = 0; chunks < max && (frames = js_zmq_frames_recv(s->handle)); chunks++) {
+        for (uint32_t i = 0; i < frames->count; i++)
+            js_zmq_capture_in(s, &frames->parts[i]);
+        if (frames->count != 2 || zmq_msg_size(&frames->parts[0]) > 255) {
+            js_zmq_frames_free(frames);
+            continue;
+        }
+        const uint8_t* id = zmq_msg_data(&frames->parts[0]);
+        size_t idLength = zmq_msg_size(&frames->parts[0]);
+        const uint8_t* data = zmq_msg_data(&frames->parts[1]);
+        size_t length = zmq_msg_size(&frames->parts[1]);
+        uint32_t hash = js_zmq_fnv1a(id, idLength);
+        JSZmqConnection** link = js_zmq_framer_find(f, id, idLength, hash);
+        s->stats.bytesIn += length;
+        if (length == 0) {
+            // STREAM reports connects and disconnects as empty frames.
+            bool connected = !*link;
+            if (connected)
+                js_zmq_framer_add(f, id, idLength, hash);
+            else
+                js_zmq_framer_remove(f, link);
+            js_zmq_framer_push(ctx, events, &count, js_zmq_routing_id_hex(ctx, id, idLength), JS_NewBool(ctx, connected));
+            js_zmq_frames_free(frames);
+            continue;
+        }
+        JSZmqConnection* c = *link ? *link : js_zmq_framer_add(f, id, idLength, hash);
+        bool failed = !c;
+        if (c && c->length > 0) {
+            // Continue the buffered frame; otherwise frames are cut straight
+            // out of the chunk and only the remainder is copied.
+            failed = js_zmq_connection_append(c, data, length) < 0;
+            data = c->data;
+            length = c->length;
+        }
+        size_t offset = 0;
+        size_t scanned = c ? c->scanned : 0;
+        JSValue idVal = JS_UNDEFINED;
+        while (!failed) {
+            size_t frameStart = 0, frameLength = 0;
+            int64_t used = js_zmq_framer_next(f, data + offset, length - offset, &scanned, &frameStart, &frameLength);
+            if (used <= 0) {
+                failed = used < 0;
+                break;
+            }
+            const uint8_t* frame = data + offset + frameStart;
+            JSValue payload = binary ? JS_NewArrayBufferCopy(ctx, frame, frameLength) :
+                                       JS_NewStringLen(ctx, (const char*)frame, frameLength);
+            if (JS_IsUndefined(idVal))
+                idVal = js_zmq_routing_id_hex(ctx, id, idLength);
+            js_zmq_framer_push(ctx, events, &count, JS_DupValue(ctx, idVal), payload);
+            s->stats.messagesIn++;
+            offset += used;
+            scanned = 0;
+        }
+        if (!failed) {
+            if (c->length > 0) {
+                memmove(c->data, c->data + offset, length - offset);
+                c->length = length - offset;
+            } else if (offset < length) {
+                failed = js_zmq_connection_append(c, data + offset, length - offset) < 0;
+            }
+            c->scanned = scanned;
+        }
+        if (failed) {
+            js_zmq_stream_disconnect(s, id, idLength);
+            link = js_zmq_framer_find(f, id, idLength, hash);
+            if (*link)
+                js_zmq_framer_remove(f, link);
+            if (JS_IsUndefined(idVal))
+                idVal = js_zmq_routing_id_hex(ctx, id, idLength);
+            js_zmq_framer_push(ctx, events, &count, JS_DupValue(ctx, idVal), JS_FALSE);
+        }
+        JS_FreeValue(ctx, idVal);
+        js_zmq_frames_free(frames);
+    }
+    if (count > 0)
+        js_zmq_stats_dispatch_start(s);
+    return events;
+}
+
+/**
+ * Sends payload to a connection with the framer's framing applied: a length
+ * prefix, or a trailing '\n' for line framing. HTTP payloads go out as they
+ * are. Returns the bytes sent or -1.
+ */
+static JSValue js_zmq_framer_send(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqFramer* f = JS_GetOpaque2(ctx, argv[0], js_zmq_framer_class_id);
+    if (!f)
+        return JS_EXCEPTION;
+    JSZmqSocket* s = js_zmq_socket_get(ctx, f->socketVal);
+    if (!s)
+        return JS_EXCEPTION;
+    uint8_t id[255];
+    int idLength = js_zmq_routing_id_parse(ctx, argv[1], id);
+    if (idLength < 0)
+        return JS_EXCEPTION;
+    js_zmq_reclaim(ctx);
+    uint8_t* data;
+    size_t length;
+    JSValue holder = JS_UNDEFINED;
+    const char* string = NULL;
+    if (js_zmq_get_bytes(ctx, argv[2], &data, &length, &holder) < 0) {
+        string = JS_ToCStringLen(ctx, &length, argv[2]);
+        if (!string)
+            return JS_EXCEPTION;
+        data = (uint8_t*)string;
+    }
+    size_t prefix = f->framing <= JS_ZMQ_FRAMING_U16_LE ? 2 : f->framing <= JS_ZMQ_FRAMING_U32_LE ? 4 : 0;
+    size_t suffix = f->framing == JS_ZMQ_FRAMING_LINE ? 1 : 0;
+    int64_t sent = -2;
+    zmq_msg_t msg;
+    if (prefix == 2 && length > UINT16_MAX) {
+        JS_ThrowRangeError(ctx, "frame too long for a 16 bit length prefix");
+    } else if (prefix == 4 && length > UINT32_MAX) {
+        JS_ThrowRangeError(ctx, "frame too long for a 32 bit length prefix");
+    } else if (js_zmq_pool_msg(&msg, prefix + length + suffix) != 0) {
+        JS_ThrowOutOfMemory(ctx);
+    } else {
+        uint8_t* out = zmq_msg_data(&msg);
+        bool bigEndian = f->framing == JS_ZMQ_FRAMING_U16_BE || f->framing == JS_ZMQ_FRAMING_U32_BE;
+        for (size_t i = 0; i < prefix; i++)
+            out[bigEndian ? prefix - 1 - i : i] = (uint8_t)(length >> (8 * i));
+        memcpy(out + prefix, data, length);
+        if (suffix)
+            out[prefix + length] = '\n';
+        sent = js_zmq_send_out(s, id, idLength, ZMQ_DONTWAIT | ZMQ_SNDMORE);
+        if (sent >= 0) {
+            int rc = js_zmq_msg_send_out(s, &msg, ZMQ_DONTWAIT);
+            sent = rc < 0 ? -1 : sent + rc;
+        }
+        js_zmq_stats_sent(s, sent);
+        zmq_msg_close(&msg);
+    }
+    if (string)
+        JS_FreeCString(ctx, string);
+    JS_FreeValue(ctx, holder);
+    if (sent == -2)
+        return JS_EXCEPTION;
+    return JS_NewInt64(ctx, sent);
+}
+
+// Closes a connection and drops whatever partial frame it had buffered.
+static JSValue js_zmq_framer_close(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqFramer* f = JS_GetOpaque2(ctx, argv[0], js_zmq_framer_class_id);
+    if (!f)
+        return JS_EXCEPTION;
+    JSZmqSocket* s = js_zmq_socket_get(ctx, f->socketVal);
+    if (!s)
+        return JS_EXCEPTION;
+    uint8_t id[255];
+    int idLength = js_zmq_routing_id_parse(ctx, argv[1], id);
+    if (idLength < 0)
+        return JS_EXCEPTION;
+    js_zmq_stream_disconnect(s, id, idLength);
+    JSZmqConnection** link = js_zmq_framer_find(f, id, idLength, js_zmq_fnv1a(id, idLength));
+    if (*link)
+        js_zmq_framer_remove(f, link);
+    return JS_UNDEFINED;
+}
+
+
+/***************************************************************
+ * Capture replay.
+ * A capture file is mapped read-only and its messages are sent again on any
+ * socket, paced by the caller: replayCapture sends everything recorded up to a
+ * point in capture time, so JS can replay at the original pace, scaled, or as
+ * fast as the socket takes it.
+ **************************************************************/
+typedef struct JSZmqCaptureReader {
+    uint8_t* map;
+    size_t size;
+    size_t offset;   // next record
+    uint64_t start;  // timestamp of the first record
+} JSZmqCaptureReader;
+
+static JSClassID js_zmq_capture_reader_class_id;
+
+static void js_zmq_capture_reader_finalizer(JSRuntime* rt, JSValue val) {
+    JSZmqCaptureReader* reader = JS_GetOpaque(val, js_zmq_capture_reader_class_id);
+    if (!reader)
+        return;
+    munmap(reader->map, reader->size);
+    js_free_rt(rt, reader);
+}
+
+static JSClassDef js_zmq_capture_reader_class = {
+    "CaptureReader",
+    .finalizer = js_zmq_capture_reader_finalizer,
+};
+
+// Reads the record header at offset; false when none fits in the file.
+static bool js_zmq_capture_record(JSZmqCaptureReader* reader, size_t offset, JSZmqCaptureRecord* record) {
+    if (offset + sizeof(JSZmqCaptureRecord) > reader->size)
+        return false;
+    memcpy(record, reader->map + offset, sizeof(JSZmqCaptureRecord));
+    return record->length <= reader->size - offset - sizeof(JSZmqCaptureRecord);
+}
+
+/**
+ * Maps a file written by setSocketCapture for replayCapture. Returns
+ * {reader, frames, duration} with the duration in nanoseconds.
+ */
+static JSValue js_zmq_open_capture(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    const char* path = JS_ToCString(ctx, argv[0]);
+    if (!path)
+        return JS_EXCEPTION;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    JS_FreeCString(ctx, path);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        int error = errno;
+        if (fd >= 0)
+            close(fd);
+        return JS_ThrowInternalError(ctx, "cannot open capture: %s", strerror(error));
+    }
+    uint8_t* map = st.st_size >= JS_ZMQ_CAPTURE_HEADER ?
+        mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+    close(fd);
+    if (map == MAP_FAILED || memcmp(map, JS_ZMQ_CAPTURE_MAGIC, 8) != 0) {
+        if (map != MAP_FAILED)
+            munmap(map, st.st_size);
+        return JS_ThrowTypeError(ctx, "not a capture file");
+    }
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+    JSValue obj = JS_NewObjectClass(ctx, js_zmq_capture_reader_class_id);
+    JSZmqCaptureReader* reader = JS_IsException(obj) ? NULL : js_mallocz(ctx, sizeof(JSZmqCaptureReader));
+    if (!reader) {
+        munmap(map, st.st_size);
+        JS_FreeValue(ctx, obj);
+        return JS_EXCEPTION;
+    }
+    reader->map = map;
+    reader->size = st.st_size;
+    reader->offset = JS_ZMQ_CAPTURE_HEADER;
+    JS_SetOpaque(obj, reader);
+    uint64_t frames = 0, last = 0;
+    JSZmqCaptureRecord record;
+    for (size_t offset = reader->offset; js_zmq_capture_record(reader, offset, &record);
+         offset += sizeof(record) + record.length) {
+        if (frames++ == 0)
+            reader->start = record.timestamp;
+        last = record.timestamp;
+    }
+    JSValue result = JS_NewObject(ctx);
+    JS_DefinePropertyValueStr(ctx, result, "reader", obj, JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, result, "frames", JS_NewInt64(ctx, frames), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, result, "duration", JS_NewFloat64(ctx, (double)(last - reader->start)), JS_PROP_C_W_E);
+    return result;
+}
+
+/**
+ * Sends the captured messages recorded up to until nanoseconds after the first
+ * record (Infinity for no limit), at most max of them, on sock. direction
+ * selects sent (0, the default), received (1) or all (2) messages. Returns
+ * {sent, next, blocked}: next is the capture time of the first message not yet
+ * sent, or -1 at the end of the file, and blocked tells that the socket
+ * refused a message with EAGAIN.
+ */
+static JSValue js_zmq_replay_capture(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqCaptureReader* reader = JS_GetOpaque2(ctx, argv[0], js_zmq_capture_reader_class_id);
+    if (!reader)
+        return JS_EXCEPTION;
+    JSZmqSocket* s = js_zmq_socket_get(ctx, argv[1]);
+    if (!s)
+        return JS_EXCEPTION;
+    double until = INFINITY;
+    uint32_t max = 1024;
+    int32_t direction = 0;
+    if (argc > 2 && !JS_IsUndefined(argv[2]) && JS_ToFloat64(ctx, &until, argv[2]) < 0)
+        return JS_EXCEPTION;
+    if (argc > 3 && !JS_IsUndefined(argv[3]) && JS_ToUint32(ctx, &max, argv[3]) < 0)
+        return JS_EXCEPTION;
+    if (argc > 4 && !JS_IsUndefined(argv[4]) && JS_ToInt32(ctx, &direction, argv[4]) < 0)
+        return JS_EXCEPTION;
+    js_zmq_reclaim(ctx);
+    uint32_t sent = 0;
+    bool blocked = false;
+    JSZmqCaptureRecord record;
+    while (sent < max && js_zmq_capture_record(reader, reader->offset, &record)) {
+        if ((double)(int64_t)(record.timestamp - reader->start) > until)
+            break;
+        // Find the extent of the message the record starts.
+        bool received = record.flags & JS_ZMQ_CAPTURE_RECEIVED;
+        size_t end = reader->offset;
+        uint32_t count = 0;
+        JSZmqCaptureRecord part = record;
+        while (true) {
+            end += sizeof(part) + part.length;
+            count++;
+            if (!(part.flags & JS_ZMQ_CAPTURE_MORE) || !js_zmq_capture_record(reader, end, &part))
+                break;
+        }
+        if (direction != 2 && received != (direction == 1)) {
+            reader->offset = end;
+            continue;
+        }
+        zmq_msg_t stackParts[8];
+        zmq_msg_t* parts = count > countof(stackParts) ? js_zmq_pool_alloc(count * sizeof(zmq_msg_t)) : stackParts;
+        if (!parts)
+            return JS_ThrowOutOfMemory(ctx);
+        uint32_t built = 0;
+        for (size_t offset = reader->offset; built < count; built++) {
+            memcpy(&part, reader->map + offset, sizeof(part));
+            if (js_zmq_pool_msg(&parts[built], part.length) != 0)
+                break;
+            memcpy(zmq_msg_data(&parts[built]), reader->map + offset + sizeof(part), part.length);
+            offset += sizeof(part) + part.length;
+        }
+        int64_t rc = built == count ? js_zmq_send_msgs(s, parts, count, ZMQ_DONTWAIT) : -1;
+        int error = zmq_errno();
+        for (uint32_t i = 0; i < built; i++)
+            zmq_msg_close(&parts[i]);
+        if (parts != stackParts)
+            js_zmq_pool_free(parts);
+        if (rc < 0) {
+            if (built == count && error == EAGAIN) {
+                blocked = true;
+                break;
+            }
+            return JS_ThrowInternalError(ctx, "%s", zmq_strerror(built == count ? error : ENOMEM));
+        }
+        reader->offset = end;
+        sent++;
+    }
+    JSValue result = JS_NewObject(ctx);
+    JS_DefinePropertyValueStr(ctx, result, "sent", JS_NewUint32(ctx, sent), JS_PROP_C_W_E);
+    double next = js_zmq_capture_record(reader, reader->offset, &record) ?
+        (double)(int64_t)(record.timestamp - reader->start) : -1;
+    JS_DefinePropertyValueStr(ctx, result, "next", JS_NewFloat64(ctx, next), JS_PROP_C_W_E);
+    JS_DefinePropertyValueStr(ctx, result, "blocked", JS_NewBool(ctx, blocked), JS_PROP_C_W_E);
+    return result;
+}
+
+
+/***************************************************************
+ * Sharded sender.
+ * Routes each message to one of several sockets by a consistent hash of its
+ * key, so messages with the same key always reach the same worker. Every
+ * shard owns virtualNodes points on a hash ring, placed by its name; adding or
+ * removing a shard only moves the keys of the ring segments it gains or loses.
+ **************************************************************/
+typedef struct JSZmqShard {
+    JSValue socketVal;
+    char* name;
+} JSZmqShard;
+
+typedef struct JSZmqRingPoint {
+    uint32_t hash;
+    uint32_t shard;
+} JSZmqRingPoint;
+
+typedef struct JSZmqShardedSender {
+    JSZmqShard* shards;
+    uint32_t shardCount;
+    uint32_t shardCapacity;
+    JSZmqRingPoint* ring; // sorted by hash
+    uint32_t ringCount;
+    uint32_t virtualNodes;
+    uint32_t keyFrame;  // frame holding the key of multipart messages
+    uint32_t keyOffset; // byte range holding the key of single payloads
+    int64_t keyLength;  // negative: up to the end
+} JSZmqShardedSender;
+
+static JSClassID js_zmq_sharded_class_id;
+
+// FNV-1a spreads poorly over the high bits on short inputs; finish it with
+// the murmur3 mixer before using it as a ring position.
+static uint32_t js_zmq_mix32(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6bu;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35u;
+    h ^= h >> 16;
+    return h;
+}
+
+static void js_zmq_sharded_finalizer(JSRuntime* rt, JSValue val) {
+    JSZmqShardedSender* sender = JS_GetOpaque(val, js_zmq_sharded_class_id);
+    if (!sender)
+        return;
+    for (uint32_t i = 0; i < sender->shardCount; i++) {
+        JS_FreeValueRT(rt, sender->shards[i].socketVal);
+        js_free_rt(rt, sender->shards[i].name);
+    }
+    js_free_rt(rt, sender->shards);
+    js_free_rt(rt, sender->ring);
+    js_free_rt(rt, sender);
+}
+
+static void js_zmq_sharded_mark(JSRuntime* rt, JSValueConst val, JS_MarkFunc* mark_func) {
+    JSZmqShardedSender* sender = JS_GetOpaque(val, js_zmq_sharded_class_id);
+    if (!sender)
+        return;
+    for (uint32_t i = 0; i < sender->shardCount; i++)
+        JS_MarkValue(rt, sender->shards[i].socketVal, mark_func);
+}
+
+static JSClassDef js_zmq_sharded_class = {
+    "ShardedSender",
+    .finalizer = js_zmq_sharded_finalizer,
+    .gc_mark = js_zmq_sharded_mark,
+};
+
+static int js_zmq_ring_compare(const void* a, const void* b) {
+    const JSZmqRingPoint* x = a;
+    const JSZmqRingPoint* y = b;
+    if (x->hash != y->hash)
+        return x->hash < y->hash ? -1 : 1;
+    return x->shard < y->shard ? -1 : x->shard > y->shard;
+}
+
+// Recomputes the ring after the shard list changed. Point positions depend
+// only on shard names, so shards that stay keep exactly the same points.
+static int js_zmq_sharded_rebuild(JSContext* ctx, JSZmqShardedSender* sender) {
+    uint32_t count = sender->shardCount * sender->virtualNodes;
+    JSZmqRingPoint* ring = count ? js_malloc(ctx, count * sizeof(JSZmqRingPoint)) : NULL;
+    if (count && !ring)
+        return -1;
+    char point[512];
+    for (uint32_t shard = 0, n = 0; shard < sender->shardCount; shard++) {
+        for (uint32_t i = 0; i < sender->virtualNodes; i++, n++) {
+            int length = snprintf(point, sizeof(point), "%s#%u", sender->shards[shard].name, i);
+            if (length >= (int)sizeof(point))
+                length = sizeof(point) - 1;
+            ring[n].hash = js_zmq_mix32(js_zmq_fnv1a((const uint8_t*)point, length));
+            ring[n].shard = shard;
+        }
+    }
+    if (count)
+        qsort(ring, count, sizeof(JSZmqRingPoint), js_zmq_ring_compare);
+    js_free(ctx, sender->ring);
+    sender->ring = ring;
+    sender->ringCount = count;
+    return 0;
+}
+
+// Hashes the key bytes [offset, offset + length) of a string or binary value,
+// clipped to the value.
+static int js_zmq_shard_hash(JSContext* ctx, JSValueConst val, uint32_t offset, int64_t length, uint32_t* hash) {
+    uint8_t* data;
+    size_t size;
+    JSValue holder = JS_UNDEFINED;
+    const char* string = NULL;
+    if (js_zmq_get_bytes(ctx, val, &data, &size, &holder) < 0) {
+        string = JS_ToCStringLen(ctx, &size, val);
+        if (!string)
+            return -1;
+        data = (uint8_t*)string;
+    }
+    size_t start = offset < size ? offset : size;
+    size_t end = length < 0 || (uint64_t)length > size - start ? size : start + length;
+    *hash = js_zmq_mix32(js_zmq_fnv1a(data + start, end - start));
+    if (string)
+        JS_FreeCString(ctx, string);
+    JS_FreeValue(ctx, holder);
+    return 0;
+}
+
+// Index of the shard owning hash: the first ring point at or after it.
+static uint32_t js_zmq_shard_lookup(JSZmqShardedSender* sender, uint32_t hash) {
+    uint32_t low = 0, high = sender->ringCount;
+    while (low < high) {
+        uint32_t mid = low + (high - low) / 2;
+        if (sender->ring[mid].hash < hash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return sender->ring[low == sender->ringCount ? 0 : low].shard;
+}
+
+/**
+ * Creates a sharded sender with virtualNodes ring points per shard (default
+ * 160). Keys are frame keyFrame of multipart messages (default 0) or bytes
+ * [keyOffset, keyOffset + keyLength) of single payloads (default all of it),
+ * unless shardSend is given one explicitly.
+ */
+static JSValue js_zmq_create_sharded_sender(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    uint32_t virtualNodes = 160, keyFrame = 0, keyOffset = 0;
+    int64_t keyLength = -1;
+    if ((argc > 0 && !JS_IsUndefined(argv[0]) && JS_ToUint32(ctx, &virtualNodes, argv[0]) < 0) ||
+        (argc > 1 && !JS_IsUndefined(argv[1]) && JS_ToUint32(ctx, &keyFrame, argv[1]) < 0) ||
+        (argc > 2 && !JS_IsUndefined(argv[2]) && JS_ToUint32(ctx, &keyOffset, argv[2]) < 0) ||
+        (argc > 3 && !JS_IsUndefined(argv[3]) && JS_ToInt64(ctx, &keyLength, argv[3]) < 0))
+        return JS_EXCEPTION;
+    if (virtualNodes == 0 || virtualNodes > 65536)
+        return JS_ThrowRangeError(ctx, "virtualNodes must be between 1 and 65536");
+    JSValue obj = JS_NewObjectClass(ctx, js_zmq_sharded_class_id);
+    if (JS_IsException(obj))
+        return obj;
+    JSZmqShardedSender* sender = js_mallocz(ctx, sizeof(JSZmqShardedSender));
+    if (!sender) {
+        JS_FreeValue(ctx, obj);
+        return JS_EXCEPTION;
+    }
+    sender->virtualNodes = virtualNodes;
+    sender->keyFrame = keyFrame;
+    sender->keyOffset = keyOffset;
+    sender->keyLength = keyLength;
+    JS_SetOpaque(obj, sender);
+    return obj;
+}
+
+/**
+ * Adds sock as the shard called name, typically its endpoint. Names must be
+ * unique and stable: they decide which keys the shard takes over.
+ */
+static JSValue js_zmq_shard_add(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqShardedSender* sender = JS_GetOpaque2(ctx, argv[0], js_zmq_sharded_class_id);
+    if (!sender)
+        return JS_EXCEPTION;
+    if (!js_zmq_socket_get(ctx, argv[1]))
+        return JS_EXCEPTION;
+    const char* name = JS_ToCString(ctx, argv[2]);
+    if (!name)
+        return JS_EXCEPTION;
+    for (uint32_t i = 0; i < sender->shardCount; i++) {
+        if (strcmp(sender->shards[i].name, name) == 0) {
+            JS_ThrowTypeError(ctx, "shard '%s' already exists", name);
+            JS_FreeCString(ctx, name);
+            return JS_EXCEPTION;
+        }
+    }
+    if (sender->shardCount == sender->shardCapacity) {
+        uint32_t capacity = sender->shardCapacity ? sender->shardCapacity * 2 : 8;
+        JSZmqShard* shards = js_realloc(ctx, sender->shards, capacity * sizeof(JSZmqShard));
+        if (!shards) {
+            JS_FreeCString(ctx, name);
+            return JS_EXCEPTION;
+        }
+        sender->shards = shards;
+        sender->shardCapacity = capacity;
+    }
+    char* copy = js_strdup(ctx, name);
+    JS_FreeCString(ctx, name);
+    if (!copy)
+        return JS_EXCEPTION;
+    JSZmqShard* shard = &sender->shards[sender->shardCount++];
+    shard->socketVal = JS_DupValue(ctx, argv[1]);
+    shard->name = copy;
+    if (js_zmq_sharded_rebuild(ctx, sender) < 0) {
+        sender->shardCount--;
+        JS_FreeValue(ctx, shard->socketVal);
+        js_free(ctx, shard->name);
+        return JS_EXCEPTION;
+    }
+    return JS_UNDEFINED;
+}
+
+/**
+ * Removes the shard called name; its keys move to the neighbouring shards on
+ * the ring. Returns the shard's socket, or null if there was no such shard.
+ */
+static JSValue js_zmq_shard_remove(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqShardedSender* sender = JS_GetOpaque2(ctx, argv[0], js_zmq_sharded_class_id);
+    if (!sender)
+        return JS_EXCEPTION;
+    const char* name = JS_ToCString(ctx, argv[1]);
+    if (!name)
+        return JS_EXCEPTION;
+    uint32_t index = 0;
+    while (index < sender->shardCount && strcmp(sender->shards[index].name, name) != 0)
+        index++;
+    JS_FreeCString(ctx, name);
+    if (index == sender->shardCount)
+        return JS_NULL;
+    JSZmqShard removed = sender->shards[index];
+    memmove(&sender->shards[index], &sender->shards[index + 1],
+            (sender->shardCount - index - 1) * sizeof(JSZmqShard));
+    sender->shardCount--;
+    js_free(ctx, removed.name);
+    if (js_zmq_sharded_rebuild(ctx, sender) < 0) {
+        // The old ring still refers to shard indices; drop it rather than
+        // route to the wrong sockets.
+        js_free(ctx, sender->ring);
+        sender->ring = NULL;
+        sender->ringCount = 0;
+        JS_FreeValue(ctx, removed.socketVal);
+        return JS_EXCEPTION;
+    }
+    return removed.socketVal;
+}
+
+// Shard index for a message or explicit key, or -1 with a pending exception.
+static int64_t js_zmq_shard_route(JSContext* ctx, JSZmqShardedSender* sender, JSValueConst message, JSValueConst key) {
+    if (sender->ringCount == 0) {
+        JS_ThrowTypeError(ctx, "sharded sender has no shards");
+        return -1;
+    }
+    uint32_t hash;
+    int rc;
+    if (!JS_IsUndefined(key)) {
+        rc = js_zmq_shard_hash(ctx, key, 0, -1, &hash);
+    } else if (JS_IsArray(ctx, message)) {
+        JSValue frame = JS_GetPropertyUint32(ctx, message, sender->keyFrame);
+        rc = js_zmq_shard_hash(ctx, frame, 0, -1, &hash);
+        JS_FreeValue(ctx, frame);
+    } else {
+        rc = js_zmq_shard_hash(ctx, message, sender->keyOffset, sender->keyLength, &hash);
+    }
+    return rc < 0 ? -1 : (int64_t)js_zmq_shard_lookup(sender, hash);
+}
+
+/**
+ * Sends message (a payload, or an array of frames sent as one multipart
+ * message) to the shard owning its key, without blocking. Returns the bytes
+ * queued or -1 (see errno()).
+ */
+static JSValue js_zmq_shard_send(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqShardedSender* sender = JS_GetOpaque2(ctx, argv[0], js_zmq_sharded_class_id);
+    if (!sender)
+        return JS_EXCEPTION;
+    int64_t index = js_zmq_shard_route(ctx, sender, argv[1], argc > 2 ? argv[2] : JS_UNDEFINED);
+    if (index < 0)
+        return JS_EXCEPTION;
+    JSZmqSocket* s = js_zmq_socket_get(ctx, sender->shards[index].socketVal);
+    if (!s)
+        return JS_EXCEPTION;
+    js_zmq_reclaim(ctx);
+    int64_t sent;
+    if (JS_IsArray(ctx, argv[1])) {
+        sent = js_zmq_send_parts(ctx, s, argv[1], ZMQ_DONTWAIT);
+        if (sent == -2)
+            return JS_EXCEPTION;
+    } else {
+        zmq_msg_t msg;
+        if (js_zmq_msg_encode(ctx, s, &msg, argv[1]) < 0)
+            return JS_EXCEPTION;
+        sent = js_zmq_send_msgs(s, &msg, 1, ZMQ_DONTWAIT);
+        zmq_msg_close(&msg);
+    }
+    return JS_NewInt64(ctx, sent);
+}
+
+// Name of the shard a key maps to.
+static JSValue js_zmq_shard_for(JSContext* ctx, JSValueConst this_val, int argc, JSValue* argv) {
+    JSZmqShardedSender* sender = JS_GetOpaque2(ctx, argv[0], js_zmq_sharded_class_id);
+    if (!sender)
+        return JS_EXCEPTION;
+    int64_t index = js_zmq_shard_route(ctx, sender, JS_UNDEFINED, argv[1]);
+    if (index < 0)
+        return JS_EXCEPTION;
+    return JS_NewString(ctx, sender->shards[index].name);
+}
+
+
+static JSCFunctionListEntry funcs[] = {
+    JS_CFUNC_DEF("version", 0, js_zmq_version),
+    JS_CFUNC_DEF("createContext", 0, js_zmq_new_context),
+    JS_CFUNC_DEF("sharedContext", 0, js_zmq_shared_context_fn),
+    JS_CFUNC_DEF("destroyContext", 1, js_zmq_destroy_context),
+    JS_CFUNC_DEF("getContextOption", 2, js_zmq_get_context_option),
+    JS_CFUNC_DEF("setContextOption", 3, js_zmq_set_context_option),
+    JS_CFUNC_DEF("getSocketOption", 2, js_zmq_get_socket_option),
+    JS_CFUNC_DEF("setSocketOption", 3, js_zmq_set_socket_option),
+    JS_CFUNC_DEF("createSocket", 2, js_zmq_create_socket),
+    JS_CFUNC_DEF("closeSocket", 2, js_zmq_close_socket),
+    JS_CFUNC_DEF("bindSocket", 2, js_zmq_bind_socket),
+    JS_CFUNC_DEF("recvSocket", 2, js_zmq_recv_socket),
+    JS_CFUNC_DEF("recvBuffer", 2, js_zmq_recv_buffer),
+    JS_CFUNC_DEF("sendSocket", 3, js_zmq_send_socket),
+    JS_CFUNC_DEF("sendMultipart", 3, js_zmq_send_multipart),
+    JS_CFUNC_DEF("recvMultipart", 3, js_zmq_recv_multipart),
+    JS_CFUNC_DEF("sendMany", 3, js_zmq_send_many),
+    JS_CFUNC_DEF("recvBatch", 3, js_zmq_recv_batch),
+    JS_CFUNC_DEF("setSocketCodec", 2, js_zmq_set_socket_codec),
+    JS_CFUNC_DEF("setSocketCompression", 4, js_zmq_set_socket_compression),
+    JS_CFUNC_DEF("getSocketStats", 2, js_zmq_get_socket_stats),
+    JS_CFUNC_DEF("monitorSocket", 2, js_zmq_monitor_socket),
+    JS_CFUNC_DEF("readMonitorEvent", 1, js_zmq_read_monitor_event),
+    JS_CFUNC_DEF("getSocketFd", 1, js_zmq_get_socket_fd),
+    JS_CFUNC_DEF("getSocketEvents", 1, js_zmq_get_socket_events),
+    JS_CFUNC_DEF("createPoller", 0, js_zmq_create_poller),
+    JS_CFUNC_DEF("pollerAdd", 4, js_zmq_poller_add),
+    JS_CFUNC_DEF("pollerRemove", 2, js_zmq_poller_remove),
+    JS_CFUNC_DEF("pollerWait", 2, js_zmq_poller_wait),
+    JS_CFUNC_DEF("pollerDispatch", 2, js_zmq_poller_dispatch),
+    JS_CFUNC_DEF("startActor", 1, js_zmq_start_actor),
+    JS_CFUNC_DEF("actorFd", 1, js_zmq_actor_fd),
+    JS_CFUNC_DEF("actorRecv", 3, js_zmq_actor_recv),
+    JS_CFUNC_DEF("actorSend", 2, js_zmq_actor_send),
+    JS_CFUNC_DEF("actorStop", 1, js_zmq_actor_stop_fn),
+    JS_CFUNC_DEF("startProxy", 4, js_zmq_start_proxy),
+    JS_CFUNC_DEF("proxyControl", 2, js_zmq_proxy_control),
+    JS_CFUNC_DEF("createRpcClient", 1, js_zmq_create_rpc_client),
+    JS_CFUNC_DEF("rpcSend", 3, js_zmq_rpc_send),
+    JS_CFUNC_DEF("rpcPoll", 3, js_zmq_rpc_poll),
+    JS_CFUNC_DEF("rpcServerRecv", 3, js_zmq_rpc_server_recv),
+    JS_CFUNC_DEF("rpcServerReply", 3, js_zmq_rpc_server_reply),
+    JS_CFUNC_DEF("createLastValueCache", 1, js_zmq_create_lvc),
+    JS_CFUNC_DEF("lvcPublish", 3, js_zmq_lvc_publish),
+    JS_CFUNC_DEF("lvcPoll", 1, js_zmq_lvc_poll),
+    JS_CFUNC_DEF("getPoolStats", 1, js_zmq_get_pool_stats),
+    JS_CFUNC_DEF("setSocketSpool", 3, js_zmq_set_socket_spool),
+    JS_CFUNC_DEF("flushSpool", 1, js_zmq_flush_spool),
+    JS_CFUNC_DEF("getSpoolStats", 1, js_zmq_get_spool_stats),
+    JS_CFUNC_DEF("setSocketCapture", 2, js_zmq_set_socket_capture),
+    JS_CFUNC_DEF("openCapture", 1, js_zmq_open_capture),
+    JS_CFUNC_DEF("replayCapture", 5, js_zmq_replay_capture),
+    JS_CFUNC_DEF("createShardedSender", 4, js_zmq_create_sharded_sender),
+    JS_CFUNC_DEF("shardAdd", 3, js_zmq_shard_add),
+    JS_CFUNC_DEF("shardRemove", 2, js_zmq_shard_remove),
+    JS_CFUNC_DEF("shardSend", 3, js_zmq_shard_send),
+    JS_CFUNC_DEF("shardFor", 2, js_zmq_shard_for),
+    JS_CFUNC_DEF("createStreamFramer", 3, js_zmq_create_stream_framer),
+    JS_CFUNC_DEF("framerRecv", 3, js_zmq_framer_recv),
+    JS_CFUNC_DEF("framerSend", 3, js_zmq_framer_send),
+    JS_CFUNC_DEF("framerClose", 2, js_zmq_framer_close),
+#ifdef ZMQ_BUILD_DRAFT_API
+    JS_CFUNC_DEF("shareSocket", 2, js_zmq_share_socket),
+    JS_CFUNC_DEF("openSharedSocket", 1, js_zmq_open_shared_socket),
+    JS_CFUNC_DEF("sendRouted", 4, js_zmq_send_routed),
+    JS_CFUNC_DEF("sendGroup", 4, js_zmq_send_group),
+    JS_CFUNC_DEF("recvRouted", 3, js_zmq_recv_routed),
+    JS_CFUNC_DEF("joinGroup", 2, js_zmq_join_group),
+    JS_CFUNC_DEF("leaveGroup", 2, js_zmq_leave_group),
+#endif
+    JS_CFUNC_DEF("connectSocket", 2, js_zmq_connect_socket),
+    JS_CFUNC_DEF("strerror", 1, js_zmq_strerror),
+    JS_CFUNC_DEF("errno", 0, js_zmq_errno),
+    JS_PROP_INT32_DEF("EAGAIN", EAGAIN, JS_PROP_CONFIGURABLE),
+    JS_CFUNC_DEF("zsock_new", 1, js_zmq_zsock_new),
+    JS_CFUNC_DEF("zsock_new_pub", 1, js_zmq_zsock_new_pub),
+    JS_CFUNC_DEF("zsock_new_sub", 2, js_zmq_zsock_new_sub),
+    JS_CFUNC_DEF("zsock_new_req", 1, js_zmq_zsock_new_req),
+    JS_CFUNC_DEF("zsock_new_rep", 1, js_zmq_zsock_new_rep),
+    JS_CFUNC_DEF("zsock_new_dealer", 1, js_zmq_zsock_new_dealer),
+    JS_CFUNC_DEF("zsock_new_router", 1, js_zmq_zsock_new_router),
+    JS_CFUNC_DEF("zsock_new_push", 1, js_zmq_zsock_new_push),
+    JS_CFUNC_DEF("zsock_new_xpub", 1, js_zmq_zsock_new_xpub),
+    JS_CFUNC_DEF("zsock_new_xsub", 1, js_zmq_zsock_new_xsub),
+    JS_CFUNC_DEF("zsock_new_pair", 1, js_zmq_zsock_new_pair),
+    JS_CFUNC_DEF("zsock_new_stream", 1, js_zmq_zsock_new_stream),
+    JS_CFUNC_DEF("zsock_new_pull", 1, js_zmq_zsock_new_pull),
+    JS_CFUNC_DEF("zsock_destroy", 2, js_zmq_zsock_destroy),
+    JS_CFUNC_DEF("zsock_bind", 2, js_zmq_zsock_bind),
+    JS_CFUNC_DEF("zsock_connect", 2, js_zmq_zsock_connect),
+    JS_CFUNC_DEF("zsock_send", 2, js_zmq_zsock_send),
+    JS_CFUNC_DEF("zsock_recv", 1, js_zmq_zsock_recv),
+    JS_CFUNC_DEF("zsock_is", 1, js_zmq_zsock_is),
+    JS_CFUNC_DEF("zsock_resolve", 1, js_zmq_zsock_resolve),
+    JS_CFUNC_DEF("zsock_flush", 1, js_zmq_zsock_flush),
+    JS_CFUNC_DEF("zsock_unbind", 2, js_zmq_zsock_unbind),
+    JS_CFUNC_DEF("zsock_endpoint", 1, js_zmq_zsock_endpoint),
+    JS_CFUNC_DEF("zsock_disconnect", 2, js_zmq_zsock_disconnect),
+    JS_CFUNC_DEF("zsock_attach", 3, js_zmq_zsock_attach),
+    JS_CFUNC_DEF("zsock_type_str", 1, js_zmq_zsock_type_str),
+};
+
+
+static int init(JSContext *ctx, JSModuleDef *m) {
+    // Class ids are process-wide, but every runtime (e.g. each os.Worker)
+    // needs its own class registration.
+    JSRuntime* rt = JS_GetRuntime(ctx);
+    JS_NewClassID(&js_zmq_context_class_id);
+    if (!JS_IsRegisteredClass(rt, js_zmq_context_class_id))
+        JS_NewClass(rt, js_zmq_context_class_id, &js_zmq_context_class);
+    JS_NewClassID(&js_zmq_socket_class_id);
+    if (!JS_IsRegisteredClass(rt, js_zmq_socket_class_id))
+        JS_NewClass(rt, js_zmq_socket_class_id, &js_zmq_socket_class);
+    JS_NewClassID(&js_zmq_poller_class_id);
+    if (!JS_IsRegisteredClass(rt, js_zmq_poller_class_id))
+        JS_NewClass(rt, js_zmq_poller_class_id, &js_zmq_poller_class);
+    JS_NewClassID(&js_zmq_actor_class_id);
+    if (!JS_IsRegisteredClass(rt, js_zmq_actor_class_id))
+        JS_NewClass(rt, js_zmq_actor_class_id, &js_zmq_actor_class);
+    JS_NewClassID(&js_zmq_proxy_class_id);
+    if (!JS_IsRegisteredClass(rt, js_zmq_proxy_class_id))
+        JS_NewClass(rt, js_zmq_proxy_class_id, &js_zmq_proxy_class);
+    JS_NewClassID(&js_zmq_rpc_client_class_id);
+    if (!JS_IsRegisteredClass(rt, js_zmq_rpc_client_class_id))
+        JS_NewClass(rt, js_zmq_rpc_client_class_id, &js_zmq_rpc_client_class);
+    JS_NewClassID(&js_zmq_envelope_class_id);
+    if (!JS_IsRegisteredClass(rt, js_zmq_envelope_class_id))
+        JS_NewClass(rt, js_zmq_envelope_class_id, &js_zmq_envelope_class);
+    JS_NewClassID(&js_zmq_lvc_class_id);
+    if (!JS_IsRegisteredClass(rt, js_zmq_lvc_class_id))
+        JS_NewClass(rt, js_zmq_lvc_class_id, &js_zmq_lvc_class);
+    JS_NewClassID(&js_zmq_sharded_class_id);
+    if (!JS_IsRegisteredClass(rt, js_zmq_sharded_class_id))
+        JS_NewClass(rt, js_zmq_sharded_class_id, &js_zmq_sharded_class);
+    JS_NewClassID(&js_zmq_capture_reader_class_id);
+    if (!JS_IsRegisteredClass(rt, js_zmq_capture_reader_class_id))
+        JS_NewClass(rt, js_zmq_capture_reader_class_id, &js_zmq_capture_reader_class);
+    JS_NewClassID(&js_zmq_framer_class_id);
+    if (!JS_IsRegisteredClass(rt, js_zmq_framer_class_id))
+        JS_NewClass(rt, js_zmq_framer_class_id, &js_zmq_framer_class);
+    JS_SetModuleExportList(ctx, m, funcs, countof(funcs));
+    return 0;
+}
+
+// Loaded with dlopen, the module must export js_init_module; linked into an
+// interpreter (see the Makefile's static target) it gets a name of its own.
+#ifdef JS_SHARED_LIBRARY
+#define JS_INIT_MODULE js_init_module
+#else
+#define JS_INIT_MODULE js_init_module_zmq
+#endif
+
+JSModuleDef *JS_INIT_MODULE(JSContext *ctx, const char *module_name) {
     JSModuleDef *m;
     m = JS_NewCModule(ctx, module_name, init);
     if (!m)
         return NULL;
     JS_AddModuleExportList(ctx, m, funcs, countof(funcs));
     return m;
-}
\ No newline at end of file
+}
+
+#ifdef JS_ZMQ_PRECOMPILED
+// Wrapper bytecode generated by qjsc into quickjs-zmq-bytecode.c.
+extern const uint8_t qjsc_quickjs_zmq[];
+extern const uint32_t qjsc_quickjs_zmq_size;
+extern const uint8_t qjsc_quickjs_zsock[];
+extern const uint32_t qjsc_quickjs_zsock_size;
+
+/**
+ * Registers the native module and both precompiled wrappers with a statically
+ * linked interpreter, so importing quickjs-zmq.mjs or quickjs-zsock.mjs
+ * neither opens a shared library nor parses source.
+ */
+int js_zmq_init_static(JSContext *ctx) {
+    if (!JS_INIT_MODULE(ctx, "quickjs-zmq.so"))
+        return -1;
+    // Load only: the modules are evaluated when a script first imports them.
+    js_std_eval_binary(ctx, qjsc_quickjs_zmq, qjsc_quickjs_zmq_size, 1);
+    js_std_eval_binary(ctx, qjsc_quickjs_zsock, qjsc_quickjs_zsock_size, 1);
+    return 0;
+}
+#endif
\ No newline at end of file
@@ -23,7 +23,7 @@ SOFTWARE.
 */
 
 import * as zmq from './quickjs-zmq.so'
-import { setTimeout } from 'os';
+import * as os from 'os';
 
 export class Zmq {
     static version() {
@@ -44,10 +44,194 @@ export const ZMQ_PUSH=8
 export const ZMQ_XPUB=9
 export const ZMQ_XSUB=10
 export const ZMQ_STREAM=11
+// Draft socket types, only usable when libzmq is built with the draft API.
+// They are thread-safe and carry routing ids or groups on single-frame messages.
+export const ZMQ_SERVER=12
+export const ZMQ_CLIENT=13
+export const ZMQ_RADIO=14
+export const ZMQ_DISH=15
+export const ZMQ_GATHER=16
+export const ZMQ_SCATTER=17
+export const ZMQ_DGRAM=18
+export const ZMQ_PEER=19
+export const ZMQ_CHANNEL=20
 
+// Send/receive flags
+export const ZMQ_DONTWAIT=1
+export const ZMQ_SNDMORE=2
+
+// ZMQ_EVENTS bits
+export const ZMQ_POLLIN=1
+export const ZMQ_POLLOUT=2
+
+// Context options (see Socket.setContextOption)
+export const ZMQ_IO_THREADS=1
+export const ZMQ_MAX_SOCKETS=2
+export const ZMQ_SOCKET_LIMIT=3
+export const ZMQ_THREAD_PRIORITY=3
+export const ZMQ_THREAD_SCHED_POLICY=4
+export const ZMQ_MAX_MSGSZ=5
+export const ZMQ_THREAD_AFFINITY_CPU_ADD=7
+export const ZMQ_THREAD_AFFINITY_CPU_REMOVE=8
+export const ZMQ_BLOCKY=70
+
+// Socket options (see Socket.setSocketOption)
+export const ZMQ_AFFINITY=4
+export const ZMQ_ROUTING_ID=5
+export const ZMQ_SUBSCRIBE=6
+export const ZMQ_UNSUBSCRIBE=7
+export const ZMQ_SNDBUF=11
+export const ZMQ_RCVBUF=12
+export const ZMQ_RCVMORE=13
+export const ZMQ_TYPE=16
+export const ZMQ_LINGER=17
+export const ZMQ_RECONNECT_IVL=18
+export const ZMQ_BACKLOG=19
+export const ZMQ_RECONNECT_IVL_MAX=21
+export const ZMQ_MAXMSGSIZE=22
+export const ZMQ_SNDHWM=23
+export const ZMQ_RCVHWM=24
+export const ZMQ_RCVTIMEO=27
+export const ZMQ_SNDTIMEO=28
+export const ZMQ_LAST_ENDPOINT=32
+export const ZMQ_ROUTER_MANDATORY=33
+export const ZMQ_TCP_KEEPALIVE=34
+export const ZMQ_TCP_KEEPALIVE_CNT=35
+export const ZMQ_TCP_KEEPALIVE_IDLE=36
+export const ZMQ_TCP_KEEPALIVE_INTVL=37
+export const ZMQ_IMMEDIATE=39
+export const ZMQ_XPUB_VERBOSE=40
+export const ZMQ_IPV6=42
+export const ZMQ_MECHANISM=43
+export const ZMQ_PLAIN_SERVER=44
+export const ZMQ_PLAIN_USERNAME=45
+export const ZMQ_PLAIN_PASSWORD=46
+export const ZMQ_CURVE_SERVER=47
+export const ZMQ_CURVE_PUBLICKEY=48
+export const ZMQ_CURVE_SECRETKEY=49
+export const ZMQ_CURVE_SERVERKEY=50
+export const ZMQ_CONFLATE=54
+export const ZMQ_ZAP_DOMAIN=55
+export const ZMQ_TOS=57
+export const ZMQ_GSSAPI_SERVER=62
+export const ZMQ_GSSAPI_PRINCIPAL=63
+export const ZMQ_GSSAPI_SERVICE_PRINCIPAL=64
+export const ZMQ_GSSAPI_PLAINTEXT=65
+export const ZMQ_HANDSHAKE_IVL=66
+export const ZMQ_XPUB_NODROP=69
+export const ZMQ_HEARTBEAT_IVL=75
+export const ZMQ_HEARTBEAT_TTL=76
+export const ZMQ_HEARTBEAT_TIMEOUT=77
+export const ZMQ_CONNECT_TIMEOUT=79
+export const ZMQ_TCP_MAXRT=80
+export const ZMQ_VMCI_BUFFER_SIZE=85
+export const ZMQ_VMCI_BUFFER_MIN_SIZE=86
+export const ZMQ_VMCI_BUFFER_MAX_SIZE=87
+export const ZMQ_VMCI_CONNECT_TIMEOUT=88
+export const ZMQ_METADATA=95
+
+// zmq_socket_monitor events
+export const ZMQ_EVENT_CONNECTED=1
+export const ZMQ_EVENT_CONNECT_DELAYED=2
+export const ZMQ_EVENT_CONNECT_RETRIED=4
+export const ZMQ_EVENT_LISTENING=8
+export const ZMQ_EVENT_BIND_FAILED=16
+export const ZMQ_EVENT_ACCEPTED=32
+export const ZMQ_EVENT_ACCEPT_FAILED=64
+export const ZMQ_EVENT_CLOSED=128
+export const ZMQ_EVENT_CLOSE_FAILED=256
+export const ZMQ_EVENT_DISCONNECTED=512
+export const ZMQ_EVENT_MONITOR_STOPPED=1024
+export const ZMQ_EVENT_HANDSHAKE_FAILED_NO_DETAIL=2048
+export const ZMQ_EVENT_HANDSHAKE_SUCCEEDED=4096
+export const ZMQ_EVENT_HANDSHAKE_FAILED_PROTOCOL=8192
+export const ZMQ_EVENT_HANDSHAKE_FAILED_AUTH=16384
+
+// Which listener each monitor event is delivered to, and its name.
+const monitorEvents = {
+    [ZMQ_EVENT_CONNECTED]: ["connected", "connected"],
+    [ZMQ_EVENT_ACCEPTED]: ["connected", "accepted"],
+    [ZMQ_EVENT_HANDSHAKE_SUCCEEDED]: ["connected", "handshake_succeeded"],
+    [ZMQ_EVENT_DISCONNECTED]: ["disconnected", "disconnected"],
+    [ZMQ_EVENT_CONNECT_RETRIED]: ["disconnected", "connect_retried"],
+    [ZMQ_EVENT_BIND_FAILED]: ["error", "bind_failed"],
+    [ZMQ_EVENT_ACCEPT_FAILED]: ["error", "accept_failed"],
+    [ZMQ_EVENT_CLOSE_FAILED]: ["error", "close_failed"],
+    [ZMQ_EVENT_HANDSHAKE_FAILED_NO_DETAIL]: ["error", "handshake_failed"],
+    [ZMQ_EVENT_HANDSHAKE_FAILED_PROTOCOL]: ["error", "handshake_failed_protocol"],
+    [ZMQ_EVENT_HANDSHAKE_FAILED_AUTH]: ["error", "handshake_failed_auth"],
+};
+
+// The SERVER/CLIENT, RADIO/DISH and PEER bindings and shared sockets are only
+// compiled in with libzmq's draft API (make DRAFT=1).
+function draft(name) {
+    if (typeof zmq[name] !== "function")
+        throw new TypeError(`libzmq draft API not available: ${name} needs quickjs-zmq built with DRAFT=1`);
+    return zmq[name];
+}
+
+// Payload codecs (see Socket.setCodec)
+export const ZMQ_CODEC_RAW=0
+export const ZMQ_CODEC_OBJECT=1
+
+// Framings of raw TCP data on ZMQ_STREAM sockets (see StreamFramer)
+export const ZMQ_FRAMING_U16_BE=1
+export const ZMQ_FRAMING_U16_LE=2
+export const ZMQ_FRAMING_U32_BE=3
+export const ZMQ_FRAMING_U32_LE=4
+export const ZMQ_FRAMING_LINE=5
+export const ZMQ_FRAMING_HTTP=6
+
+
+/**
+ * A libzmq context, i.e. a pool of I/O threads for its sockets. Options are
+ * applied right away, before any socket exists, as libzmq requires:
+ *   ioThreads    number of I/O threads (libzmq's default is 1)
+ *   affinity     array of CPUs the I/O threads may run on
+ *   maxSockets   maximum number of sockets
+ *   schedPolicy  I/O thread scheduling policy (e.g. SCHED_FIFO)
+ *   priority     I/O thread priority under that policy
+ * Sockets keep their context alive; destroy() only drops this handle.
+ */
+export class Context {
+    /**
+     * The process-wide default context, created on first use and shared by
+     * every os.Worker so inproc:// endpoints connect across workers.
+     */
+    static shared() {
+        if (Context.sharedContext === undefined) {
+            Context.sharedContext = new Context({}, zmq.sharedContext());
+        }
+        return Context.sharedContext;
+    }
+
+    constructor(options={}, handle=zmq.createContext()) {
+        this.context = handle;
+        if (options.ioThreads !== undefined) this.setOption(ZMQ_IO_THREADS, options.ioThreads);
+        if (options.maxSockets !== undefined) this.setOption(ZMQ_MAX_SOCKETS, options.maxSockets);
+        if (options.schedPolicy !== undefined) this.setOption(ZMQ_THREAD_SCHED_POLICY, options.schedPolicy);
+        if (options.priority !== undefined) this.setOption(ZMQ_THREAD_PRIORITY, options.priority);
+        for (var cpu of options.affinity || []) {
+            this.setOption(ZMQ_THREAD_AFFINITY_CPU_ADD, cpu);
+        }
+    }
+
+    getOption(optionName) {
+        return zmq.getContextOption(this.context, optionName);
+    }
+
+    setOption(optionName, optionValue) {
+        if (zmq.setContextOption(this.context, optionName, optionValue) != 0) {
+            throw new Error(`context option ${optionName}: ${zmq.strerror(zmq.errno())}`);
+        }
+    }
+
+    destroy() {
+        zmq.destroyContext(this.context);
+    }
+}
 
 export class Socket {
-    static context = zmq.createContext();
     static errorCodeToString(errorCode) {
         return zmq.strerror(errorCode);
     }
@@ -56,8 +240,16 @@ export class Socket {
         return {"rc": errorCode, "description": Socket.errorCodeToString(errorCode)}
     }
 
-    constructor(type=ZMQ_REP) {
-        this.socket = zmq.createSocket(Socket.context, type);
+    // Maximum number of messages pulled per native call while draining.
+    static batchSize = 256;
+
+    static isBinary(message) {
+        return message instanceof ArrayBuffer || ArrayBuffer.isView(message);
+    }
+
+    constructor(type=ZMQ_REP, context=Context.shared(), handle=zmq.createSocket(context.context, type)) {
+        this.context = context;
+        this.socket = handle;
         // console.log(this.socket);
         // Set up event listeners.
         this.listeners = {
@@ -67,6 +259,21 @@ export class Socket {
             error: [] 
         };
         this.listening = false;
+        // When true, received messages are delivered as ArrayBuffers that own
+        // the message memory instead of being decoded as strings.
+        this.binary = false;
+        // When true, each "data" event carries the array of all frames of a
+        // multipart message.
+        this.multipart = false;
+        // When true (draft socket types), each "data" event carries
+        // {payload, routingId, group}.
+        this.routed = false;
+        this.codec = ZMQ_CODEC_RAW;
+        // Sends waiting for the socket to drop below its high-water mark.
+        this.sendQueue = [];
+        this.flushWaiters = [];
+        // True while messages wait in the overflow spool (see setSpool).
+        this.spooled = false;
     }
 
     on(event, cb) {
@@ -77,12 +284,13 @@ export class Socket {
     }
 
     destroy() {
-        zmq.destroySocket(this.socket);
-        zmq.destroyContext(this.context);
-        this.emit("disconnected", this.socket);
-        // this.socket = undefined;
-        // this.context = undefined;
         this.listening = false;
+        this.unwatch();
+        this.unmonitor();
+        // The shared context is terminated by the native layer once its last
+        // socket is gone.
+        zmq.closeSocket(this.socket);
+        this.emit("disconnected", this.socket);
     }
 
     emit(event, data={}) {
@@ -108,31 +316,164 @@ export class Socket {
         });
     }
 
-    async listen(address) {
-        // console.log("Inside listen");
-        var returnCode = await this.bind(address);
-        // console.log(`Socket bind returned with ${returnCode}`);
-        // if (returnCode < 0) {
-        //     throw
-        // }
-        // console.log("Socket is bound");
+    /**
+     * Calls onMessage for every message received. Receiving is driven by the
+     * os event loop: ZMQ_FD is edge-triggered, so each wakeup drains the socket
+     * with ZMQ_DONTWAIT until ZMQ_EVENTS drops ZMQ_POLLIN.
+     */
+    watch(onMessage) {
         this.listening = true;
-        while (this.listening) {
-            // console.log("Listening");
+        this.drain = () => {
             try {
-                // console.log("Receive");
-                var data = zmq.recvSocket(this.socket);
-                console.log(`Data: ${data}`);
-                this.emit("data", data);
-                zmq.sendSocket(this.socket, "OK");
-                // console.log("After data");
+                while (this.listening && (zmq.getSocketEvents(this.socket) & ZMQ_POLLIN)) {
+                    if (this.routed) {
+                        var message = draft("recvRouted")(this.socket, ZMQ_DONTWAIT, this.binary);
+                        if (message === null) break;
+                        onMessage(message);
+                        continue;
+                    }
+                    if (this.multipart) {
+                        var data = zmq.recvMultipart(this.socket, ZMQ_DONTWAIT, this.binary);
+                        if (data === null) break;
+                        onMessage(data);
+                        continue;
+                    }
+                    // Pull whatever is queued in one native call.
+                    var batch = zmq.recvBatch(this.socket, Socket.batchSize, this.binary);
+                    if (batch.length == 0) break;
+                    for (var i = 0; i < batch.length && this.listening; i++) {
+                        onMessage(batch[i]);
+                    }
+                }
             } catch (e) {
                 console.log(e);
                 this.destroy();
             }
+        };
+        this.updateHandler();
+        // Messages queued before the handler was installed will not raise a
+        // new edge, so pick them up now.
+        this.onEvents();
+    }
+
+    unwatch() {
+        this.drain = undefined;
+        this.updateHandler();
+    }
+
+    /**
+     * Delivers libzmq's own connection events to the listeners: "connected"
+     * on connect, accept and handshake, "disconnected" on disconnects and
+     * connect retries, "error" on bind, accept and handshake failures. Each
+     * event carries {event, name, value, endpoint}.
+     */
+    monitor() {
+        if (this.monitorSocket !== undefined) return;
+        this.monitorSocket = zmq.monitorSocket(this.socket);
+        this.monitorFd = zmq.getSocketFd(this.monitorSocket);
+        os.setReadHandler(this.monitorFd, () => this.readMonitor());
+        this.readMonitor();
+    }
+
+    readMonitor() {
+        var event;
+        while (this.monitorSocket !== undefined &&
+               (event = zmq.readMonitorEvent(this.monitorSocket)) !== null) {
+            var target = monitorEvents[event.event];
+            if (target) this.emit(target[0], Object.assign({name: target[1]}, event));
         }
     }
 
+    unmonitor() {
+        if (this.monitorSocket === undefined) return;
+        os.setReadHandler(this.monitorFd, null);
+        if (this.socket !== undefined) zmq.monitorSocket(this.socket, 0);
+        zmq.closeSocket(this.monitorSocket, 0);
+        this.monitorSocket = undefined;
+    }
+
+    // Replies to the peer a SERVER or PEER socket received routingId from.
+    sendTo(routingId, message, flags=0) {
+        return draft("sendRouted")(this.socket, this.encode(message), routingId, flags);
+    }
+
+    // Sends to every DISH socket that joined group.
+    sendGroup(group, message, flags=0) {
+        return draft("sendGroup")(this.socket, group, this.encode(message), flags);
+    }
+
+    join(group) {
+        return draft("joinGroup")(this.socket, group);
+    }
+
+    leave(group) {
+        return draft("leaveGroup")(this.socket, group);
+    }
+
+    /**
+     * Publishes this thread-safe socket under name; other workers open it with
+     * Socket.openShared(name) and may send and receive on it concurrently.
+     */
+    share(name) {
+        draft("shareSocket")(this.socket, name);
+    }
+
+    static openShared(name, context=Context.shared()) {
+        var handle = draft("openSharedSocket")(name);
+        return handle === null ? null : new Socket(undefined, context, handle);
+    }
+
+    /**
+     * Returns message and byte counters, high-water mark hits and the dispatch
+     * time histogram kept by the native layer; see getSocketStats.
+     */
+    stats(reset=false) {
+        return zmq.getSocketStats(this.socket, reset);
+    }
+
+    /**
+     * Hit and miss counts of the calling thread's message buffer pool, overall
+     * and per size class; misses that keep growing mean the pool is too small.
+     */
+    static poolStats(reset=false) {
+        return zmq.getPoolStats(reset);
+    }
+
+    /**
+     * Keeps the ZMQ_FD read handler installed while something needs it: a
+     * watch() receiver or sends waiting for ZMQ_POLLOUT.
+     */
+    updateHandler() {
+        var needed = this.drain !== undefined || this.sendQueue.length > 0 || this.spooled;
+        if (needed && this.fd === undefined) {
+            this.fd = zmq.getSocketFd(this.socket);
+            os.setReadHandler(this.fd, () => this.onEvents());
+        } else if (!needed && this.fd !== undefined) {
+            os.setReadHandler(this.fd, null);
+            this.fd = undefined;
+        }
+    }
+
+    onEvents() {
+        // Sending and receiving both reset the edge on ZMQ_FD, so keep going
+        // until neither side can make progress.
+        do {
+            if (this.sendQueue.length > 0 || this.spooled) this.flushQueue();
+            if (this.drain) this.drain();
+        } while ((this.sendQueue.length > 0 || this.spooled) && this.socket !== undefined &&
+                 (zmq.getSocketEvents(this.socket) & ZMQ_POLLOUT));
+    }
+
+    async listen(address) {
+        var returnCode = await this.bind(address);
+        this.watch((data) => {
+            console.log(`Data: ${data}`);
+            this.emit("data", data);
+            zmq.sendSocket(this.socket, "OK");
+        });
+        return returnCode;
+    }
+
     connect(address) {
         return new Promise((resolve, reject) => {
             var returnValue = zmq.connectSocket(this.socket, address);
@@ -147,41 +488,555 @@ export class Socket {
         });
     }
 
+    /**
+     * With ZMQ_CODEC_OBJECT, payloads are any JS value serialized natively, and
+     * received payloads arrive decoded. The default ZMQ_CODEC_RAW sends
+     * ArrayBuffers and TypedArrays as-is and JSON encodes everything else.
+     * Only the last frame of a multipart message is affected.
+     */
+    setCodec(codec) {
+        zmq.setSocketCodec(this.socket, codec);
+        this.codec = codec;
+    }
+
+    /**
+     * Deflates outgoing payloads of at least threshold bytes at the given zlib
+     * level (1-9) and inflates compressed payloads on receive. Level 0 only
+     * inflates, a negative level turns compression off. A shared dictionary of
+     * typical payload content improves the ratio for small JSON messages; peers
+     * must use the same one.
+     */
+    setCompression(level=6, threshold=1024, dictionary=undefined) {
+        zmq.setSocketCompression(this.socket, level, threshold, dictionary);
+    }
+
+    /**
+     * Spools messages refused at the high-water mark to a memory-mapped file
+     * of at most limit bytes instead of waiting, and replays them in order on
+     * ZMQ_POLLOUT. Sends never block while a spool is set; they only fail once
+     * the file is full. Messages left in the file by a previous run are sent
+     * first. A null path turns spooling off, keeping unsent messages on disk.
+     */
+    setSpool(path, limit=64 * 1024 * 1024) {
+        var waiting = zmq.setSocketSpool(this.socket, path, limit);
+        this.spoolPath = path === null ? undefined : path;
+        this.spooled = waiting > 0;
+        this.updateHandler();
+        return waiting;
+    }
+
+    // {depth, bytes, capacity, spooled, replayed, rejected, dropped, compactions}
+    // or null. dropped counts spooled messages libzmq refused for good, e.g.
+    // for a peer that has gone away.
+    spoolStats() {
+        return zmq.getSpoolStats(this.socket);
+    }
+
+    // Sends what the spool holds. Runs from the ZMQ_FD read handler, so a
+    // socket failure is reported as an "error" event instead of thrown.
+    flushSpool() {
+        try {
+            this.spooled = zmq.flushSpool(this.socket) > 0;
+        } catch (e) {
+            this.emit("error", this.constructor.formatError(zmq.errno()));
+        }
+    }
+
+    /**
+     * Records every frame sent or received to a capture file, with timestamps
+     * and multipart boundaries, for bench/replay.mjs. Traffic forwarded by a
+     * SocketProxy is not recorded; spooled messages are recorded when they are
+     * sent. A null path stops, and throws if part of the capture could not be
+     * written.
+     */
+    setCapture(path) {
+        zmq.setSocketCapture(this.socket, path);
+    }
+
+    encode(message) {
+        // ArrayBuffers and TypedArrays go out as-is (large ones without
+        // copying); everything else is JSON encoded unless the native codec
+        // handles it.
+        if (this.codec == ZMQ_CODEC_OBJECT || Socket.isBinary(message)) return message;
+        return JSON.stringify(message);
+    }
+
     send(message) {
+        return this.enqueue(this.encode(message), false);
+    }
+
+    /**
+     * Sends an array of frames as one multipart message. Frames are sent as
+     * given (strings, ArrayBuffers or TypedArrays), without JSON encoding.
+     */
+    sendMultipart(frames) {
+        return this.enqueue(frames, true);
+    }
+
+    /**
+     * Resolves as soon as libzmq has accepted the message. When the socket is
+     * at its high-water mark the message waits, in order, for ZMQ_POLLOUT.
+     */
+    enqueue(payload, multipart) {
         return new Promise((resolve, reject) => {
-            // console.log("In send");
-            console.log(`Sending ${JSON.stringify(message)}`);
-            var returnValue = zmq.sendSocket(this.socket, JSON.stringify(message));
-            if (returnValue >= 0) {
-                // this.emit("data");
-                // 100ms timeout gives libzmq time to flush the message queue
-                // Ensures that quick running clients still send message.
-                setTimeout(() => {
-                    resolve(returnValue);
-                }, 100);            
-            } else {
-                this.emit("error", Socket.formatError(zmq_errno()));
-                reject(returnValue);
+            this.sendQueue.push({payload, multipart, resolve, reject});
+            if (this.sendQueue.length == 1) {
+                this.onEvents();
             }
         });
     }
+
+    flushQueue() {
+        while (this.sendQueue.length > 0) {
+            var item = this.sendQueue[0];
+            var returnValue = item.multipart ?
+                zmq.sendMultipart(this.socket, item.payload, ZMQ_DONTWAIT) :
+                zmq.sendSocket(this.socket, item.payload, ZMQ_DONTWAIT);
+            if (returnValue < 0) {
+                var errorCode = zmq.errno();
+                if (errorCode == zmq.EAGAIN) {
+                    break;
+                }
+                this.sendQueue.shift();
+                this.emit("error", Socket.formatError(errorCode));
+                item.reject(returnValue);
+                continue;
+            }
+            this.sendQueue.shift();
+            item.resolve(returnValue);
+        }
+        if (this.spoolPath !== undefined) {
+            this.flushSpool();
+        }
+        this.updateHandler();
+        if (this.sendQueue.length == 0) {
+            var waiters = this.flushWaiters;
+            this.flushWaiters = [];
+            waiters.forEach((resolve) => resolve());
+        }
+    }
+
+    /**
+     * Resolves once every pending send has been handed to libzmq.
+     */
+    flush() {
+        if (this.sendQueue.length == 0) {
+            return Promise.resolve();
+        }
+        return new Promise((resolve) => this.flushWaiters.push(resolve));
+    }
+
+    /**
+     * Queues an array of messages in one native call without blocking.
+     * Messages are encoded like send(); an element that is an array is sent as
+     * one multipart message of raw frames. Returns how many messages were
+     * queued, which is less than messages.length once the socket hits its
+     * high-water mark.
+     */
+    sendMany(messages) {
+        var payloads = messages.map((message) =>
+            Array.isArray(message) ? message : this.encode(message));
+        var sent = zmq.sendMany(this.socket, payloads);
+        if (this.spoolPath !== undefined) {
+            this.flushSpool();
+            this.updateHandler();
+        }
+        return sent;
+    }
+
+    /**
+     * Flushes pending sends, then closes the socket. libzmq keeps delivering
+     * already queued messages for up to linger milliseconds (-1 waits forever).
+     */
+    async close(linger=1000) {
+        await this.flush();
+        this.listening = false;
+        this.unwatch();
+        this.unmonitor();
+        zmq.closeSocket(this.socket, linger);
+        this.emit("disconnected", this.socket);
+        this.socket = undefined;
+    }
     
     getContextOption(optionName) {
-        return zmq.getContextOption(this.context, optionName)
+        return this.context.getOption(optionName);
     }
 
     setContextOption(optionName, optionValue) {
-        return zmq.setContextOption(this.context, optionName, optionValue);
+        return this.context.setOption(optionName, optionValue);
     }
 
+    /**
+     * Returns the option's value: a number, a BigInt for ZMQ_AFFINITY and the
+     * ZMQ_VMCI_BUFFER_* sizes, a string (e.g. ZMQ_LAST_ENDPOINT) or an
+     * ArrayBuffer for binary options such as ZMQ_ROUTING_ID and CURVE keys.
+     */
     getSocketOption(optionName) {
-        var optionValue;
-        var returnCode = zmq.getSocketOption(this.socket, optionName, optionValue);
-        return optionValue;
+        return zmq.getSocketOption(this.socket, optionName);
     }
 
+    /**
+     * Sets an option such as ZMQ_SNDHWM or ZMQ_AFFINITY. Returns 0, or -1 on
+     * error (see zmq.errno()).
+     */
     setSocketOption(optionName, optionValue) {
-        var returnCode = zmq.getSocketOption(this.socket, optionName, optionValue);
-        return returnCode;
+        return zmq.setSocketOption(this.socket, optionName, optionValue);
+    }
+}
+
+/**
+ * Waits on many sockets at once. Sockets are Socket instances of this module
+ * or quickjs-zsock.mjs, or raw handles.
+ * poll() dispatches callbacks for ready sockets; wait() returns the ready set.
+ * Both block for up to timeout milliseconds (-1 forever, 0 to just check).
+ */
+export class Poller {
+    constructor() {
+        this.poller = zmq.createPoller();
+        this.sockets = new Map();
+    }
+
+    add(socket, events=ZMQ_POLLIN, callback=undefined) {
+        var handle = socket.socket !== undefined ? socket.socket : socket;
+        this.sockets.set(handle, socket);
+        var dispatch = callback ? (h, revents) => callback(socket, revents) : undefined;
+        zmq.pollerAdd(this.poller, handle, events, dispatch);
+    }
+
+    remove(socket) {
+        var handle = socket.socket !== undefined ? socket.socket : socket;
+        this.sockets.delete(handle);
+        return zmq.pollerRemove(this.poller, handle);
+    }
+
+    wait(timeout=-1) {
+        return zmq.pollerWait(this.poller, timeout).map((handle) => this.sockets.get(handle));
+    }
+
+    poll(timeout=-1) {
+        return zmq.pollerDispatch(this.poller, timeout);
+    }
+}
+
+/**
+ * Runs a socket's I/O on a background thread. Received messages are handed
+ * over in batches and passed to onMessage from the os event loop, so the
+ * network keeps flowing while the interpreter is busy. The socket cannot be
+ * used directly until stop() is called.
+ */
+export class Actor {
+    constructor(socket, onMessage, binary=false) {
+        this.socket = socket;
+        this.actor = zmq.startActor(socket.socket);
+        // Messages waiting for room in the outbound ring.
+        this.pending = [];
+        this.fd = zmq.actorFd(this.actor);
+        os.setReadHandler(this.fd, () => {
+            var batch = zmq.actorRecv(this.actor, socket.constructor.batchSize, binary);
+            for (var i = 0; i < batch.length; i++) {
+                onMessage(batch[i]);
+            }
+            this.flushPending();
+        });
+    }
+
+    /**
+     * Queues messages (encoded like Socket.sendMany) for the background thread.
+     */
+    send(...messages) {
+        var payloads = messages.map((message) =>
+            Array.isArray(message) ? message : this.socket.encode(message));
+        this.pending.push(...payloads);
+        this.flushPending();
+    }
+
+    flushPending() {
+        if (this.pending.length == 0) return;
+        var queued = zmq.actorSend(this.actor, this.pending);
+        this.pending.splice(0, queued);
+        if (this.pending.length > 0 && this.retry === undefined) {
+            // The outbound ring is full; try again once the thread caught up.
+            this.retry = os.setTimeout(() => {
+                this.retry = undefined;
+                this.flushPending();
+            }, 1);
+        }
+    }
+
+    /**
+     * Stops the thread and returns the socket to direct use. Messages not yet
+     * sent, including those still waiting for room in the ring, are sent on
+     * the socket without blocking. Returns how many of them libzmq refused.
+     */
+    stop() {
+        os.setReadHandler(this.fd, null);
+        if (this.retry !== undefined) os.clearTimeout(this.retry);
+        this.retry = undefined;
+        var unsent = zmq.actorStop(this.actor);
+        if (this.pending.length > 0) {
+            unsent += this.pending.length - zmq.sendMany(this.socket.socket, this.pending);
+            this.pending = [];
+        }
+        return unsent;
+    }
+}
+
+/**
+ * Forwards messages between two sockets on a native thread, like
+ * zmq_proxy_steerable, so payloads never pass through JS. With a capture
+ * socket every sampleEvery-th message is mirrored to it. The sockets cannot be
+ * used directly until terminate().
+ */
+export class SocketProxy {
+    constructor(frontend, backend, capture=undefined, sampleEvery=1) {
+        this.sockets = [frontend, backend, capture];
+        this.proxy = zmq.startProxy(frontend.socket, backend.socket,
+                                    capture ? capture.socket : undefined, sampleEvery);
+    }
+
+    pause() {
+        zmq.proxyControl(this.proxy, "PAUSE");
+    }
+
+    resume() {
+        zmq.proxyControl(this.proxy, "RESUME");
+    }
+
+    /**
+     * Returns {frontend, backend} message and byte counters.
+     */
+    statistics() {
+        return zmq.proxyControl(this.proxy, "STATISTICS");
+    }
+
+    terminate() {
+        zmq.proxyControl(this.proxy, "TERMINATE");
+    }
+}
+
+/**
+ * Pipelined request/reply over a DEALER socket. Every request carries a
+ * correlation id, so thousands can be in flight at once; replies may arrive in
+ * any order. Timeouts are tracked natively and checked by one shared ticker.
+ */
+export class RpcClient {
+    constructor(socket, timeout=5000) {
+        this.socket = socket;
+        this.timeout = timeout;
+        this.client = zmq.createRpcClient(socket.socket);
+        this.pending = new Map();
+        this.fd = zmq.getSocketFd(socket.socket);
+        os.setReadHandler(this.fd, () => this.poll());
+    }
+
+    /**
+     * Resolves with the reply payload (decoded by the socket's codec) or
+     * rejects when no reply arrives within timeout milliseconds.
+     */
+    request(payload, timeout=this.timeout) {
+        return new Promise((resolve, reject) => {
+            var id = zmq.rpcSend(this.client, this.socket.encode(payload), timeout);
+            if (id < 0) {
+                reject(this.socket.constructor.formatError(zmq.errno()));
+                return;
+            }
+            this.pending.set(id, {resolve, reject});
+            this.schedule();
+        });
+    }
+
+    poll() {
+        do {
+            var result = zmq.rpcPoll(this.client, this.socket.constructor.batchSize, this.socket.binary);
+            for (var [id, payload] of result.replies) {
+                var request = this.pending.get(id);
+                this.pending.delete(id);
+                request.resolve(payload);
+            }
+            for (var id of result.expired) {
+                var request = this.pending.get(id);
+                this.pending.delete(id);
+                request.reject(new Error(`request ${id} timed out`));
+            }
+            // ZMQ_FD is edge-triggered, so drain until nothing is left.
+        } while (zmq.getSocketEvents(this.socket.socket) & ZMQ_POLLIN);
+    }
+
+    schedule() {
+        if (this.ticker !== undefined || this.pending.size == 0) return;
+        this.ticker = os.setTimeout(() => {
+            this.ticker = undefined;
+            this.poll();
+            this.schedule();
+        }, 10);
+    }
+
+    close() {
+        os.setReadHandler(this.fd, null);
+        if (this.ticker !== undefined) os.clearTimeout(this.ticker);
+        this.ticker = undefined;
+        this.pending.forEach((request) => request.reject(new Error("client closed")));
+        this.pending.clear();
+    }
+}
+
+/**
+ * Serves RpcClient requests on a ROUTER socket. handler(payload) returns the
+ * reply or a promise of it; the routing envelope stays native and is attached
+ * to the reply whenever it is ready.
+ */
+export class RpcServer {
+    constructor(socket, handler) {
+        this.socket = socket;
+        this.handler = handler;
+        this.fd = zmq.getSocketFd(socket.socket);
+        os.setReadHandler(this.fd, () => this.serve());
+        this.serve();
+    }
+
+    serve() {
+        do {
+            var requests = zmq.rpcServerRecv(this.socket.socket, this.socket.constructor.batchSize, this.socket.binary);
+            for (var [token, payload] of requests) {
+                this.dispatch(token, payload);
+            }
+        } while (this.socket.socket !== undefined && (zmq.getSocketEvents(this.socket.socket) & ZMQ_POLLIN));
+    }
+
+    async dispatch(token, payload) {
+        try {
+            var reply = await this.handler(payload);
+            zmq.rpcServerReply(this.socket.socket, token, this.socket.encode(reply));
+        } catch (e) {
+            this.socket.emit("error", e);
+        }
+    }
+
+    close() {
+        os.setReadHandler(this.fd, null);
     }
-}
\ No newline at end of file
+}
+
+/**
+ * Last value cache for an XPUB socket: publish() remembers the latest payload
+ * of each topic, and every subscription is answered natively by republishing
+ * the cached values of the matching topics. XPUB cannot send to one
+ * subscriber, so those values reach everyone subscribed to them; receivers
+ * that mind duplicates should treat a repeated value as a no-op.
+ */
+export class LastValueCache {
+    constructor(socket) {
+        this.socket = socket;
+        this.cache = zmq.createLastValueCache(socket.socket);
+        this.fd = zmq.getSocketFd(socket.socket);
+        os.setReadHandler(this.fd, () => this.replay());
+        // Subscriptions queued before the cache existed raise no new edge.
+        this.replay();
+    }
+
+    publish(topic, message) {
+        return zmq.lvcPublish(this.cache, topic, this.socket.encode(message));
+    }
+
+    replay() {
+        var replayed = 0;
+        do {
+            replayed += zmq.lvcPoll(this.cache);
+        } while (this.socket.socket !== undefined && (zmq.getSocketEvents(this.socket.socket) & ZMQ_POLLIN));
+        return replayed;
+    }
+
+    close() {
+        os.setReadHandler(this.fd, null);
+    }
+}
+
+/**
+ * Reassembles the raw TCP data of a ZMQ_STREAM socket into frames natively.
+ * Connections are identified by hex strings; handlers are onFrame(id, frame),
+ * onConnect(id) and onDisconnect(id).
+ */
+export class StreamFramer {
+    constructor(socket, framing, handlers, maxFrame=1 << 20) {
+        this.socket = socket;
+        this.handlers = handlers;
+        this.framer = zmq.createStreamFramer(socket.socket, framing, maxFrame);
+        this.fd = zmq.getSocketFd(socket.socket);
+        os.setReadHandler(this.fd, () => this.drain());
+        this.drain();
+    }
+
+    drain() {
+        do {
+            var events = zmq.framerRecv(this.framer, this.socket.constructor.batchSize, this.socket.binary);
+            for (var [id, frame] of events) {
+                if (frame === true) {
+                    if (this.handlers.onConnect) this.handlers.onConnect(id);
+                } else if (frame === false) {
+                    if (this.handlers.onDisconnect) this.handlers.onDisconnect(id);
+                } else {
+                    this.handlers.onFrame(id, frame);
+                }
+            }
+        } while (this.socket.socket !== undefined && (zmq.getSocketEvents(this.socket.socket) & ZMQ_POLLIN));
+    }
+
+    send(id, frame) {
+        return zmq.framerSend(this.framer, id, frame);
+    }
+
+    disconnect(id) {
+        zmq.framerClose(this.framer, id);
+    }
+
+    close() {
+        os.setReadHandler(this.fd, null);
+    }
+}
+
+/**
+ * Routes messages over several sockets by a consistent hash of their key, so
+ * equal keys reach the same worker. The key is the first frame of multipart
+ * messages or the whole encoded payload, unless given to send() or configured
+ * with keyFrame/keyOffset/keyLength. Shards are named, usually by endpoint; adding
+ * or removing one only moves the keys that hash next to its ring points.
+ */
+export class ShardedSender {
+    constructor(virtualNodes=160, {keyFrame=0, keyOffset=0, keyLength=-1}={}) {
+        this.sender = zmq.createShardedSender(virtualNodes, keyFrame, keyOffset, keyLength);
+        this.shards = new Map();
+    }
+
+    add(name, socket) {
+        zmq.shardAdd(this.sender, socket.socket, name);
+        this.shards.set(name, socket);
+    }
+
+    // Payloads are encoded once, before routing, so shards should share the
+    // same codec.
+    get encoder() {
+        return this.shards.values().next().value;
+    }
+
+    // Returns the removed Socket so the caller can close it.
+    remove(name) {
+        var socket = this.shards.get(name);
+        zmq.shardRemove(this.sender, name);
+        this.shards.delete(name);
+        return socket;
+    }
+
+    /**
+     * Sends without blocking; an array is sent as one multipart message of
+     * raw frames. Returns the bytes queued, or -1 when the chosen shard is at
+     * its high-water mark.
+     */
+    send(message, key=undefined) {
+        if (!Array.isArray(message) && this.shards.size > 0) message = this.encoder.encode(message);
+        return zmq.shardSend(this.sender, message, key);
+    }
+
+    shardFor(key) {
+        return zmq.shardFor(this.sender, key);
+    }
+}
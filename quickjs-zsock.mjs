@@ -23,7 +23,7 @@ SOFTWARE.
 */
 
 import * as zmq from './quickjs-zmq.so'
-import { setTimeout } from 'os';
+import * as os from 'os';
 
 /**
  * Note: This class is not currently functional.
@@ -47,6 +47,143 @@ export const ZMQ_PUSH=8
 export const ZMQ_XPUB=9
 export const ZMQ_XSUB=10
 export const ZMQ_STREAM=11
+// Draft socket types, only usable when libzmq is built with the draft API.
+// They are thread-safe and carry routing ids or groups on single-frame messages.
+export const ZMQ_SERVER=12
+export const ZMQ_CLIENT=13
+export const ZMQ_RADIO=14
+export const ZMQ_DISH=15
+export const ZMQ_GATHER=16
+export const ZMQ_SCATTER=17
+export const ZMQ_DGRAM=18
+export const ZMQ_PEER=19
+export const ZMQ_CHANNEL=20
+
+// Send/receive flags
+export const ZMQ_DONTWAIT=1
+export const ZMQ_SNDMORE=2
+
+// ZMQ_EVENTS bits
+export const ZMQ_POLLIN=1
+export const ZMQ_POLLOUT=2
+
+// Context options (see Socket.setContextOption)
+export const ZMQ_IO_THREADS=1
+export const ZMQ_MAX_SOCKETS=2
+export const ZMQ_SOCKET_LIMIT=3
+export const ZMQ_THREAD_PRIORITY=3
+export const ZMQ_THREAD_SCHED_POLICY=4
+export const ZMQ_MAX_MSGSZ=5
+export const ZMQ_THREAD_AFFINITY_CPU_ADD=7
+export const ZMQ_THREAD_AFFINITY_CPU_REMOVE=8
+export const ZMQ_BLOCKY=70
+
+// Socket options (see Socket.setSocketOption)
+export const ZMQ_AFFINITY=4
+export const ZMQ_ROUTING_ID=5
+export const ZMQ_SUBSCRIBE=6
+export const ZMQ_UNSUBSCRIBE=7
+export const ZMQ_SNDBUF=11
+export const ZMQ_RCVBUF=12
+export const ZMQ_RCVMORE=13
+export const ZMQ_TYPE=16
+export const ZMQ_LINGER=17
+export const ZMQ_RECONNECT_IVL=18
+export const ZMQ_BACKLOG=19
+export const ZMQ_RECONNECT_IVL_MAX=21
+export const ZMQ_MAXMSGSIZE=22
+export const ZMQ_SNDHWM=23
+export const ZMQ_RCVHWM=24
+export const ZMQ_RCVTIMEO=27
+export const ZMQ_SNDTIMEO=28
+export const ZMQ_LAST_ENDPOINT=32
+export const ZMQ_ROUTER_MANDATORY=33
+export const ZMQ_TCP_KEEPALIVE=34
+export const ZMQ_TCP_KEEPALIVE_CNT=35
+export const ZMQ_TCP_KEEPALIVE_IDLE=36
+export const ZMQ_TCP_KEEPALIVE_INTVL=37
+export const ZMQ_IMMEDIATE=39
+export const ZMQ_XPUB_VERBOSE=40
+export const ZMQ_IPV6=42
+export const ZMQ_MECHANISM=43
+export const ZMQ_PLAIN_SERVER=44
+export const ZMQ_PLAIN_USERNAME=45
+export const ZMQ_PLAIN_PASSWORD=46
+export const ZMQ_CURVE_SERVER=47
+export const ZMQ_CURVE_PUBLICKEY=48
+export const ZMQ_CURVE_SECRETKEY=49
+export const ZMQ_CURVE_SERVERKEY=50
+export const ZMQ_CONFLATE=54
+export const ZMQ_ZAP_DOMAIN=55
+export const ZMQ_TOS=57
+export const ZMQ_GSSAPI_SERVER=62
+export const ZMQ_GSSAPI_PRINCIPAL=63
+export const ZMQ_GSSAPI_SERVICE_PRINCIPAL=64
+export const ZMQ_GSSAPI_PLAINTEXT=65
+export const ZMQ_HANDSHAKE_IVL=66
+export const ZMQ_XPUB_NODROP=69
+export const ZMQ_HEARTBEAT_IVL=75
+export const ZMQ_HEARTBEAT_TTL=76
+export const ZMQ_HEARTBEAT_TIMEOUT=77
+export const ZMQ_CONNECT_TIMEOUT=79
+export const ZMQ_TCP_MAXRT=80
+export const ZMQ_VMCI_BUFFER_SIZE=85
+export const ZMQ_VMCI_BUFFER_MIN_SIZE=86
+export const ZMQ_VMCI_BUFFER_MAX_SIZE=87
+export const ZMQ_VMCI_CONNECT_TIMEOUT=88
+export const ZMQ_METADATA=95
+
+// zmq_socket_monitor events
+export const ZMQ_EVENT_CONNECTED=1
+export const ZMQ_EVENT_CONNECT_DELAYED=2
+export const ZMQ_EVENT_CONNECT_RETRIED=4
+export const ZMQ_EVENT_LISTENING=8
+export const ZMQ_EVENT_BIND_FAILED=16
+export const ZMQ_EVENT_ACCEPTED=32
+export const ZMQ_EVENT_ACCEPT_FAILED=64
+export const ZMQ_EVENT_CLOSED=128
+export const ZMQ_EVENT_CLOSE_FAILED=256
+export const ZMQ_EVENT_DISCONNECTED=512
+export const ZMQ_EVENT_MONITOR_STOPPED=1024
+export const ZMQ_EVENT_HANDSHAKE_FAILED_NO_DETAIL=2048
+export const ZMQ_EVENT_HANDSHAKE_SUCCEEDED=4096
+export const ZMQ_EVENT_HANDSHAKE_FAILED_PROTOCOL=8192
+export const ZMQ_EVENT_HANDSHAKE_FAILED_AUTH=16384
+
+// Which listener each monitor event is delivered to, and its name.
+const monitorEvents = {
+    [ZMQ_EVENT_CONNECTED]: ["connected", "connected"],
+    [ZMQ_EVENT_ACCEPTED]: ["connected", "accepted"],
+    [ZMQ_EVENT_HANDSHAKE_SUCCEEDED]: ["connected", "handshake_succeeded"],
+    [ZMQ_EVENT_DISCONNECTED]: ["disconnected", "disconnected"],
+    [ZMQ_EVENT_CONNECT_RETRIED]: ["disconnected", "connect_retried"],
+    [ZMQ_EVENT_BIND_FAILED]: ["error", "bind_failed"],
+    [ZMQ_EVENT_ACCEPT_FAILED]: ["error", "accept_failed"],
+    [ZMQ_EVENT_CLOSE_FAILED]: ["error", "close_failed"],
+    [ZMQ_EVENT_HANDSHAKE_FAILED_NO_DETAIL]: ["error", "handshake_failed"],
+    [ZMQ_EVENT_HANDSHAKE_FAILED_PROTOCOL]: ["error", "handshake_failed_protocol"],
+    [ZMQ_EVENT_HANDSHAKE_FAILED_AUTH]: ["error", "handshake_failed_auth"],
+};
+
+// The SERVER/CLIENT, RADIO/DISH and PEER bindings and shared sockets are only
+// compiled in with libzmq's draft API (make DRAFT=1).
+function draft(name) {
+    if (typeof zmq[name] !== "function")
+        throw new TypeError(`libzmq draft API not available: ${name} needs quickjs-zmq built with DRAFT=1`);
+    return zmq[name];
+}
+
+// Payload codecs (see Socket.setCodec)
+export const ZMQ_CODEC_RAW=0
+export const ZMQ_CODEC_OBJECT=1
+
+// Framings of raw TCP data on ZMQ_STREAM sockets (see StreamFramer)
+export const ZMQ_FRAMING_U16_BE=1
+export const ZMQ_FRAMING_U16_LE=2
+export const ZMQ_FRAMING_U32_BE=3
+export const ZMQ_FRAMING_U32_LE=4
+export const ZMQ_FRAMING_LINE=5
+export const ZMQ_FRAMING_HTTP=6
 
 
 export class Socket {
@@ -59,6 +196,13 @@ export class Socket {
         return {"rc": errorCode, "description": Socket.errorCodeToString(errorCode)}
     }
 
+    // Maximum number of messages pulled per native call while draining.
+    static batchSize = 256;
+
+    static isBinary(message) {
+        return message instanceof ArrayBuffer || ArrayBuffer.isView(message);
+    }
+
     constructor(type=ZMQ_REP) {
         this.socket = zmq.zsock_new(type);
         // console.log(this.socket);
@@ -70,6 +214,21 @@ export class Socket {
             error: [] 
         };
         this.listening = false;
+        // When true, received messages are delivered as ArrayBuffers that own
+        // the message memory instead of being decoded as strings.
+        this.binary = false;
+        // When true, each "data" event carries the array of all frames of a
+        // multipart message.
+        this.multipart = false;
+        // When true (draft socket types), each "data" event carries
+        // {payload, routingId, group}.
+        this.routed = false;
+        this.codec = ZMQ_CODEC_RAW;
+        // Sends waiting for the socket to drop below its high-water mark.
+        this.sendQueue = [];
+        this.flushWaiters = [];
+        // True while messages wait in the overflow spool (see setSpool).
+        this.spooled = false;
     }
 
     on(event, cb) {
@@ -80,11 +239,11 @@ export class Socket {
     }
 
     destroy() {
+        this.listening = false;
+        this.unwatch();
+        this.unmonitor();
         this.emit("disconnected", this.socket);
         zmq.zsock_destroy(this.socket);
-        // this.socket = undefined;
-        // this.context = undefined;
-        this.listening = false;
     }
 
     emit(event, data={}) {
@@ -101,7 +260,7 @@ export class Socket {
         return new Promise((resolve, reject) => {
             // CZMQ_EXPORT int
             // zsock_unbind (zsock_t *self, const char *format, ...) CHECK_PRINTF (2);     
-            var rc = zsock_unbind(this.socket, address);
+            var rc = zmq.zsock_unbind(this.socket, address);
             if (rc < 0) {
                 reject(`Failed with return code ${rc}`);
             } else {
@@ -116,39 +275,157 @@ export class Socket {
             if (boundPort >= 0) {
                 this.emit("connected", {"port": "boundPort"});
                 this.port = boundPort;
-                resolve(returnValue);
+                resolve(boundPort);
             } else {
-                this.emit("error", Socket.formatError(returnValue));
-                reject(returnValue);
+                this.emit("error", Socket.formatError(boundPort));
+                reject(boundPort);
             }
         });
     }
 
-    async listen(address) {
-        // console.log("Inside listen");
-        this.port = await this.bind(address);
-        // console.log(`Socket bind returned with ${returnCode}`);
-        // if (returnCode < 0) {
-        //     throw
-        // }
-        // console.log("Socket is bound");
+    /**
+     * Calls onMessage for every message received. Receiving is driven by the
+     * os event loop: ZMQ_FD is edge-triggered, so each wakeup drains the socket
+     * with ZMQ_DONTWAIT until ZMQ_EVENTS drops ZMQ_POLLIN.
+     */
+    watch(onMessage) {
         this.listening = true;
-        while (this.listening) {
-            // console.log("Listening");
+        this.drain = () => {
             try {
-                // console.log("Receive");
-                var data = zmq.zsock_recv(this.socket);
-                // console.log(`Data: ${data}`);
-                this.emit("data", data);
-                // zmq.zsock_send(this.socket, "OK");
-                // console.log("After data");
+                while (this.listening && (zmq.getSocketEvents(this.socket) & ZMQ_POLLIN)) {
+                    if (this.routed) {
+                        var message = draft("recvRouted")(this.socket, ZMQ_DONTWAIT, this.binary);
+                        if (message === null) break;
+                        onMessage(message);
+                        continue;
+                    }
+                    if (this.multipart) {
+                        var data = zmq.recvMultipart(this.socket, ZMQ_DONTWAIT, this.binary);
+                        if (data === null) break;
+                        onMessage(data);
+                        continue;
+                    }
+                    // Pull whatever is queued in one native call.
+                    var batch = zmq.recvBatch(this.socket, Socket.batchSize, this.binary);
+                    if (batch.length == 0) break;
+                    for (var i = 0; i < batch.length && this.listening; i++) {
+                        onMessage(batch[i]);
+                    }
+                }
             } catch (e) {
                 console.log(e);
                 this.destroy();
             }
+        };
+        this.updateHandler();
+        // Messages queued before the handler was installed will not raise a
+        // new edge, so pick them up now.
+        this.onEvents();
+    }
+
+    unwatch() {
+        this.drain = undefined;
+        this.updateHandler();
+    }
+
+    /**
+     * Delivers libzmq's own connection events to the listeners: "connected"
+     * on connect, accept and handshake, "disconnected" on disconnects and
+     * connect retries, "error" on bind, accept and handshake failures. Each
+     * event carries {event, name, value, endpoint}.
+     */
+    monitor() {
+        if (this.monitorSocket !== undefined) return;
+        this.monitorSocket = zmq.monitorSocket(this.socket);
+        this.monitorFd = zmq.getSocketFd(this.monitorSocket);
+        os.setReadHandler(this.monitorFd, () => this.readMonitor());
+        this.readMonitor();
+    }
+
+    readMonitor() {
+        var event;
+        while (this.monitorSocket !== undefined &&
+               (event = zmq.readMonitorEvent(this.monitorSocket)) !== null) {
+            var target = monitorEvents[event.event];
+            if (target) this.emit(target[0], Object.assign({name: target[1]}, event));
         }
     }
 
+    unmonitor() {
+        if (this.monitorSocket === undefined) return;
+        os.setReadHandler(this.monitorFd, null);
+        if (this.socket !== undefined) zmq.monitorSocket(this.socket, 0);
+        zmq.closeSocket(this.monitorSocket, 0);
+        this.monitorSocket = undefined;
+    }
+
+    // Replies to the peer a SERVER or PEER socket received routingId from.
+    sendTo(routingId, message, flags=0) {
+        return draft("sendRouted")(this.socket, this.encode(message), routingId, flags);
+    }
+
+    // Sends to every DISH socket that joined group.
+    sendGroup(group, message, flags=0) {
+        return draft("sendGroup")(this.socket, group, this.encode(message), flags);
+    }
+
+    join(group) {
+        return draft("joinGroup")(this.socket, group);
+    }
+
+    leave(group) {
+        return draft("leaveGroup")(this.socket, group);
+    }
+
+    /**
+     * Returns message and byte counters, high-water mark hits and the dispatch
+     * time histogram kept by the native layer; see getSocketStats.
+     */
+    stats(reset=false) {
+        return zmq.getSocketStats(this.socket, reset);
+    }
+
+    /**
+     * Hit and miss counts of the calling thread's message buffer pool, overall
+     * and per size class; misses that keep growing mean the pool is too small.
+     */
+    static poolStats(reset=false) {
+        return zmq.getPoolStats(reset);
+    }
+
+    /**
+     * Keeps the ZMQ_FD read handler installed while something needs it: a
+     * watch() receiver or sends waiting for ZMQ_POLLOUT.
+     */
+    updateHandler() {
+        var needed = this.drain !== undefined || this.sendQueue.length > 0 || this.spooled;
+        if (needed && this.fd === undefined) {
+            this.fd = zmq.getSocketFd(this.socket);
+            os.setReadHandler(this.fd, () => this.onEvents());
+        } else if (!needed && this.fd !== undefined) {
+            os.setReadHandler(this.fd, null);
+            this.fd = undefined;
+        }
+    }
+
+    onEvents() {
+        // Sending and receiving both reset the edge on ZMQ_FD, so keep going
+        // until neither side can make progress.
+        do {
+            if (this.sendQueue.length > 0 || this.spooled) this.flushQueue();
+            if (this.drain) this.drain();
+        } while ((this.sendQueue.length > 0 || this.spooled) && this.socket !== undefined &&
+                 (zmq.getSocketEvents(this.socket) & ZMQ_POLLOUT));
+    }
+
+    async listen(address) {
+        this.port = await this.bind(address);
+        this.watch((data) => {
+            this.emit("data", data);
+        });
+        return this.port;
+    }
+
     connect(address) {
         return new Promise((resolve, reject) => {
             console.log("Attempting to connect socket.")
@@ -164,23 +441,196 @@ export class Socket {
         });
     }
 
+    /**
+     * With ZMQ_CODEC_OBJECT, payloads are any JS value serialized natively, and
+     * received payloads arrive decoded. The default ZMQ_CODEC_RAW sends
+     * ArrayBuffers and TypedArrays as-is and JSON encodes everything else.
+     * Only the last frame of a multipart message is affected.
+     */
+    setCodec(codec) {
+        zmq.setSocketCodec(this.socket, codec);
+        this.codec = codec;
+    }
+
+    /**
+     * Deflates outgoing payloads of at least threshold bytes at the given zlib
+     * level (1-9) and inflates compressed payloads on receive. Level 0 only
+     * inflates, a negative level turns compression off. A shared dictionary of
+     * typical payload content improves the ratio for small JSON messages; peers
+     * must use the same one.
+     */
+    setCompression(level=6, threshold=1024, dictionary=undefined) {
+        zmq.setSocketCompression(this.socket, level, threshold, dictionary);
+    }
+
+    /**
+     * Spools messages refused at the high-water mark to a memory-mapped file
+     * of at most limit bytes instead of waiting, and replays them in order on
+     * ZMQ_POLLOUT. Sends never block while a spool is set; they only fail once
+     * the file is full. Messages left in the file by a previous run are sent
+     * first. A null path turns spooling off, keeping unsent messages on disk.
+     */
+    setSpool(path, limit=64 * 1024 * 1024) {
+        var waiting = zmq.setSocketSpool(this.socket, path, limit);
+        this.spoolPath = path === null ? undefined : path;
+        this.spooled = waiting > 0;
+        this.updateHandler();
+        return waiting;
+    }
+
+    // {depth, bytes, capacity, spooled, replayed, rejected, dropped, compactions}
+    // or null. dropped counts spooled messages libzmq refused for good, e.g.
+    // for a peer that has gone away.
+    spoolStats() {
+        return zmq.getSpoolStats(this.socket);
+    }
+
+    // Sends what the spool holds. Runs from the ZMQ_FD read handler, so a
+    // socket failure is reported as an "error" event instead of thrown.
+    flushSpool() {
+        try {
+            this.spooled = zmq.flushSpool(this.socket) > 0;
+        } catch (e) {
+            this.emit("error", this.constructor.formatError(zmq.errno()));
+        }
+    }
+
+    /**
+     * Records every frame sent or received to a capture file, with timestamps
+     * and multipart boundaries, for bench/replay.mjs. Traffic forwarded by a
+     * SocketProxy is not recorded; spooled messages are recorded when they are
+     * sent. A null path stops, and throws if part of the capture could not be
+     * written.
+     */
+    setCapture(path) {
+        zmq.setSocketCapture(this.socket, path);
+    }
+
+    encode(message) {
+        // ArrayBuffers and TypedArrays go out as-is (large ones without
+        // copying); everything else is JSON encoded unless the native codec
+        // handles it.
+        if (this.codec == ZMQ_CODEC_OBJECT || Socket.isBinary(message)) return message;
+        return JSON.stringify(message);
+    }
+
     send(message) {
+        return this.enqueue(this.encode(message), false);
+    }
+
+    /**
+     * Sends an array of frames as one multipart message. Frames are sent as
+     * given (strings, ArrayBuffers or TypedArrays), without JSON encoding.
+     */
+    sendMultipart(frames) {
+        return this.enqueue(frames, true);
+    }
+
+    /**
+     * Resolves as soon as libzmq has accepted the message. When the socket is
+     * at its high-water mark the message waits, in order, for ZMQ_POLLOUT.
+     */
+    enqueue(payload, multipart) {
         return new Promise((resolve, reject) => {
-            // console.log("In send");
-            console.log(`Sending ${JSON.stringify(message)}`);
-            var returnValue = zmq.zsock_send(this.socket, JSON.stringify(message));
-            if (returnValue >= 0) {
-                // this.emit("data");
-                // 100ms timeout gives libzmq time to flush the message queue
-                // Ensures that quick running clients still send message.
-                setTimeout(() => {
-                    resolve(returnValue);
-                }, 100);
-            } else {
-                this.emit("error", Socket.formatError(zmq_errno()));
-                reject(returnValue);
+            this.sendQueue.push({payload, multipart, resolve, reject});
+            if (this.sendQueue.length == 1) {
+                this.onEvents();
             }
         });
     }
-    
-}
\ No newline at end of file
+
+    flushQueue() {
+        while (this.sendQueue.length > 0) {
+            var item = this.sendQueue[0];
+            var returnValue = item.multipart ?
+                zmq.sendMultipart(this.socket, item.payload, ZMQ_DONTWAIT) :
+                zmq.sendSocket(this.socket, item.payload, ZMQ_DONTWAIT);
+            if (returnValue < 0) {
+                var errorCode = zmq.errno();
+                if (errorCode == zmq.EAGAIN) {
+                    break;
+                }
+                this.sendQueue.shift();
+                this.emit("error", Socket.formatError(errorCode));
+                item.reject(returnValue);
+                continue;
+            }
+            this.sendQueue.shift();
+            item.resolve(returnValue);
+        }
+        if (this.spoolPath !== undefined) {
+            this.flushSpool();
+        }
+        this.updateHandler();
+        if (this.sendQueue.length == 0) {
+            var waiters = this.flushWaiters;
+            this.flushWaiters = [];
+            waiters.forEach((resolve) => resolve());
+        }
+    }
+
+    /**
+     * Resolves once every pending send has been handed to libzmq.
+     */
+    flush() {
+        if (this.sendQueue.length == 0) {
+            return Promise.resolve();
+        }
+        return new Promise((resolve) => this.flushWaiters.push(resolve));
+    }
+
+    /**
+     * Queues an array of messages in one native call without blocking.
+     * Messages are encoded like send(); an element that is an array is sent as
+     * one multipart message of raw frames. Returns how many messages were
+     * queued, which is less than messages.length once the socket hits its
+     * high-water mark.
+     */
+    sendMany(messages) {
+        var payloads = messages.map((message) =>
+            Array.isArray(message) ? message : this.encode(message));
+        var sent = zmq.sendMany(this.socket, payloads);
+        if (this.spoolPath !== undefined) {
+            this.flushSpool();
+            this.updateHandler();
+        }
+        return sent;
+    }
+
+    /**
+     * Flushes pending sends, then closes the socket. libzmq keeps delivering
+     * already queued messages for up to linger milliseconds (-1 waits forever).
+     */
+    async close(linger=1000) {
+        await this.flush();
+        this.listening = false;
+        this.unwatch();
+        this.unmonitor();
+        zmq.zsock_destroy(this.socket, linger);
+        this.emit("disconnected", this.socket);
+        this.socket = undefined;
+    }
+
+    /**
+     * Returns the option's value: a number, a BigInt for ZMQ_AFFINITY and the
+     * ZMQ_VMCI_BUFFER_* sizes, a string (e.g. ZMQ_LAST_ENDPOINT) or an
+     * ArrayBuffer for binary options such as ZMQ_ROUTING_ID and CURVE keys.
+     */
+    getSocketOption(optionName) {
+        return zmq.getSocketOption(this.socket, optionName);
+    }
+
+    /**
+     * Sets an option such as ZMQ_SNDHWM or ZMQ_AFFINITY. Returns 0, or -1 on
+     * error (see zmq.errno()).
+     */
+    setSocketOption(optionName, optionValue) {
+        return zmq.setSocketOption(this.socket, optionName, optionValue);
+    }
+}
+
+// Poller and the helpers built on it take the Sockets of either module, so
+// they are shared rather than defined here again.
+export {
+    Poller, Actor, SocketProxy, RpcClient, RpcServer, LastValueCache, StreamFramer, ShardedSender,
+} from './quickjs-zmq.mjs';
@@ -33,7 +33,7 @@ console.log("Binding the socket now");
         "key1": "value",
         "key2": "value"
     };
-    sock.send(testObject).then((responseCode) => {
+    await sock.send(testObject).then((responseCode) => {
         console.log(`Success: ${responseCode}`);
     }, (responseCode) => {
         console.log(`Error code ${responseCode}`);
@@ -45,7 +45,6 @@ console.log("Binding the socket now");
     // }, (responseCode) => {
     //     console.log(`Failed with ${responseCode}`);
     // });
-    // Wait for 100 ms for libzmq to flush the message queue.
-
-    // sock.destroy();
+    // Give libzmq up to a second to deliver the message before closing.
+    await sock.close(1000);
 })(sock);
\ No newline at end of file